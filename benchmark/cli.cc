@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 #include <event.h>
 #include <stack>
 #include <vector>
@@ -10,6 +11,8 @@
 
 #include "qrpc/util/random.h"
 #include "qrpc/util/completion.h"
+#include "qrpc/util/cycles.h"
+#include "qrpc/rpc/stats.h"
 #include "qrpc/rpc/rpc.h"
 #include "echo.pb.h"
 
@@ -32,6 +35,13 @@ DEFINE_uint64(total_num, 10000, "The total number of requests for each channel")
 DEFINE_uint64(per_cons, 1, "The number of channels for each worker thread");
 DEFINE_uint64(per_reqs, 1, "The number of request for each channel to sending");
 
+DEFINE_string(mode, "closed", "The load mode (closed: per_reqs outstanding for each channel, open: sending at the offered rate)");
+DEFINE_double(rate, 10000, "The offered requests per second of all workers in open mode");
+DEFINE_string(arrival, "fixed", "The arrival of requests in open mode (fixed, poisson)");
+DEFINE_int32(duration, 10, "The seconds of sending requests for each offered load in open mode");
+DEFINE_string(sweep, "", "The comma separated offered loads to sweep in open mode, overriding rate");
+DEFINE_string(json, "", "The file to write the results in json, - for stdout");
+
 class Worker;
 
 string rpc_msg;
@@ -41,8 +51,7 @@ vector<Worker *> workers;
 vector<pthread_t> threads;
 
 struct Msg {
-    timeval start_time_;
-    timeval stop_time_;
+    uint64_t start_;
 
     EchoRequest request_;
     EchoResponse response_;
@@ -60,6 +69,7 @@ public:
 
     stack<Msg *> temps_;
     vector<Msg *> results_;
+    Histogram latency_;
 
     Channel *channel_;
     EchoService::Stub *stub_;
@@ -189,7 +199,7 @@ void Connection::Done(Msg *item)
     if (item->controller_->Failed()) {
         LOG(FATAL) << "RPC response error: " << item->controller_->ErrorText();
     } else {
-        gettimeofday(&item->stop_time_, NULL);
+        latency_.Add(rdtsc() - item->start_);
         results_.push_back(item);
         Run();
     }
@@ -208,10 +218,10 @@ void Connection::Run()
     Msg *item = temps_.top();
     temps_.pop();
 
+    item->start_ = rdtsc();
     stub_->Echo(item->controller_,
             &item->request_, &item->response_,
             qrpc::NewCallback(this, &Connection::Done, item));
-    gettimeofday(&item->start_time_, NULL);
 }
 
 void* worker_routine(void *arg)
@@ -250,41 +260,427 @@ uint64_t escape_us(timeval &start, timeval &stop)
     return end - fir;
 }
 
-uint64_t total_requests_time_us()
-{
-    uint64_t time = 0;
+// -------------------------------------------------------------
+// open loop: the requests are sent at the offered rate whatever
+// the responses are, and the latency is taken from the intended
+// sending time, so the requests queued behind a slow one aren't
+// hidden from the tail (coordinated omission).
+// -------------------------------------------------------------
 
-    for (size_t i = 0; i < workers.size(); ++i) {
-        Worker *w = workers[i];
+struct OpenMsg {
+    uint64_t intended_;
 
-        for (size_t j = 0; j < w->conns_.size(); ++j) {
-            Connection *c = w->conns_[j];
+    EchoRequest request_;
+    EchoResponse response_;
+
+    qrpc::Controller *controller_;
+
+    OpenMsg() : intended_(0), controller_(NULL) { }
+    ~OpenMsg() { delete controller_; }
+};
+
+class Pacer {
+public:
+    uint64_t sent_;
+    uint64_t ok_;
+    uint64_t failed_;
+    Histogram latency_;
+
+public:
+    Pacer(double rate, uint64_t seed)
+        : sent_(0)
+        , ok_(0)
+        , failed_(0)
+        , base_(NULL)
+        , timer_(NULL)
+        , next_stub_(0)
+        , gap_(cycles_per_usec() * 1000000 / rate)
+        , poisson_(FLAGS_arrival == "poisson")
+        , seed_(seed | 1)
+        , next_(0)
+        , stop_(0)
+    {
+        event_config *config = event_config_new();
+        if (!config) {
+            LOG(FATAL) << "new event config failed";
+        }
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+        /* the timer in microseconds (timerfd), not milliseconds */
+        event_config_set_flag(config, EVENT_BASE_FLAG_PRECISE_TIMER);
+#endif
+
+        base_ = event_base_new_with_config(config);
+        if (!base_) {
+            LOG(FATAL) << "new event base failed";
+        }
+
+        event_config_free(config);
+
+        timer_ = evtimer_new(base_, OnTimer, this);
+        if (!timer_) {
+            LOG(FATAL) << "new timer failed";
+        }
+    }
 
-            for (size_t k = 0; k < c->results_.size(); ++k) {
-                Msg *msg = c->results_[k];
+    ~Pacer()
+    {
+        for (size_t i = 0; i < stubs_.size(); ++i) {
+            delete stubs_[i];
+            delete channels_[i];
+        }
+
+        event_free(timer_);
+        event_base_free(base_);
+    }
+
+    /* send requests for the seconds, then wait for the responses */
+    void Run(uint64_t seconds)
+    {
+        for (uint64_t i = 0; i < FLAGS_per_cons; ++i) {
+            Channel *channel = NULL;
+
+            int rc = Channel::New(ChannelOptions(),
+                    FLAGS_host, FLAGS_port, base_, &channel);
+            if (rc) {
+                LOG(FATAL) << "alloc channel failed";
+            }
+
+            rc = channel->Open();
+            if (rc) {
+                LOG(FATAL) << "open channel failed";
+            }
 
-                time += escape_us(msg->start_time_, msg->stop_time_);
+            EchoService::Stub *stub = new EchoService::Stub(channel);
+            if (!stub) {
+                LOG(FATAL) << "alloc broker service stub failed";
             }
+
+            channels_.push_back(channel);
+            stubs_.push_back(stub);
         }
+
+        /* the workers start at a random phase, not in lockstep */
+        next_ = rdtsc() + (uint64_t)(gap_ * (NextRandom() >> 11) / (1ULL << 53));
+        stop_ = rdtsc() + usec_to_cycles(seconds * 1000000);
+
+        Tick();
+
+        event_base_loop(base_, 0);
+    }
+
+private:
+    static void OnTimer(int fd, short which, void *arg)
+    {
+        ((Pacer *)arg)->Tick();
     }
 
-    return time;
+    uint64_t NextRandom()
+    {
+        /* xorshift64, random() of util isn't thread safe */
+        seed_ ^= seed_ << 13;
+        seed_ ^= seed_ >> 7;
+        seed_ ^= seed_ << 17;
+        return seed_;
+    }
+
+    /* the cycles to the next request */
+    uint64_t NextGap()
+    {
+        if (!poisson_) {
+            return (uint64_t)gap_;
+        }
+
+        /* exponential interval, u is in (0, 1] */
+        double u = ((NextRandom() >> 11) + 1) / (double)(1ULL << 53);
+        return (uint64_t)(-log(u) * gap_);
+    }
+
+    /*
+     * Send the requests due, the timer may be late (in milliseconds
+     * without the precise timer), so a tick may send a burst, but
+     * each of them is still timed from its own intended time.
+     */
+    void Tick()
+    {
+        uint64_t now = rdtsc();
+
+        while (next_ <= now && next_ < stop_) {
+            Send(next_);
+            next_ += NextGap();
+        }
+
+        if (next_ >= stop_) {
+            Drained();
+            return;
+        }
+
+        uint64_t wait = cycles_to_usec(next_ - now);
+        timeval tv = { (time_t)(wait / 1000000), (suseconds_t)(wait % 1000000) };
+
+        if (evtimer_add(timer_, &tv)) {
+            LOG(FATAL) << "add timer failed";
+        }
+    }
+
+    void Send(uint64_t intended)
+    {
+        OpenMsg *item = new OpenMsg();
+        if (!item) {
+            LOG(FATAL) << "alloc message failed";
+        }
+
+        item->intended_ = intended;
+        item->request_.set_query(rpc_msg);
+
+        ControllerOptions options;
+        options.rpc_timeout = FLAGS_rpc_timeout;
+        options.compression = (CompressionType)FLAGS_compress;
+
+        int rc = Controller::New(options, &item->controller_);
+        if (rc) {
+            LOG(FATAL) << "alloc controller failed";
+        }
+
+        EchoService::Stub *stub = stubs_[next_stub_++ % stubs_.size()];
+
+        ++sent_;
+        stub->Echo(item->controller_,
+                &item->request_, &item->response_,
+                qrpc::NewCallback(this, &Pacer::Done, item));
+    }
+
+    void Done(OpenMsg *item)
+    {
+        /* the failures (mostly timeout) are the result of overload */
+        if (item->controller_->Failed()) {
+            ++failed_;
+        } else {
+            ++ok_;
+            latency_.Add(rdtsc() - item->intended_);
+        }
+        delete item;
+
+        if (next_ >= stop_) {
+            Drained();
+        }
+    }
+
+    void Drained()
+    {
+        if (ok_ + failed_ == sent_) {
+            event_base_loopbreak(base_);
+        }
+    }
+
+private:
+    event_base *base_;
+    event *timer_;
+
+    vector<Channel *> channels_;
+    vector<EchoService::Stub *> stubs_;
+    size_t next_stub_;
+
+    double gap_;            /* the mean cycles between requests */
+    bool poisson_;
+    uint64_t seed_;
+
+    uint64_t next_;         /* the intended time of next request */
+    uint64_t stop_;
+};
+
+void* pacer_routine(void *arg)
+{
+    Pacer *me = (Pacer *)arg;
+
+    me->Run(FLAGS_duration);
+
+    return NULL;
 }
 
-int main(int argc, char *argv[])
+// -------------------------------------------------------------
+// the results
+// -------------------------------------------------------------
+
+struct Result {
+    double offered;         /* requests per second, 0 in closed mode */
+    double seconds;
+    uint64_t sent;
+    uint64_t ok;
+    uint64_t failed;
+    Histogram latency;
+
+    Result() : offered(0), seconds(0), sent(0), ok(0), failed(0) { }
+
+    double throughput() const { return seconds > 0 ? ok / seconds : 0; }
+
+    double mean_us() const {
+        return ok ? cycles_to_nsec(latency.sum() / ok) / 1000.0 : 0;
+    }
+
+    double percentile_us(double p) const {
+        return cycles_to_nsec(latency.Percentile(p)) / 1000.0;
+    }
+
+    double max_us() const {
+        return cycles_to_nsec(latency.max()) / 1000.0;
+    }
+};
+
+Result run_open_loop(double rate)
 {
-    /* init argument */
-    ParseCommandLineFlags(&argc, &argv, false);
+    vector<Pacer *> pacers;
+    vector<pthread_t> tids;
 
-    /* init log prefix */
-    google::InitGoogleLogging("cli");
+    for (uint64_t i = 0; i < FLAGS_worker_num; i++) {
+        Pacer *pacer = new Pacer(rate / FLAGS_worker_num, random64());
+        if (!pacer) {
+            LOG(FATAL) << "alloc pacer failed";
+        }
+        pacers.push_back(pacer);
+    }
 
-    /* init random message */
-    for (int i = 0; i < FLAGS_msg_size; ++i) {
-        uint64_t c = random_range('a', 'z');
-        rpc_msg += (char)c;
+    timeval start, stop;
+    gettimeofday(&start, NULL);
+
+    for (uint64_t i = 0; i < FLAGS_worker_num; i++) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, pacer_routine, pacers[i]);
+        if (rc) {
+            exit(EXIT_FAILURE);
+        }
+        tids.push_back(tid);
+    }
+
+    for (uint64_t i = 0; i < FLAGS_worker_num; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    gettimeofday(&stop, NULL);
+
+    Result result;
+    result.offered = rate;
+    result.seconds = escape_us(start, stop) / 1000000.0;
+
+    for (uint64_t i = 0; i < FLAGS_worker_num; i++) {
+        result.sent += pacers[i]->sent_;
+        result.ok += pacers[i]->ok_;
+        result.failed += pacers[i]->failed_;
+        result.latency.Merge(pacers[i]->latency_);
+
+        delete pacers[i];
+    }
+
+    return result;
+}
+
+void print_open_loop(const Result &r, bool header)
+{
+    if (header) {
+        printf("%12s %12s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+               "offered", "throughput", "failed", "mean(us)", "p50(us)",
+               "p90(us)", "p99(us)", "p999(us)", "max(us)", "sent");
+    }
+
+    printf("%12.0f %12.0f %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10lu\n",
+           r.offered, r.throughput(), r.failed, r.mean_us(),
+           r.percentile_us(0.5), r.percentile_us(0.9), r.percentile_us(0.99),
+           r.percentile_us(0.999), r.max_us(), r.sent);
+}
+
+void write_json(const vector<Result> &results)
+{
+    FILE *out = stdout;
+
+    if (FLAGS_json != "-") {
+        out = fopen(FLAGS_json.c_str(), "w");
+        if (!out) {
+            LOG(FATAL) << "open " << FLAGS_json << " failed";
+        }
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"mode\": \"%s\",\n", FLAGS_mode.c_str());
+    fprintf(out, "  \"arrival\": \"%s\",\n", FLAGS_arrival.c_str());
+    fprintf(out, "  \"msg_size\": %d,\n", FLAGS_msg_size);
+    fprintf(out, "  \"compress\": %d,\n", FLAGS_compress);
+    fprintf(out, "  \"worker_num\": %lu,\n", FLAGS_worker_num);
+    fprintf(out, "  \"per_cons\": %lu,\n", FLAGS_per_cons);
+    fprintf(out, "  \"per_reqs\": %lu,\n", FLAGS_per_reqs);
+    fprintf(out, "  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+
+        fprintf(out, "    {\"offered\": %.0f, \"throughput\": %.1f, "
+                "\"seconds\": %.3f, \"sent\": %lu, \"ok\": %lu, \"failed\": %lu, "
+                "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+                "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+                r.offered, r.throughput(), r.seconds, r.sent, r.ok, r.failed,
+                r.mean_us(), r.percentile_us(0.5), r.percentile_us(0.9),
+                r.percentile_us(0.99), r.percentile_us(0.999), r.max_us(),
+                i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+}
+
+/* the offered loads of sweep, or the single rate */
+vector<double> offered_loads()
+{
+    vector<double> loads;
+
+    const char *p = FLAGS_sweep.c_str();
+    while (*p) {
+        char *end = NULL;
+        double rate = strtod(p, &end);
+        if (end == p || rate <= 0) {
+            LOG(FATAL) << "invalid sweep: " << FLAGS_sweep;
+        }
+        loads.push_back(rate);
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    if (loads.empty()) {
+        loads.push_back(FLAGS_rate);
+    }
+
+    return loads;
+}
+
+int open_loop_perf()
+{
+    if (FLAGS_arrival != "fixed" && FLAGS_arrival != "poisson") {
+        LOG(FATAL) << "invalid arrival: " << FLAGS_arrival;
+    }
+
+    vector<double> loads = offered_loads();
+    vector<Result> results;
+
+    for (size_t i = 0; i < loads.size(); ++i) {
+        results.push_back(run_open_loop(loads[i]));
+        print_open_loop(results.back(), i == 0);
+        fflush(stdout);
+    }
+
+    if (!FLAGS_json.empty()) {
+        write_json(results);
     }
 
+    return 0;
+}
+
+// -------------------------------------------------------------
+// closed loop
+// -------------------------------------------------------------
+
+int closed_loop_perf()
+{
     /* init worker threads */
     for (uint64_t i = 0; i < FLAGS_worker_num; i++) {
         Completion work(1);
@@ -319,26 +715,74 @@ int main(int argc, char *argv[])
     gettimeofday(&stop_time, NULL);
 
     /* stat the request */
+    Result result;
+    result.seconds = escape_us(start_time, stop_time) / 1000000.0;
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker *w = workers[i];
+
+        for (size_t j = 0; j < w->conns_.size(); ++j) {
+            result.latency.Merge(w->conns_[j]->latency_);
+        }
+    }
+    result.sent = result.ok = result.latency.count();
+
     uint64_t total_request = FLAGS_worker_num * FLAGS_per_cons * FLAGS_total_num;
-    uint64_t all_time = total_requests_time_us();
+    uint64_t all_time = cycles_to_usec(result.latency.sum());
     uint64_t total_time = escape_us(start_time, stop_time);
 
     printf("qps                  : %lu\n", total_request * 1000000 / total_time);
     printf("per request time(us) : %lu\n", all_time / total_request);
+    printf("p50 time(us)         : %.1f\n", result.percentile_us(0.5));
+    printf("p90 time(us)         : %.1f\n", result.percentile_us(0.9));
+    printf("p99 time(us)         : %.1f\n", result.percentile_us(0.99));
+    printf("p999 time(us)        : %.1f\n", result.percentile_us(0.999));
+    printf("max time(us)         : %.1f\n", result.max_us());
     printf("total request        : %lu\n", total_request);
     printf("total time(us)       : %lu\n", total_time);
     printf("all request time(us) : %lu\n", all_time);
     printf("total thread         : %lu\n", FLAGS_worker_num);
     printf("total connection     : %lu\n", FLAGS_worker_num * FLAGS_per_cons);
 
+    if (!FLAGS_json.empty()) {
+        write_json(vector<Result>(1, result));
+    }
+
     /* release workers */
     for (uint64_t i = 0; i < FLAGS_worker_num; i++) {
         delete workers[i];
     }
 
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    /* init argument */
+    ParseCommandLineFlags(&argc, &argv, false);
+
+    /* init log prefix */
+    google::InitGoogleLogging("cli");
+
+    /* init random message */
+    for (int i = 0; i < FLAGS_msg_size; ++i) {
+        uint64_t c = random_range('a', 'z');
+        rpc_msg += (char)c;
+    }
+
+    int rc = 0;
+
+    if (FLAGS_mode == "open") {
+        rc = open_loop_perf();
+    } else if (FLAGS_mode == "closed") {
+        rc = closed_loop_perf();
+    } else {
+        LOG(FATAL) << "invalid mode: " << FLAGS_mode;
+    }
+
     ShutdownProtobufLibrary();
     ShutdownGoogleLogging();
     ShutDownCommandLineFlags();
 
-    return 0;
+    return rc;
 }
@@ -0,0 +1,644 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <event.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "qrpc/util/random.h"
+#include "qrpc/util/cycles.h"
+#include "qrpc/rpc/stats.h"
+#include "qrpc/rpc/rpc.h"
+#include "echo.pb.h"
+
+using namespace std;
+using namespace qrpc;
+using namespace test;
+using namespace GFLAGS_NAMESPACE;
+
+DEFINE_string(transports, "tcp,unix", "The comma separated transports (tcp, unix)");
+DEFINE_string(workers, "1,2,4", "The comma separated worker threads of server");
+DEFINE_string(conns, "1,4,16", "The comma separated channels of all client threads");
+DEFINE_string(depths, "1,8,32", "The comma separated outstanding requests of each channel");
+DEFINE_string(sizes, "64,4096", "The comma separated sizes in bytes of request and response");
+DEFINE_string(codecs, "none,lz4", "The comma separated codecs (none, zlib, lz4, snappy)");
+
+DEFINE_int32(client_threads, 2, "The client threads, the channels are spread over them");
+DEFINE_int32(duration, 2000, "The milliseconds of measuring each point");
+DEFINE_int32(warmup, 200, "The milliseconds before measuring each point");
+DEFINE_int32(port, 44444, "The tcp port of the in-process server");
+DEFINE_bool(pin, true, "Pin the client threads and the server workers to separate cpus");
+
+DEFINE_string(csv, "", "The file to write the matrix in csv, - for stdout");
+DEFINE_string(json, "", "The file to write the matrix in json, - for stdout");
+
+const char *codec_names[] = { "none", "zlib", "lz4", "snappy" };
+
+/* a point of the matrix */
+struct Point {
+    string transport;
+    int workers;
+    int conns;
+    int depth;
+    int size;
+    int codec;
+};
+
+struct Result {
+    Point point;
+    double seconds;
+    uint64_t ok;
+    uint64_t failed;
+    Histogram latency;
+
+    Result() : seconds(0), ok(0), failed(0) { }
+
+    double qps() const { return seconds > 0 ? ok / seconds : 0; }
+
+    /* the payload of requests and responses */
+    double mb_per_sec() const { return qps() * point.size * 2 / 1000000; }
+
+    double mean_us() const {
+        return ok ? cycles_to_nsec(latency.sum() / ok) / 1000.0 : 0;
+    }
+
+    double percentile_us(double p) const {
+        return cycles_to_nsec(latency.Percentile(p)) / 1000.0;
+    }
+
+    double max_us() const {
+        return cycles_to_nsec(latency.max()) / 1000.0;
+    }
+};
+
+class EchoServiceImpl : public EchoService {
+public:
+    virtual void Echo(google::protobuf::RpcController *controller,
+                      const EchoRequest *request,
+                      EchoResponse *response,
+                      google::protobuf::Closure *done) {
+        response->set_result(request->query());
+        done->Run();
+    }
+};
+
+// -------------------------------------------------------------
+// the client threads, each channel keeps depth requests outstanding
+// -------------------------------------------------------------
+
+class Client;
+
+struct Call {
+    Client *client_;
+    EchoService::Stub *stub_;
+
+    uint64_t start_;
+    EchoRequest request_;
+    EchoResponse response_;
+
+    qrpc::Controller *controller_;
+
+    Call() : client_(NULL), stub_(NULL), start_(0), controller_(NULL) { }
+    ~Call() { delete controller_; }
+};
+
+class Client {
+public:
+    uint64_t ok_;
+    uint64_t failed_;
+    Histogram latency_;
+
+public:
+    Client(const Point &point, const string &host, int conns, int cpu)
+        : ok_(0)
+        , failed_(0)
+        , point_(point)
+        , host_(host)
+        , conns_(conns)
+        , cpu_(cpu)
+        , base_(NULL)
+        , inflight_(0)
+        , measure_(0)
+        , stop_(0)
+    {
+    }
+
+    ~Client()
+    {
+        for (size_t i = 0; i < calls_.size(); ++i) {
+            delete calls_[i];
+        }
+        for (size_t i = 0; i < stubs_.size(); ++i) {
+            delete stubs_[i];
+            delete channels_[i];
+        }
+        if (base_) {
+            event_base_free(base_);
+        }
+    }
+
+    void Run(const string &payload)
+    {
+        if (cpu_ >= 0) {
+            pin_thread(cpu_);
+        }
+
+        base_ = event_base_new();
+        if (!base_) {
+            LOG(FATAL) << "new event base failed";
+        }
+
+        for (int i = 0; i < conns_; ++i) {
+            Channel *channel = NULL;
+
+            int rc = Channel::New(ChannelOptions(),
+                    host_, FLAGS_port, base_, &channel);
+            if (rc) {
+                LOG(FATAL) << "alloc channel failed";
+            }
+
+            rc = channel->Open();
+            if (rc) {
+                LOG(FATAL) << "open channel failed";
+            }
+
+            EchoService::Stub *stub = new EchoService::Stub(channel);
+            if (!stub) {
+                LOG(FATAL) << "alloc echo service stub failed";
+            }
+
+            channels_.push_back(channel);
+            stubs_.push_back(stub);
+
+            for (int j = 0; j < point_.depth; ++j) {
+                Call *call = new Call();
+                if (!call) {
+                    LOG(FATAL) << "alloc call failed";
+                }
+
+                ControllerOptions options;
+                options.compression = (CompressionType)point_.codec;
+
+                rc = Controller::New(options, &call->controller_);
+                if (rc) {
+                    LOG(FATAL) << "alloc controller failed";
+                }
+
+                call->client_ = this;
+                call->stub_ = stub;
+                call->request_.set_query(payload);
+
+                calls_.push_back(call);
+            }
+        }
+
+        uint64_t now = rdtsc();
+        measure_ = now + usec_to_cycles(FLAGS_warmup * 1000);
+        stop_ = measure_ + usec_to_cycles(FLAGS_duration * 1000);
+
+        for (size_t i = 0; i < calls_.size(); ++i) {
+            Send(calls_[i]);
+        }
+
+        event_base_loop(base_, 0);
+    }
+
+    static void pin_thread(int cpu)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            LOG(WARNING) << "pin thread to cpu " << cpu << " failed";
+        }
+    }
+
+private:
+    void Send(Call *call)
+    {
+        ++inflight_;
+
+        call->start_ = rdtsc();
+        call->stub_->Echo(call->controller_,
+                &call->request_, &call->response_,
+                qrpc::NewCallback(this, &Client::Done, call));
+    }
+
+    void Done(Call *call)
+    {
+        uint64_t now = rdtsc();
+
+        --inflight_;
+
+        if (now >= measure_ && call->start_ < stop_) {
+            if (call->controller_->Failed()) {
+                ++failed_;
+            } else {
+                ++ok_;
+                latency_.Add(now - call->start_);
+            }
+        }
+
+        if (now < stop_) {
+            call->controller_->Reset();
+            Send(call);
+        } else if (!inflight_) {
+            event_base_loopbreak(base_);
+        }
+    }
+
+private:
+    Point point_;
+    string host_;
+    int conns_;
+    int cpu_;
+
+    event_base *base_;
+    vector<Channel *> channels_;
+    vector<EchoService::Stub *> stubs_;
+    vector<Call *> calls_;
+
+    uint64_t inflight_;
+    uint64_t measure_;
+    uint64_t stop_;
+};
+
+struct ClientArg {
+    Client *client;
+    const string *payload;
+};
+
+void* client_routine(void *arg)
+{
+    ClientArg *me = (ClientArg *)arg;
+
+    me->client->Run(*me->payload);
+
+    return NULL;
+}
+
+// -------------------------------------------------------------
+// the matrix
+// -------------------------------------------------------------
+
+/*
+ * The cpus of the server workers and the clients, the clients take
+ * the last cpus, the workers inherit the mask set before starting
+ * the server. Returns false if there aren't enough cpus.
+ */
+bool split_cpus(int clients, cpu_set_t *server, vector<int> *client_cpus)
+{
+    cpu_set_t online;
+    if (sched_getaffinity(0, sizeof(online), &online)) {
+        return false;
+    }
+
+    vector<int> cpus;
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &online)) {
+            cpus.push_back(i);
+        }
+    }
+
+    if ((int)cpus.size() <= clients) {
+        return false;
+    }
+
+    CPU_ZERO(server);
+    for (size_t i = 0; i < cpus.size() - clients; ++i) {
+        CPU_SET(cpus[i], server);
+    }
+    for (size_t i = cpus.size() - clients; i < cpus.size(); ++i) {
+        client_cpus->push_back(cpus[i]);
+    }
+
+    return true;
+}
+
+Result run_point(const Point &point, const string &unix_path)
+{
+    ServerOptions options;
+    options.num_worker_thread = point.workers;
+
+    cpu_set_t saved, server_cpus;
+    vector<int> client_cpus;
+    bool pin = FLAGS_pin && split_cpus(FLAGS_client_threads, &server_cpus, &client_cpus);
+
+    /* the workers inherit the affinity of this thread */
+    if (pin) {
+        sched_getaffinity(0, sizeof(saved), &saved);
+        sched_setaffinity(0, sizeof(server_cpus), &server_cpus);
+    }
+
+    Server *server = NULL;
+    int rc = Server::New(options, NULL, &server);
+    if (rc) {
+        LOG(FATAL) << "new server failed";
+    }
+
+    rc = server->Register(new EchoServiceImpl(), kServerOwnsService);
+    if (rc) {
+        LOG(FATAL) << "register service failed";
+    }
+
+    rc = server->SetResponseCompression("test.EchoService.Echo",
+                                        (CompressionType)point.codec);
+    if (rc) {
+        LOG(FATAL) << "set response compression failed";
+    }
+
+    string host = "127.0.0.1";
+    if (point.transport == "unix") {
+        host = "unix:" + unix_path;
+        rc = server->Add(host, 0);
+    } else {
+        rc = server->Add(host, FLAGS_port);
+    }
+    if (rc) {
+        LOG(FATAL) << "add endpoint failed: " << host;
+    }
+
+    rc = server->Start();
+    if (rc) {
+        LOG(FATAL) << "start server failed";
+    }
+
+    if (pin) {
+        sched_setaffinity(0, sizeof(saved), &saved);
+    }
+
+    /* the random letters as the request of cli */
+    string payload;
+    for (int i = 0; i < point.size; ++i) {
+        payload += (char)random_range('a', 'z');
+    }
+
+    vector<Client *> clients;
+    vector<ClientArg> args(FLAGS_client_threads);
+    vector<pthread_t> tids;
+
+    for (int i = 0; i < FLAGS_client_threads; ++i) {
+        /* spread the channels, the first threads take the remainder */
+        int conns = point.conns / FLAGS_client_threads
+                  + (i < point.conns % FLAGS_client_threads ? 1 : 0);
+        if (!conns) {
+            continue;
+        }
+
+        Client *client = new Client(point, host, conns,
+                                    pin ? client_cpus[i] : -1);
+        if (!client) {
+            LOG(FATAL) << "alloc client failed";
+        }
+        clients.push_back(client);
+
+        args[i].client = client;
+        args[i].payload = &payload;
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, client_routine, &args[i])) {
+            LOG(FATAL) << "create client thread failed";
+        }
+        tids.push_back(tid);
+    }
+
+    for (size_t i = 0; i < tids.size(); ++i) {
+        pthread_join(tids[i], NULL);
+    }
+
+    Result result;
+    result.point = point;
+    result.seconds = FLAGS_duration / 1000.0;
+
+    for (size_t i = 0; i < clients.size(); ++i) {
+        result.ok += clients[i]->ok_;
+        result.failed += clients[i]->failed_;
+        result.latency.Merge(clients[i]->latency_);
+
+        delete clients[i];
+    }
+
+    delete server;
+
+    return result;
+}
+
+vector<string> parse_names(const string &flag)
+{
+    vector<string> names;
+
+    size_t start = 0;
+    while (start < flag.size()) {
+        size_t end = flag.find(',', start);
+        if (end == string::npos) {
+            end = flag.size();
+        }
+        if (end > start) {
+            names.push_back(flag.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+
+    return names;
+}
+
+vector<int> parse_list(const string &flag)
+{
+    vector<string> names = parse_names(flag);
+    vector<int> list;
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        int value = atoi(names[i].c_str());
+        if (value <= 0) {
+            LOG(FATAL) << "invalid list: " << flag;
+        }
+        list.push_back(value);
+    }
+
+    return list;
+}
+
+int parse_codec(const string &name)
+{
+    for (int i = 0; i < 4; ++i) {
+        if (name == codec_names[i]) {
+            return i;
+        }
+    }
+
+    LOG(FATAL) << "invalid codec: " << name;
+    return 0;
+}
+
+vector<Point> new_points()
+{
+    vector<string> transports = parse_names(FLAGS_transports);
+    vector<int> workers = parse_list(FLAGS_workers);
+    vector<int> conns = parse_list(FLAGS_conns);
+    vector<int> depths = parse_list(FLAGS_depths);
+    vector<int> sizes = parse_list(FLAGS_sizes);
+    vector<string> codecs = parse_names(FLAGS_codecs);
+
+    for (size_t t = 0; t < transports.size(); ++t) {
+        if (transports[t] != "tcp" && transports[t] != "unix") {
+            LOG(FATAL) << "invalid transport: " << transports[t];
+        }
+    }
+
+    size_t total = transports.size() * workers.size() * conns.size()
+                 * depths.size() * sizes.size() * codecs.size();
+
+    vector<Point> points;
+
+    /* the last dimension changes fastest */
+    for (size_t i = 0; i < total; ++i) {
+        size_t n = i;
+        Point point;
+
+        point.codec = parse_codec(codecs[n % codecs.size()]);
+        n /= codecs.size();
+        point.size = sizes[n % sizes.size()];
+        n /= sizes.size();
+        point.depth = depths[n % depths.size()];
+        n /= depths.size();
+        point.conns = conns[n % conns.size()];
+        n /= conns.size();
+        point.workers = workers[n % workers.size()];
+        n /= workers.size();
+        point.transport = transports[n];
+
+        points.push_back(point);
+    }
+
+    return points;
+}
+
+FILE* open_output(const string &path)
+{
+    if (path == "-") {
+        return stdout;
+    }
+
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) {
+        LOG(FATAL) << "open " << path << " failed";
+    }
+
+    return out;
+}
+
+void close_output(FILE *out)
+{
+    if (out != stdout) {
+        fclose(out);
+    }
+}
+
+void write_csv(const vector<Result> &results)
+{
+    FILE *out = open_output(FLAGS_csv);
+
+    fprintf(out, "transport,workers,conns,depth,size,codec,qps,mb_per_sec,"
+            "failed,mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        const Point &p = r.point;
+
+        fprintf(out, "%s,%d,%d,%d,%d,%s,%.0f,%.1f,%lu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                p.transport.c_str(), p.workers, p.conns, p.depth, p.size,
+                codec_names[p.codec], r.qps(), r.mb_per_sec(), r.failed,
+                r.mean_us(), r.percentile_us(0.5), r.percentile_us(0.9),
+                r.percentile_us(0.99), r.percentile_us(0.999), r.max_us());
+    }
+
+    close_output(out);
+}
+
+void write_json(const vector<Result> &results)
+{
+    FILE *out = open_output(FLAGS_json);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"client_threads\": %d,\n", FLAGS_client_threads);
+    fprintf(out, "  \"duration_ms\": %d,\n", FLAGS_duration);
+    fprintf(out, "  \"pin\": %s,\n", FLAGS_pin ? "true" : "false");
+    fprintf(out, "  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        const Point &p = r.point;
+
+        fprintf(out, "    {\"transport\": \"%s\", \"workers\": %d, "
+                "\"conns\": %d, \"depth\": %d, \"size\": %d, \"codec\": \"%s\", "
+                "\"qps\": %.0f, \"mb_per_sec\": %.1f, \"failed\": %lu, "
+                "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+                "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+                p.transport.c_str(), p.workers, p.conns, p.depth, p.size,
+                codec_names[p.codec], r.qps(), r.mb_per_sec(), r.failed,
+                r.mean_us(), r.percentile_us(0.5), r.percentile_us(0.9),
+                r.percentile_us(0.99), r.percentile_us(0.999), r.max_us(),
+                i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    close_output(out);
+}
+
+int main(int argc, char *argv[])
+{
+    /* init argument */
+    ParseCommandLineFlags(&argc, &argv, false);
+
+    /* init log prefix */
+    google::InitGoogleLogging("e2e");
+
+    if (FLAGS_client_threads <= 0) {
+        LOG(FATAL) << "invalid client threads: " << FLAGS_client_threads;
+    }
+
+    char unix_path[64];
+    snprintf(unix_path, sizeof(unix_path), "/tmp/qrpc_e2e_%d.sock", getpid());
+
+    vector<Point> points = new_points();
+    vector<Result> results;
+
+    printf("%-9s %7s %5s %5s %7s %6s %10s %9s %7s %9s %9s %9s %9s\n",
+           "transport", "workers", "conns", "depth", "size", "codec",
+           "qps", "MB/s", "failed", "mean(us)", "p50(us)", "p99(us)", "max(us)");
+
+    for (size_t i = 0; i < points.size(); ++i) {
+        results.push_back(run_point(points[i], unix_path));
+
+        const Result &r = results.back();
+        const Point &p = r.point;
+
+        printf("%-9s %7d %5d %5d %7d %6s %10.0f %9.1f %7lu %9.1f %9.1f %9.1f %9.1f\n",
+               p.transport.c_str(), p.workers, p.conns, p.depth, p.size,
+               codec_names[p.codec], r.qps(), r.mb_per_sec(), r.failed,
+               r.mean_us(), r.percentile_us(0.5), r.percentile_us(0.99),
+               r.max_us());
+        fflush(stdout);
+    }
+
+    if (!FLAGS_csv.empty()) {
+        write_csv(results);
+    }
+    if (!FLAGS_json.empty()) {
+        write_json(results);
+    }
+
+    google::protobuf::ShutdownProtobufLibrary();
+    google::ShutdownGoogleLogging();
+    ShutDownCommandLineFlags();
+
+    return 0;
+}
@@ -0,0 +1,704 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <event.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "qrpc/util/random.h"
+#include "qrpc/util/cycles.h"
+#include "qrpc/util/completion.h"
+#include "qrpc/util/task.h"
+#include "qrpc/util/timer.h"
+#include "qrpc/util/event_queue.h"
+#include "qrpc/rpc/rpc.h"
+#include "qrpc/rpc/controller_client.h"
+#include "qrpc/rpc/controller_server.h"
+#include "qrpc/rpc/message.h"
+#include "qrpc/rpc/message.pb.h"
+#include "qrpc/rpc/compressor.h"
+#include "qrpc/rpc/connection.h"
+#include "qrpc/rpc/builtin.h"
+#include "qrpc/rpc/server_impl.h"
+#include "echo.pb.h"
+
+using namespace std;
+using namespace qrpc;
+using namespace test;
+using namespace GFLAGS_NAMESPACE;
+
+DEFINE_string(filter, "", "Run the benchmarks whose name contains the string");
+DEFINE_string(sizes, "64,1024,16384,262144", "The comma separated message sizes in bytes");
+DEFINE_string(producers, "1,2,4", "The comma separated producer threads of EvQueue");
+DEFINE_int32(min_time, 200, "The minimum milliseconds of each repetition");
+DEFINE_int32(repeat, 5, "The repetitions of each benchmark, the median is reported");
+DEFINE_string(json, "", "The file to write the results in json, - for stdout");
+
+/*
+ * A benchmark runs the operation for the iterations, Run() is
+ * called repeatedly with the iterations scaled to min_time.
+ */
+class Bench {
+public:
+    string name_;
+    uint64_t bytes_;        /* bytes of each operation, 0 if not a stream */
+
+public:
+    explicit Bench(const string &name) : name_(name), bytes_(0) { }
+    virtual ~Bench() { }
+
+    virtual void Run(uint64_t iters) = 0;
+};
+
+struct Result {
+    string name;
+    uint64_t iters;
+    double median_ns;
+    double min_ns;
+    double mb_per_sec;
+};
+
+vector<int> sizes;
+vector<int> producers;
+
+const CompressionType codecs[] = {
+    kNoCompression, kZlibCompression, kLz4Compression, kSnappyCompression,
+};
+const char* codec_names[] = { "none", "zlib", "lz4", "snappy" };
+
+string name_of(const char *bench, const char *arg, int size)
+{
+    char name[128];
+
+    if (arg) {
+        snprintf(name, sizeof(name), "%s/%s/%d", bench, arg, size);
+    } else {
+        snprintf(name, sizeof(name), "%s/%d", bench, size);
+    }
+
+    return name;
+}
+
+/* the text compressed about as the real payload, not random bytes */
+string new_payload(int size)
+{
+    static const char *words[] = {
+        "qrpc", "service", "method", "request", "response", "channel",
+        "server", "worker", "timeout", "sequence", "payload", "echo",
+    };
+
+    string payload;
+
+    while ((int)payload.size() < size) {
+        payload += words[random_range(0, sizeof(words) / sizeof(words[0]) - 1)];
+        payload += (char)random_range('a', 'z');
+        payload += ' ';
+    }
+    payload.resize(size);
+
+    return payload;
+}
+
+/* the meta of request as sent by the channel */
+void new_request_meta(MsgMeta *meta)
+{
+    meta->set_sequence(123456789);
+    meta->set_service("test.EchoService");
+    meta->set_method("Echo");
+    meta->set_compression_type(kLz4Compression);
+    meta->set_accept_compression(kAcceptCompression);
+    meta->set_trace_id(random64());
+    meta->set_span_id(random64());
+    meta->set_parent_span(random64());
+    meta->set_sampled(true);
+}
+
+/* the meta of failed response */
+void new_response_meta(MsgMeta *meta)
+{
+    meta->set_sequence(123456789);
+    meta->set_code(1);
+    meta->set_error_text("the rpc is timeout");
+    meta->set_server_queue_ns(12345);
+    meta->set_server_handler_ns(67890);
+}
+
+// -------------------------------------------------------------
+// framing: Connection::Encode/Decode without socket
+// -------------------------------------------------------------
+
+class BenchMessage : public Message {
+public:
+    BenchMessage(::qrpc::CompressionType comp, int size)
+        : comp_(comp), data_(new_payload(size)) {
+        new_request_meta(&meta_);
+    }
+
+    virtual int CompressionType() const { return comp_; }
+
+    virtual void ByteSize(int *smeta, int *sdata) const {
+        *smeta = meta_.ByteSize();
+        *sdata = data_.size();
+    }
+
+    virtual bool SerializeToArray(char *data, int len) const {
+        uint8_t *brk = meta_.SerializeWithCachedSizesToArray((uint8_t *)data);
+        memcpy(brk, data_.data(), data_.size());
+        return true;
+    }
+
+    virtual bool ParseFromArray(const char *data, int len, const MsgMeta &meta) {
+        return true;
+    }
+
+private:
+    ::qrpc::CompressionType comp_;
+    MsgMeta meta_;
+    string data_;
+};
+
+class BenchConnection : public Connection {
+public:
+    BenchConnection() {
+        rsize_ = wsize_ = 4096;
+
+        rcur_ = rbuf_ = (char *)malloc(rsize_);
+        if (!rbuf_) {
+            LOG(FATAL) << "alloc read buf failed";
+        }
+
+        char *wbuf = (char *)malloc(wsize_);
+        if (!wbuf) {
+            LOG(FATAL) << "alloc write buf failed";
+        }
+        AssignWbuf(wbuf);
+
+        compressor_ = new Compressor();
+        if (!compressor_) {
+            LOG(FATAL) << "alloc compressor failed";
+        }
+    }
+
+    virtual ~BenchConnection() { delete compressor_; }
+
+    void Encode(Message *msg) {
+        wmsg_ = msg;
+        if (Connection::Encode() != kEncodeOk) {
+            LOG(FATAL) << "encode failed";
+        }
+    }
+
+    /* the frame of the last encoded message */
+    const char* frame() const { return wcur_; }
+    int frame_size() const { return wbytes_; }
+
+    /* place the frame into the read buf */
+    void Load(const char *frame, int size) {
+        if (size > rsize_) {
+            rsize_ = size;
+            rcur_ = rbuf_ = (char *)realloc(rbuf_, rsize_);
+            if (!rbuf_) {
+                LOG(FATAL) << "realloc read buf failed";
+            }
+        }
+        memcpy(rbuf_, frame, size);
+        rbytes_ = size;
+    }
+
+    void Decode(int size) {
+        rcur_ = rbuf_;
+        rbytes_ = size;
+        rmsg_hdr_ = MsgHdr();
+
+        if (Connection::Decode() != kDecodeOk) {
+            LOG(FATAL) << "decode failed";
+        }
+    }
+
+protected:
+    virtual void SendFail() { }
+    virtual void RecvFail() { }
+    virtual void SendDone(Message *msg) { }
+    virtual bool SendNext(Message **msg) { return false; }
+    virtual bool RecvDone(const char *payload, int meta, int data) { return true; }
+};
+
+class EncodeBench : public Bench {
+public:
+    EncodeBench(int codec, int size)
+        : Bench(name_of("encode", codec_names[codec], size))
+        , msg_(codecs[codec], size) {
+        bytes_ = size;
+    }
+
+    virtual void Run(uint64_t iters) {
+        for (uint64_t i = 0; i < iters; ++i) {
+            conn_.Encode(&msg_);
+        }
+    }
+
+private:
+    BenchMessage msg_;
+    BenchConnection conn_;
+};
+
+class DecodeBench : public Bench {
+public:
+    DecodeBench(int codec, int size)
+        : Bench(name_of("decode", codec_names[codec], size))
+        , msg_(codecs[codec], size) {
+        bytes_ = size;
+
+        conn_.Encode(&msg_);
+        size_ = conn_.frame_size();
+        conn_.Load(conn_.frame(), size_);
+    }
+
+    virtual void Run(uint64_t iters) {
+        for (uint64_t i = 0; i < iters; ++i) {
+            conn_.Decode(size_);
+        }
+    }
+
+private:
+    int size_;
+    BenchMessage msg_;
+    BenchConnection conn_;
+};
+
+// -------------------------------------------------------------
+// Compressor
+// -------------------------------------------------------------
+
+class CompressBench : public Bench {
+public:
+    CompressBench(int codec, int size, bool uncompress)
+        : Bench(name_of(uncompress ? "uncompress" : "compress",
+                        codec_names[codec], size))
+        , uncompress_(uncompress)
+        , input_(new_payload(size))
+        , output_(size * 2 + 1024) {
+        bytes_ = size;
+        comp_.UseCompression(codecs[codec]);
+
+        size_t rlen = 0;
+        if (comp_.Compress(input_.data(), input_.size(),
+                           &output_[0], output_.size(), &rlen) != kCompOk) {
+            LOG(FATAL) << "compress failed";
+        }
+        compressed_.assign(&output_[0], rlen);
+    }
+
+    virtual void Run(uint64_t iters) {
+        size_t rlen = 0;
+        int rc = kCompOk;
+
+        for (uint64_t i = 0; i < iters; ++i) {
+            if (uncompress_) {
+                rc |= comp_.Uncompress(compressed_.data(), compressed_.size(),
+                                       &output_[0], input_.size(), &rlen);
+            } else {
+                rc |= comp_.Compress(input_.data(), input_.size(),
+                                     &output_[0], output_.size(), &rlen);
+            }
+        }
+
+        if (rc != kCompOk) {
+            LOG(FATAL) << "compressor failed: " << name_;
+        }
+    }
+
+private:
+    bool uncompress_;
+    string input_;
+    string compressed_;
+    vector<char> output_;
+    Compressor comp_;
+};
+
+// -------------------------------------------------------------
+// MsgMeta
+// -------------------------------------------------------------
+
+class MetaParseBench : public Bench {
+public:
+    explicit MetaParseBench(bool request)
+        : Bench(request ? "msgmeta_parse/request" : "msgmeta_parse/response") {
+        MsgMeta meta;
+        if (request) {
+            new_request_meta(&meta);
+        } else {
+            new_response_meta(&meta);
+        }
+        meta.SerializeToString(&data_);
+    }
+
+    virtual void Run(uint64_t iters) {
+        MsgMeta meta;
+
+        for (uint64_t i = 0; i < iters; ++i) {
+            if (!meta.ParseFromArray(data_.data(), data_.size())) {
+                LOG(FATAL) << "parse meta failed";
+            }
+        }
+    }
+
+private:
+    string data_;
+};
+
+// -------------------------------------------------------------
+// EvQueue: the producers push, the loop thread drains
+// -------------------------------------------------------------
+
+class CountTask : public Task {
+public:
+    CountTask() : base_(NULL), count_(0), target_(0) { }
+
+    virtual void Quit() { }
+
+    virtual void operator()() {
+        if (++count_ == target_) {
+            event_base_loopbreak(base_);
+        }
+    }
+
+    event_base *base_;
+    uint64_t count_;
+    uint64_t target_;
+};
+
+class EvQueueBench : public Bench {
+public:
+    explicit EvQueueBench(int producers)
+        : Bench(name_of("evqueue_push_drain", NULL, producers))
+        , producers_(producers)
+        , iters_(0)
+        , start_(NULL) {
+        base_ = event_base_new();
+        if (!base_) {
+            LOG(FATAL) << "new event base failed";
+        }
+
+        queue_ = new EvQueue(base_);
+        if (!queue_) {
+            LOG(FATAL) << "new event queue failed";
+        }
+        task_.base_ = base_;
+    }
+
+    virtual ~EvQueueBench() {
+        delete queue_;
+        event_base_free(base_);
+    }
+
+    virtual void Run(uint64_t iters) {
+        Completion start(1);
+        vector<pthread_t> tids;
+
+        iters_ = (iters + producers_ - 1) / producers_;
+        start_ = &start;
+
+        task_.count_ = 0;
+        task_.target_ = iters_ * producers_;
+
+        for (int i = 0; i < producers_; ++i) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, Produce, this)) {
+                LOG(FATAL) << "create producer failed";
+            }
+            tids.push_back(tid);
+        }
+
+        start.SignalAll();
+        event_base_loop(base_, 0);
+
+        for (int i = 0; i < producers_; ++i) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+
+private:
+    static void* Produce(void *arg) {
+        EvQueueBench *me = (EvQueueBench *)arg;
+
+        me->start_->Wait();
+
+        for (uint64_t i = 0; i < me->iters_; ++i) {
+            me->queue_->Push(&me->task_);
+        }
+
+        return NULL;
+    }
+
+private:
+    int producers_;
+    uint64_t iters_;
+    Completion *start_;
+
+    CountTask task_;
+    EvQueue *queue_;
+    event_base *base_;
+};
+
+// -------------------------------------------------------------
+// Timer
+// -------------------------------------------------------------
+
+void nop_handle() { }
+
+class TimerBench : public Bench {
+public:
+    TimerBench() : Bench("timer_arm_cancel") {
+        base_ = event_base_new();
+        if (!base_) {
+            LOG(FATAL) << "new event base failed";
+        }
+        timer_.Set(base_, 10000, nop_handle);
+    }
+
+    virtual ~TimerBench() { event_base_free(base_); }
+
+    virtual void Run(uint64_t iters) {
+        for (uint64_t i = 0; i < iters; ++i) {
+            timer_.SchedOneshot();
+            timer_.SchedCancel();
+        }
+    }
+
+private:
+    Timer timer_;
+    event_base *base_;
+};
+
+// -------------------------------------------------------------
+// ServerImpl::Find
+// -------------------------------------------------------------
+
+class EchoServiceImpl : public EchoService {
+public:
+    virtual void Echo(google::protobuf::RpcController *controller,
+                      const EchoRequest *request,
+                      EchoResponse *response,
+                      google::protobuf::Closure *done) {
+        done->Run();
+    }
+};
+
+class FindBench : public Bench {
+public:
+    FindBench() : Bench("server_find"), server_(NULL) {
+        base_ = event_base_new();
+        if (!base_) {
+            LOG(FATAL) << "new event base failed";
+        }
+
+        int rc = Server::New(ServerOptions(), base_, &server_);
+        if (rc) {
+            LOG(FATAL) << "new server failed";
+        }
+
+        rc = server_->Register(new EchoServiceImpl(), kServerOwnsService);
+        if (rc) {
+            LOG(FATAL) << "register service failed";
+        }
+
+        new_request_meta(&meta_);
+    }
+
+    virtual ~FindBench() {
+        delete server_;
+        event_base_free(base_);
+    }
+
+    virtual void Run(uint64_t iters) {
+        ServerImpl *impl = (ServerImpl *)server_;
+
+        for (uint64_t i = 0; i < iters; ++i) {
+            if (!impl->Find(meta_)) {
+                LOG(FATAL) << "service not found";
+            }
+        }
+    }
+
+private:
+    Server *server_;
+    MsgMeta meta_;
+    event_base *base_;
+};
+
+// -------------------------------------------------------------
+// the runner
+// -------------------------------------------------------------
+
+double run_ns(Bench *bench, uint64_t iters)
+{
+    uint64_t start = rdtsc();
+    bench->Run(iters);
+    return cycles_to_nsec(rdtsc() - start);
+}
+
+Result measure(Bench *bench)
+{
+    double min_ns = FLAGS_min_time * 1000000.0;
+
+    /* grow the iterations until a run takes a tenth of min_time */
+    uint64_t iters = 1;
+    double ns = run_ns(bench, iters);
+
+    while (ns < min_ns / 10) {
+        iters *= 10;
+        ns = run_ns(bench, iters);
+    }
+
+    iters = (uint64_t)(iters * min_ns / ns) + 1;
+
+    vector<double> per_op;
+    for (int i = 0; i < FLAGS_repeat; ++i) {
+        per_op.push_back(run_ns(bench, iters) / iters);
+    }
+    sort(per_op.begin(), per_op.end());
+
+    Result result;
+    result.name = bench->name_;
+    result.iters = iters;
+    result.median_ns = per_op[per_op.size() / 2];
+    result.min_ns = per_op[0];
+    result.mb_per_sec = bench->bytes_ * 1000.0 / result.median_ns;
+
+    return result;
+}
+
+vector<int> parse_list(const string &flag)
+{
+    vector<int> list;
+
+    const char *p = flag.c_str();
+    while (*p) {
+        char *end = NULL;
+        long value = strtol(p, &end, 10);
+        if (end == p || value <= 0) {
+            LOG(FATAL) << "invalid list: " << flag;
+        }
+        list.push_back(value);
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return list;
+}
+
+vector<Bench *> new_benches()
+{
+    vector<Bench *> benches;
+
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        for (int c = 0; c < 4; ++c) {
+            benches.push_back(new EncodeBench(c, sizes[i]));
+            benches.push_back(new DecodeBench(c, sizes[i]));
+        }
+    }
+
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        for (int c = 1; c < 4; ++c) {
+            benches.push_back(new CompressBench(c, sizes[i], false));
+            benches.push_back(new CompressBench(c, sizes[i], true));
+        }
+    }
+
+    benches.push_back(new MetaParseBench(true));
+    benches.push_back(new MetaParseBench(false));
+
+    for (size_t i = 0; i < producers.size(); ++i) {
+        benches.push_back(new EvQueueBench(producers[i]));
+    }
+
+    benches.push_back(new TimerBench());
+    benches.push_back(new FindBench());
+
+    return benches;
+}
+
+void write_json(const vector<Result> &results)
+{
+    FILE *out = stdout;
+
+    if (FLAGS_json != "-") {
+        out = fopen(FLAGS_json.c_str(), "w");
+        if (!out) {
+            LOG(FATAL) << "open " << FLAGS_json << " failed";
+        }
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"cycles_per_usec\": %.1f,\n", cycles_per_usec());
+    fprintf(out, "  \"min_time_ms\": %d,\n", FLAGS_min_time);
+    fprintf(out, "  \"repeat\": %d,\n", FLAGS_repeat);
+    fprintf(out, "  \"benchmarks\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %lu, "
+                "\"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f, "
+                "\"mb_per_sec\": %.1f}%s\n",
+                r.name.c_str(), r.iters, r.median_ns, r.min_ns, r.mb_per_sec,
+                i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    /* init argument */
+    ParseCommandLineFlags(&argc, &argv, false);
+
+    /* init log prefix */
+    google::InitGoogleLogging("microbench");
+
+    sizes = parse_list(FLAGS_sizes);
+    producers = parse_list(FLAGS_producers);
+
+    vector<Bench *> benches = new_benches();
+    vector<Result> results;
+
+    printf("%-36s %12s %12s %12s %12s\n",
+           "benchmark", "iterations", "ns/op", "min ns/op", "MB/s");
+
+    for (size_t i = 0; i < benches.size(); ++i) {
+        Bench *bench = benches[i];
+
+        if (bench->name_.find(FLAGS_filter) != string::npos) {
+            results.push_back(measure(bench));
+
+            const Result &r = results.back();
+            printf("%-36s %12lu %12.1f %12.1f %12.1f\n",
+                   r.name.c_str(), r.iters, r.median_ns, r.min_ns, r.mb_per_sec);
+            fflush(stdout);
+        }
+
+        delete bench;
+    }
+
+    if (!FLAGS_json.empty()) {
+        write_json(results);
+    }
+
+    google::protobuf::ShutdownProtobufLibrary();
+    google::ShutdownGoogleLogging();
+    ShutDownCommandLineFlags();
+
+    return 0;
+}
@@ -3,14 +3,108 @@
 #include <string>
 
 #include "src/qrpc/util/log.h"
+#include "src/qrpc/util/socket.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/rpc/stats.h"
+#include "src/qrpc/rpc/rpcz.h"
+#include "src/qrpc/rpc/trace.h"
 #include "src/qrpc/rpc/builtin.h"
+#include "src/qrpc/rpc/server.h"
+#include "src/qrpc/rpc/server_impl.h"
 
 using namespace std;
 using namespace google::protobuf;
 
 namespace qrpc {
 
-BuiltinServiceImpl::BuiltinServiceImpl()
+namespace {
+
+bool has_prefix(const string &str, const string &prefix)
+{
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+void fill_stats(const StatsMap &stats, bool client,
+                const string &prefix, StatsResponse *response)
+{
+    StatsMap::const_iterator ite = stats.begin();
+
+    for (; ite != stats.end(); ++ite) {
+        if (!has_prefix(ite->first, prefix)) {
+            continue;
+        }
+
+        const MethodStats &ms = ite->second;
+        const Histogram &hist = ms.latency();
+
+        MethodStatistics *out = response->add_method();
+        out->set_method(ite->first);
+        out->set_client(client);
+        out->set_count(ms.count());
+
+        for (int i = 1; i < kStatsCodes; i++) {
+            if (ms.errors(i)) {
+                ErrorCount *err = out->add_errors();
+                err->set_code(i);
+                err->set_count(ms.errors(i));
+            }
+        }
+
+        out->set_latency_sum_ns(cycles_to_nsec(hist.sum()));
+        out->set_latency_max_ns(cycles_to_nsec(hist.max()));
+        out->set_latency_p50_ns(cycles_to_nsec(hist.Percentile(0.5)));
+        out->set_latency_p90_ns(cycles_to_nsec(hist.Percentile(0.9)));
+        out->set_latency_p99_ns(cycles_to_nsec(hist.Percentile(0.99)));
+        out->set_latency_p999_ns(cycles_to_nsec(hist.Percentile(0.999)));
+
+        for (int i = 0; i < kHistBuckets; i++) {
+            if (hist.bucket(i)) {
+                LatencyBucket *bucket = out->add_buckets();
+                bucket->set_upper_ns(cycles_to_nsec(Histogram::Upper(i)));
+                bucket->set_count(hist.bucket(i));
+            }
+        }
+    }
+}
+
+void fill_rpcz(const RpczSpan &span, uint64_t now_cycles,
+               uint64_t now_us, RpczEntry *out)
+{
+    const uint64_t *stamps = span.stamps;
+    uint64_t recv = stamps[kRpczRecv];
+
+    out->set_method(span.method);
+    out->set_remote(span.remote);
+    out->set_request_size(span.request_size);
+    out->set_response_size(span.response_size);
+    out->set_code(span.code);
+    out->set_recv_time_us(now_us - cycles_to_usec(now_cycles - recv));
+
+    out->set_parse_ns(cycles_to_nsec(stamps[kRpczParse] - recv));
+    out->set_handler_ns(cycles_to_nsec(stamps[kRpczHandler] - recv));
+    out->set_done_ns(cycles_to_nsec(stamps[kRpczDone] - recv));
+    out->set_encode_ns(cycles_to_nsec(stamps[kRpczEncode] - recv));
+    out->set_sent_ns(cycles_to_nsec(stamps[kRpczSent] - recv));
+}
+
+void fill_span(const TraceSpan &span, SpanEntry *out)
+{
+    out->set_trace_id(span.trace_id);
+    out->set_span_id(span.span_id);
+    if (span.parent_span) {
+        out->set_parent_span(span.parent_span);
+    }
+    out->set_method(span.method);
+    out->set_server(span.server);
+    out->set_code(span.code);
+    out->set_start_time_us(span.start_us);
+    out->set_duration_ns(span.duration_ns);
+}
+
+} // anonymous namespace
+
+BuiltinServiceImpl::BuiltinServiceImpl(ServerImpl *server)
+    : server_(server)
 {
 
 }
@@ -25,6 +119,93 @@ void BuiltinServiceImpl::Status(google::protobuf::RpcController *controller,
                                 StatusResponse *response,
                                 google::protobuf::Closure *done)
 {
+    const vector<pair<string, int> > &endpoints = server_->endpoints();
+
+    /* advertise the unix domain sockets for the local clients */
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        const string &host = endpoints[i].first;
+
+        if (!is_unix_addr(host.c_str())) {
+            continue;
+        }
+
+        if (host[0] == '/') {
+            response->add_unix_path(host);
+        } else {
+            response->add_unix_path(host.substr(sizeof(UNIX_ADDRPREFIX) - 1));
+        }
+    }
+
+    done->Run();
+}
+
+void BuiltinServiceImpl::Stats(google::protobuf::RpcController *controller,
+                               const StatsRequest *request,
+                               StatsResponse *response,
+                               google::protobuf::Closure *done)
+{
+    const string &prefix = request->method_prefix();
+
+    /* aggregate the per-thread stats on demand */
+    StatsMap server_stats;
+    server_->MergeStats(&server_stats);
+    fill_stats(server_stats, false, prefix, response);
+
+    StatsMap client_stats;
+    merge_client_stats(&client_stats);
+    fill_stats(client_stats, true, prefix, response);
+
+    done->Run();
+}
+
+void BuiltinServiceImpl::Rpcz(google::protobuf::RpcController *controller,
+                              const RpczRequest *request,
+                              RpczResponse *response,
+                              google::protobuf::Closure *done)
+{
+    const string &prefix = request->method_prefix();
+    uint64_t min_cycles = usec_to_cycles(request->min_latency_us());
+
+    vector<RpczSpan> spans;
+    server_->DumpRpcz(&spans);
+
+    uint64_t now_cycles = rdtsc();
+    uint64_t now_us = wall_usec();
+
+    for (size_t i = 0; i < spans.size(); i++) {
+        if ((uint32_t)response->span_size() >= request->max_count()) {
+            break;
+        }
+
+        const RpczSpan &span = spans[i];
+        if (!has_prefix(span.method, prefix)) {
+            continue;
+        }
+        if (span.stamps[kRpczSent] - span.stamps[kRpczRecv] < min_cycles) {
+            continue;
+        }
+
+        fill_rpcz(span, now_cycles, now_us, response->add_span());
+    }
+
+    done->Run();
+}
+
+void BuiltinServiceImpl::Traces(google::protobuf::RpcController *controller,
+                                const TracesRequest *request,
+                                TracesResponse *response,
+                                google::protobuf::Closure *done)
+{
+    vector<TraceSpan> spans;
+    server_->DumpTraces(request->trace_id(), &spans);
+
+    for (size_t i = 0; i < spans.size(); i++) {
+        if ((uint32_t)response->span_size() >= request->max_count()) {
+            break;
+        }
+        fill_span(spans[i], response->add_span());
+    }
+
     done->Run();
 }
 
@@ -11,15 +11,35 @@
 
 namespace qrpc {
 
+class ServerImpl;
+
 class BuiltinServiceImpl : public BuiltinService {
 public:
-    BuiltinServiceImpl();
+    explicit BuiltinServiceImpl(ServerImpl *server);
     virtual ~BuiltinServiceImpl();
 
     virtual void Status(::google::protobuf::RpcController* controller,
                         const StatusRequest* request,
                         StatusResponse* response,
                         ::google::protobuf::Closure* done);
+
+    virtual void Stats(::google::protobuf::RpcController* controller,
+                       const StatsRequest* request,
+                       StatsResponse* response,
+                       ::google::protobuf::Closure* done);
+
+    virtual void Rpcz(::google::protobuf::RpcController* controller,
+                      const RpczRequest* request,
+                      RpczResponse* response,
+                      ::google::protobuf::Closure* done);
+
+    virtual void Traces(::google::protobuf::RpcController* controller,
+                        const TracesRequest* request,
+                        TracesResponse* response,
+                        ::google::protobuf::Closure* done);
+
+private:
+    ServerImpl *server_;
 };
 
 } // namespace qrpc
@@ -1,14 +1,20 @@
 #include <stdlib.h>
 #include <string>
+#include <vector>
 
 #include "src/qrpc/util/log.h"
 #include "src/qrpc/util/compiler.h"
+#include "src/qrpc/util/socket.h"
 #include "src/qrpc/rpc/errno.h"
 #include "src/qrpc/rpc/closure.h"
 #include "src/qrpc/rpc/controller.h"
 #include "src/qrpc/rpc/controller_client.h"
 #include "src/qrpc/rpc/channel.h"
 #include "src/qrpc/rpc/channel_impl.h"
+#include "src/qrpc/rpc/replica_channel.h"
+#include "src/qrpc/rpc/builtin.h"
+#include "src/qrpc/rpc/server.h"
+#include "src/qrpc/rpc/server_impl.h"
 
 using namespace std;
 
@@ -52,6 +58,32 @@ inline bool options_ok(const ChannelOptions &opt)
     ZERO_RET(opt.connect_timeout);
     ZERO_RET(opt.retry_interval);
     NEGATIVE_RET(opt.heartbeat_interval);
+    NEGATIVE_RET(opt.shm_ring_size);
+    NEGATIVE_RET(opt.shm_spin_count);
+    NEGATIVE_RET(opt.trace_sample_rate);
+    NEGATIVE_RET(opt.slow_callback_usec);
+    NEGATIVE_RET(opt.max_pending);
+    NEGATIVE_RET(opt.max_inflight);
+    NEGATIVE_RET(opt.hedge_budget_percent);
+    NEGATIVE_RET(opt.retry_budget_percent);
+
+    return true;
+}
+
+/* the port is ignored by unix domain socket */
+inline bool endpoint_ok(const string &host, int *port)
+{
+    if (host.empty()) {
+        LOG(ERROR) << "host address is empty";
+        return false;
+    }
+
+    if (is_unix_addr(host.c_str())) {
+        *port = 0;
+    } else if (*port <= 0) {
+        LOG(ERROR) << "network port is invalid";
+        return false;
+    }
 
     return true;
 }
@@ -72,10 +104,34 @@ ChannelOptions::ChannelOptions()
     , connect_timeout(5000)
     , retry_interval(1000)
     , heartbeat_interval(600000)
+    , frame_checksum(false)
+    , prefer_unix_socket(true)
+    , shm_ring_size(0)
+    , shm_spin_count(0)
+    , local_serialization(false)
+    , trace_sample_rate(0)
+    , slow_callback_usec(100000)
+    , max_pending(0)
+    , max_inflight(0)
+    , wait_for_capacity(false)
+    , hedge_budget_percent(10)
+    , retry_budget_percent(10)
+    , retransmit_on_reconnect(true)
 {
 
 }
 
+RetryPolicy::RetryPolicy()
+    : max_attempts(3)
+    , initial_backoff_usec(10000)
+    , max_backoff_usec(1000000)
+{
+    codes.push_back(kErrOverload);
+    codes.push_back(kErrBacklog);
+    codes.push_back(kErrRateLimit);
+    codes.push_back(kErrConnLost);
+}
+
 Channel::~Channel()
 {
 
@@ -89,13 +145,35 @@ int Channel::New(const ChannelOptions &options,
         return kErrParam;
     }
 
-    if (host.empty()) {
-        LOG(ERROR) << "host address is empty";
+    if (!endpoint_ok(host, &port)) {
         return kErrParam;
     }
 
-    if (port <= 0) {
-        LOG(ERROR) << "network port is invalid";
+    if (!base) {
+        LOG(ERROR) << "event base is null";
+        return kErrParam;
+    }
+
+    Channel *channel = new ChannelImpl(options, host, port, base);
+    if (!channel) {
+        LOG(ERROR) << "alloc channel object failed!!!";
+        return kErrMem;
+    }
+
+    *chanptr = channel;
+    return kOk;
+}
+
+int Channel::New(const ChannelOptions &options,
+                 Server *server,
+                 event_base *base, Channel **chanptr)
+{
+    if (!options_ok(options)) {
+        return kErrParam;
+    }
+
+    if (!server) {
+        LOG(ERROR) << "server is null";
         return kErrParam;
     }
 
@@ -104,7 +182,43 @@ int Channel::New(const ChannelOptions &options,
         return kErrParam;
     }
 
-    Channel *channel = new ChannelImpl(options, host, port, base);
+    ServerImpl *srv_impl = (ServerImpl *)server;
+    Channel *channel = new ChannelImpl(options, srv_impl, base);
+    if (!channel) {
+        LOG(ERROR) << "alloc channel object failed!!!";
+        return kErrMem;
+    }
+
+    *chanptr = channel;
+    return kOk;
+}
+
+int Channel::New(const ChannelOptions &options,
+                 const vector<pair<string, int> > &endpoints,
+                 event_base *base, Channel **chanptr)
+{
+    if (!options_ok(options)) {
+        return kErrParam;
+    }
+
+    if (endpoints.empty()) {
+        LOG(ERROR) << "endpoints are empty";
+        return kErrParam;
+    }
+
+    vector<pair<string, int> > replicas(endpoints);
+    for (size_t i = 0; i < replicas.size(); i++) {
+        if (!endpoint_ok(replicas[i].first, &replicas[i].second)) {
+            return kErrParam;
+        }
+    }
+
+    if (!base) {
+        LOG(ERROR) << "event base is null";
+        return kErrParam;
+    }
+
+    Channel *channel = new ReplicaChannel(options, replicas, base);
     if (!channel) {
         LOG(ERROR) << "alloc channel object failed!!!";
         return kErrMem;
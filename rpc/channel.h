@@ -4,11 +4,14 @@
 #include <stdint.h>
 #include <event.h>
 #include <string>
+#include <vector>
 #include <google/protobuf/service.h>
 #include <google/protobuf/descriptor.h>
 
 namespace qrpc {
 
+class Server;
+
 struct ChannelOptions {
     /*
      * The recv buf size (bytes) in kernel mode.
@@ -79,10 +82,221 @@ struct ChannelOptions {
      */
     int heartbeat_interval;
 
+    /*
+     * Carry the crc32c of payload in each message header,
+     * and the server does the same for responses once it
+     * receives a checksummed request.
+     *
+     * Default: false
+     */
+    bool frame_checksum;
+
+    /*
+     * Switch to the unix domain socket advertised by the server
+     * if the server runs on the same host.
+     * It falls back to TCP if connecting the socket failed.
+     *
+     * Default: true
+     */
+    bool prefer_unix_socket;
+
+    /*
+     * The ring size (bytes) of the shared memory transport,
+     * which replaces the unix domain socket for the messages
+     * if the server is on the same host.
+     * ZERO means disable this feature.
+     *
+     * Default: 0
+     */
+    int shm_ring_size;
+
+    /*
+     * The polling times of the shared memory ring before
+     * parking in the event loop, applied to both sides.
+     * Spinning trades CPU for latency, and is useful only
+     * if the client and the server run on dedicated cores.
+     *
+     * Default: 0
+     */
+    int shm_spin_count;
+
+    /*
+     * Serialize the messages of in-process channel as the
+     * network does, rather than copying the request and
+     * swapping the response.
+     *
+     * Default: false
+     */
+    bool local_serialization;
+
+    /*
+     * Start a trace for every call which isn't made inside a
+     * traced handler, and sample one of every trace_sample_rate
+     * traces into the span buffers. The calls inside the handlers
+     * always follow the trace of the request.
+     * ZERO means never start a trace.
+     *
+     * Default: 0
+     */
+    int trace_sample_rate;
+
+    /*
+     * Warn the callbacks of channels slower than it in microseconds,
+     * the channels of the same thread share the setting of the first
+     * one. ZERO means never warn.
+     *
+     * Default: 100000
+     */
+    int slow_callback_usec;
+
+    /*
+     * The max requests waiting to be sent, which pile up while
+     * the connection is down. The calls beyond it fail with
+     * kErrBacklog at once, or wait if wait_for_capacity.
+     * The requests sent before a reconnection are retransmitted
+     * regardless of it, see retransmit_on_reconnect.
+     * ZERO means no limit.
+     *
+     * Default: 0
+     */
+    int max_pending;
+
+    /*
+     * The max requests sent and waiting for the responses,
+     * the others are held in the send queue. It bounds the
+     * calls of in-process channel as max_pending does.
+     * ZERO means no limit.
+     *
+     * Default: 0
+     */
+    int max_inflight;
+
+    /*
+     * Hold the calls beyond the limits until a request is done,
+     * rather than failing them at once. The held calls which are
+     * timeout fail with kErrBacklog, not kErrTimeout.
+     * The builtin service isn't limited.
+     *
+     * Default: false
+     */
+    bool wait_for_capacity;
+
+    /*
+     * The identity of the client sent with the requests, e.g. the
+     * tenant or the caller service, which the server with fair_queue
+     * shares the workers by. EMPTY means the connection is taken.
+     *
+     * Default: ""
+     */
+    std::string client_id;
+
+    /*
+     * The backup requests of hedged calls at most, in percentage
+     * of the calls of hedged methods, so hedging can't add more
+     * load than it. See Channel::SetHedgingPolicy().
+     *
+     * Default: 10
+     */
+    int hedge_budget_percent;
+
+    /*
+     * The retries at most, in percentage of the calls of retried
+     * methods, so retrying can't multiply the load in an outage.
+     * A few retries are allowed before the calls earn them.
+     * See Channel::SetRetryPolicy().
+     *
+     * Default: 10
+     */
+    int retry_budget_percent;
+
+    /*
+     * Resend the requests which were sent but not answered once the
+     * connection is reestablished, which isn't safe for the methods
+     * that aren't idempotent. Otherwise they fail with kErrConnLost,
+     * which the retry policy of the method may retry.
+     *
+     * Default: true
+     */
+    bool retransmit_on_reconnect;
+
     /* construct function */
     ChannelOptions();
 };
 
+/*
+ * Call the method again if it failed with a retriable code, after the
+ * backoff of full jitter: a random delay in [0, min(max_backoff_usec,
+ * initial_backoff_usec * 2^(n-1))] before the n-th retry.
+ *
+ * The attempts share the rpc_timeout of the controller, so the call
+ * isn't retried if the deadline comes during the backoff. The channel
+ * over replicas sends the retry to the next replica.
+ */
+struct RetryPolicy {
+    /*
+     * The attempts at most, including the first one.
+     *
+     * Default: 3
+     */
+    int max_attempts;
+
+    /*
+     * The codes to retry, kErrCancel is never retried.
+     * The methods which aren't idempotent should retry only the
+     * codes of the requests which the server hasn't handled.
+     *
+     * Default: kErrOverload, kErrBacklog, kErrRateLimit, kErrConnLost
+     */
+    std::vector<int> codes;
+
+    /*
+     * The upper bound of the first backoff (microsecond).
+     *
+     * Default: 10000
+     */
+    int initial_backoff_usec;
+
+    /*
+     * The upper bound of the backoffs (microsecond).
+     *
+     * Default: 1000000
+     */
+    int max_backoff_usec;
+
+    /* construct function */
+    RetryPolicy();
+};
+
+/*
+ * Send a backup request to another replica if the call isn't done
+ * after a delay, the first response wins and the other is canceled.
+ * It's only for the idempotent methods, e.g. the reads.
+ */
+struct HedgingPolicy {
+    /*
+     * Hedge after the percentile (1 ~ 99) of the latency of the
+     * method's recent calls. ZERO means always wait delay_usec.
+     *
+     * Default: 95
+     */
+    int delay_percentile;
+
+    /*
+     * The delay (microsecond) before the latency is sampled,
+     * or always if delay_percentile is ZERO.
+     *
+     * Default: 10000
+     */
+    int delay_usec;
+
+    /* construct function */
+    HedgingPolicy()
+        : delay_percentile(95)
+        , delay_usec(10000)
+    {
+    }
+};
+
 class Channel : public google::protobuf::RpcChannel {
 public:
     /**
@@ -94,6 +308,9 @@ public:
      * or a network hostname, whose network addresses are looked up
      * and the first address resolved will be used.
      *
+     * The host in format of "unix:/path" specifies a unix domain socket,
+     * and the port is ignored.
+     *
      * Stores a pointer to a heap-allowed channel in *chanptr
      * and returns zero on success.
      * Stores NULL in *chanptr and returns an error code on error.
@@ -105,6 +322,44 @@ public:
                    event_base *base,
                    Channel **chanptr);
 
+    /**
+     * Create an in-process channel bound to the server.
+     *
+     * The requests are dispatched to the server's worker threads
+     * directly, bypassing the sockets and the serialization.
+     * The controller, timeout and cancel behave as the network.
+     *
+     * The server must be started, and outlive the channel.
+     *
+     * Stores a pointer to a heap-allowed channel in *chanptr
+     * and returns zero on success.
+     * Stores NULL in *chanptr and returns an error code on error.
+     *
+     * Caller should delete *chanptr when it is no longer needed.
+     */
+    static int New(const ChannelOptions &options,
+                   Server *server,
+                   event_base *base,
+                   Channel **chanptr);
+
+    /**
+     * Create a channel over the replicas of a service.
+     *
+     * The endpoints are the host and port pairs as above, and each
+     * one has a connection of its own. The calls are spread over
+     * the replicas round robin, and hedged by SetHedgingPolicy().
+     *
+     * Stores a pointer to a heap-allowed channel in *chanptr
+     * and returns zero on success.
+     * Stores NULL in *chanptr and returns an error code on error.
+     *
+     * Caller should delete *chanptr when it is no longer needed.
+     */
+    static int New(const ChannelOptions &options,
+                   const std::vector<std::pair<std::string, int> > &endpoints,
+                   event_base *base,
+                   Channel **chanptr);
+
     inline Channel() { }
     virtual ~Channel();
 
@@ -138,6 +393,34 @@ public:
      */
     virtual int Cancel() = 0;
 
+    /**
+     * Hedge the calls of the method, which is specified by the full
+     * name, e.g. "qrpc.example.EchoService.Echo".
+     *
+     * Only the channel over replicas supports it, and it should be
+     * called before the calls of the method. If the primary failed
+     * and waits for the backup, the controller cancels the backup.
+     *
+     * @return
+     * Return 0 if success, error code otherwise.
+     */
+    virtual int SetHedgingPolicy(const std::string &method,
+                                 const HedgingPolicy &policy) = 0;
+
+    /**
+     * Retry the failed calls of the method, which is specified by
+     * the full name as above. It should be called before the calls
+     * of the method.
+     *
+     * The controller cancels the call between the attempts as
+     * well, which is done with kErrCancel then.
+     *
+     * @return
+     * Return 0 if success, error code otherwise.
+     */
+    virtual int SetRetryPolicy(const std::string &method,
+                               const RetryPolicy &policy) = 0;
+
 private:
     /* No copying allowed */
     Channel(const Channel &);
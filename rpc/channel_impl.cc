@@ -22,6 +22,7 @@
 #include "src/qrpc/util/compiler.h"
 #include "src/qrpc/util/completion.h"
 #include "src/qrpc/util/socket.h"
+#include "src/qrpc/util/probe.h"
 #include "src/qrpc/rpc/errno.h"
 #include "src/qrpc/rpc/closure.h"
 #include "src/qrpc/rpc/controller.h"
@@ -31,14 +32,34 @@
 #include "src/qrpc/rpc/message.pb.h"
 #include "src/qrpc/rpc/connection.h"
 #include "src/qrpc/rpc/compressor.h"
+#include "src/qrpc/rpc/stats.h"
+#include "src/qrpc/rpc/loop_monitor.h"
 #include "src/qrpc/rpc/channel.h"
 #include "src/qrpc/rpc/channel_impl.h"
+#include "src/qrpc/rpc/command.h"
+#include "src/qrpc/rpc/worker.h"
+#include "src/qrpc/rpc/builtin.h"
+#include "src/qrpc/rpc/server.h"
+#include "src/qrpc/rpc/server_impl.h"
 
 using namespace std;
 using namespace google::protobuf;
 
 namespace qrpc {
 
+namespace {
+
+/* the heartbeat and the probe go before the others */
+ControllerOptions builtin_options()
+{
+    ControllerOptions options;
+    options.priority = kPriorityHigh;
+
+    return options;
+}
+
+} // anonymous namespace
+
 /* protect the shared compressors */
 pthread_mutex_t ChannelImpl::mutex_ = PTHREAD_MUTEX_INITIALIZER;
 
@@ -99,6 +120,14 @@ ChannelImpl::ChannelImpl(const ChannelOptions &options,
                          const string &host, int port,
                          event_base *base)
     : sequence_(0)
+    , retrier_(options.retry_budget_percent, base,
+               tr1::bind(&ChannelImpl::StartCall, this,
+                         tr1::placeholders::_1, tr1::placeholders::_2,
+                         tr1::placeholders::_3, tr1::placeholders::_4,
+                         tr1::placeholders::_5))
+    , credit_requests_(0)
+    , credit_bytes_(0)
+    , recv_bytes_(0)
     , conn_(NULL)
     , base_(base)
     , port_(port)
@@ -107,9 +136,20 @@ ChannelImpl::ChannelImpl(const ChannelOptions &options,
     , options_(options)
     , has_status_(false)
     , stub_(this)
-    , controller_(ControllerOptions())
+    , controller_(builtin_options())
     , closure_(this, &ChannelImpl::OnKeepaliveDone, false)
+    , unix_failed_(false)
+    , has_probe_(false)
+    , has_switch_(false)
+    , has_unix_timer_(false)
+    , probe_controller_(builtin_options())
+    , probe_closure_(this, &ChannelImpl::OnProbeDone, false)
+    , server_(NULL)
+    , worker_(NULL)
+    , peer_(NULL)
     , compressor_(new_compressor_if_not(tid_))
+    , stats_(new_client_stats_if_not(tid_))
+    , loop_(new_loop_monitor_if_not(tid_, base, options.slow_callback_usec))
 {
     char tmp[1024] = { 0 };
 
@@ -121,15 +161,61 @@ ChannelImpl::ChannelImpl(const ChannelOptions &options,
     }
 }
 
+ChannelImpl::ChannelImpl(const ChannelOptions &options,
+                         ServerImpl *server,
+                         event_base *base)
+    : sequence_(0)
+    , retrier_(options.retry_budget_percent, base,
+               tr1::bind(&ChannelImpl::StartCall, this,
+                         tr1::placeholders::_1, tr1::placeholders::_2,
+                         tr1::placeholders::_3, tr1::placeholders::_4,
+                         tr1::placeholders::_5))
+    , credit_requests_(0)
+    , credit_bytes_(0)
+    , recv_bytes_(0)
+    , conn_(NULL)
+    , base_(base)
+    , port_(0)
+    , host_("inproc")
+    , endpoint_("inproc")
+    , tid_(pthread_self())
+    , options_(options)
+    , has_status_(false)
+    , stub_(this)
+    , controller_(builtin_options())
+    , closure_(this, &ChannelImpl::OnKeepaliveDone, false)
+    , unix_failed_(false)
+    , has_probe_(false)
+    , has_switch_(false)
+    , has_unix_timer_(false)
+    , probe_controller_(builtin_options())
+    , probe_closure_(this, &ChannelImpl::OnProbeDone, false)
+    , server_(server)
+    , worker_(NULL)
+    , peer_(NULL)
+    , compressor_(new_compressor_if_not(tid_))
+    , stats_(new_client_stats_if_not(tid_))
+    , loop_(new_loop_monitor_if_not(tid_, base, options.slow_callback_usec))
+{
+
+}
+
 ChannelImpl::~ChannelImpl()
 {
+    DelUnixTimer();
     CancelAllRpc(true);
+    CloseLocal();
 
     delete conn_;
     conn_ = NULL;
 
     /* release compressor */
     del_compressor_if_zero(compressor_, tid_);
+
+    /* release client stats */
+    del_client_stats_if_zero(stats_, tid_);
+
+    del_loop_monitor_if_zero(loop_, tid_);
 }
 
 int ChannelImpl::Open()
@@ -139,11 +225,27 @@ int ChannelImpl::Open()
         return kErrCtx;
     }
     
-    if (conn_) {
+    if (conn_ || peer_) {
         LOG(ERROR) << "the channel has beed opened";
         return kError;
     }
 
+    if (server_) {
+        worker_ = server_->NextWorker();
+        if (!worker_) {
+            LOG(ERROR) << "the server isn't running";
+            return kError;
+        }
+
+        peer_ = new LocalPeer(this, base_);
+        if (!peer_) {
+            LOG(ERROR) << "open channel failed";
+            return kErrMem;
+        }
+
+        return kOk;
+    }
+
     conn_ = new ClientConnection(this);
     if (!conn_) {
         LOG(ERROR) << "open channel failed";
@@ -160,7 +262,9 @@ int ChannelImpl::Close()
         return kErrCtx;
     }
 
+    DelUnixTimer();
     CancelAllRpc(true);
+    CloseLocal();
 
     delete conn_;
     conn_ = NULL;
@@ -180,6 +284,24 @@ int ChannelImpl::Cancel()
     return 0;
 }
 
+int ChannelImpl::SetHedgingPolicy(const std::string &method,
+                                  const HedgingPolicy &policy)
+{
+    LOG(ERROR) << "hedging needs the channel over replicas: " << method;
+    return kErrParam;
+}
+
+int ChannelImpl::SetRetryPolicy(const std::string &method,
+                                const RetryPolicy &policy)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    return retrier_.SetPolicy(method, policy);
+}
+
 void ChannelImpl::Keepalive()
 {
     if (!sendq_.empty()) {
@@ -217,6 +339,112 @@ void ChannelImpl::OnKeepaliveDone()
     has_status_ = false;
 }
 
+inline void ChannelImpl::NewUnixTimer()
+{
+    if (has_unix_timer_) {
+        return;
+    }
+
+    has_unix_timer_ = true;
+
+    unix_timer_.Set(base_, 1, tr1::bind(&ChannelImpl::HandleUnixTimer, this));
+    unix_timer_.SchedOneshot();
+}
+
+inline void ChannelImpl::DelUnixTimer()
+{
+    if (!has_unix_timer_) {
+        return;
+    }
+
+    has_unix_timer_ = false;
+    unix_timer_.SchedCancel();
+}
+
+void ChannelImpl::HandleUnixTimer()
+{
+    has_unix_timer_ = false;
+
+    /* ask the server for its unix domain sockets */
+    if (!has_probe_ && !has_switch_ && unix_path_.empty()) {
+        has_probe_ = true;
+        probe_controller_.Reset();
+        probe_response_.Clear();
+        stub_.Status(&probe_controller_, &probe_request_,
+                     &probe_response_, &probe_closure_);
+        return;
+    }
+
+    /* wait for the sent requests of the TCP connection */
+    if (!has_switch_ || !recvq_.empty() || cur_send_.second) {
+        return;
+    }
+
+    DLOG(INFO) << "switch to unix domain socket: " << unix_path_;
+
+    has_switch_ = false;
+
+    delete conn_;
+    conn_ = new ClientConnection(this);
+    if (!conn_) {
+        LOG(FATAL) << "alloc channel object failed";
+    }
+}
+
+void ChannelImpl::OnConnected(ClientConnection *conn)
+{
+    if (!options_.prefer_unix_socket || unix_failed_) {
+        return;
+    }
+
+    /* user specified or switched */
+    if (is_unix_addr(host_.c_str()) || !unix_path_.empty()) {
+        return;
+    }
+
+    /* the server runs on the same host */
+    const string &local = conn->local_addr();
+    const string &remote = conn->remote_addr();
+    if (local.compare(0, local.rfind(':'), remote, 0, remote.rfind(':'))) {
+        return;
+    }
+
+    /* maybe in the constructor of connection */
+    NewUnixTimer();
+}
+
+void ChannelImpl::OnConnectFail()
+{
+    if (unix_path_.empty()) {
+        return;
+    }
+
+    LOG(WARNING) << "connect to " << unix_path_
+        << " failed, fall back to "
+        << host_ << ":" << port_;
+
+    unix_failed_ = true;
+    unix_path_.clear();
+
+    /* stop holding the requests for it */
+    has_switch_ = false;
+}
+
+void ChannelImpl::OnProbeDone()
+{
+    has_probe_ = false;
+
+    if (probe_controller_.Failed() || !probe_response_.unix_path_size()) {
+        return;
+    }
+
+    unix_path_ = probe_response_.unix_path(0);
+    has_switch_ = true;
+
+    /* it's running in the callback of connection */
+    NewUnixTimer();
+}
+
 void ChannelImpl::CallMethod(const google::protobuf::MethodDescriptor *method,
                              google::protobuf::RpcController *controller,
                              const google::protobuf::Message *request,
@@ -236,8 +464,20 @@ void ChannelImpl::CallMethod(const google::protobuf::MethodDescriptor *method,
         LOG(FATAL) << "rpc controller is null";
     }
 
-    ClientController *ctl = (ClientController *)controller;
+    if (unlikely(retrier_.CallMethod(method, controller,
+                                     request, response, done))) {
+        return;
+    }
+
+    StartCall(method, (ClientController *)controller, request, response, done);
+}
 
+void ChannelImpl::StartCall(const google::protobuf::MethodDescriptor *method,
+                            ClientController *ctl,
+                            const google::protobuf::Message *request,
+                            google::protobuf::Message *response,
+                            google::protobuf::Closure *done)
+{
     //if (!request->IsInitialized()) {
     //    ctl->SetResponseCode(kErrField);
     //    ctl->SetResponseError(rerror(kErrField));
@@ -250,14 +490,210 @@ void ChannelImpl::CallMethod(const google::protobuf::MethodDescriptor *method,
         LOG(FATAL) << "alloc client message failed!!!";
     }
 
+    QRPC_PROBE3(client_call, cli_msg, this, method->full_name().c_str());
+
+    /* behind the held calls, so they're in order */
+    if (unlikely(Limited(method)) && (!waitq_.empty() || !HasCapacity())) {
+        if (!options_.wait_for_capacity) {
+            return RejectRpc(cli_msg);
+        }
+        waitq_.push_back(MsgItem(cli_msg->id(), cli_msg));
+        cli_msg->NewMonitor();
+        return;
+    }
+
+    if (server_) {
+        return CallLocal(cli_msg, request);
+    }
+
     if (sendq_.empty()) {
         conn_->EnableUpload();
     }
-    sendq_.push_back(MsgItem(cli_msg->id(), cli_msg));
+    sendq_.push_back(MsgItem(cli_msg->id(), cli_msg), cli_msg->priority());
 
     cli_msg->NewMonitor();
 }
 
+inline bool
+ChannelImpl::Limited(const google::protobuf::MethodDescriptor *method) const
+{
+    if (!options_.max_pending && !options_.max_inflight) {
+        return false;
+    }
+
+    /* the heartbeat and the probe */
+    return method->service() != BuiltinService::descriptor();
+}
+
+inline bool ChannelImpl::HasCapacity() const
+{
+    /* no send queue, the requests are pushed to the worker at once */
+    if (server_) {
+        return !options_.max_inflight ||
+            recvq_.size() < (size_t)options_.max_inflight;
+    }
+
+    return !options_.max_pending ||
+        sendq_.size() < (size_t)options_.max_pending;
+}
+
+/* the window of max_inflight and the credits of the server */
+inline bool ChannelImpl::WindowFull() const
+{
+    if (options_.max_inflight &&
+        recvq_.size() >= (size_t)options_.max_inflight) {
+        return true;
+    }
+
+    /* one request is always allowed */
+    if (recvq_.empty()) {
+        return false;
+    }
+
+    return (credit_requests_ && recvq_.size() >= credit_requests_) ||
+        (credit_bytes_ && recv_bytes_ >= credit_bytes_);
+}
+
+void ChannelImpl::TakeCredit(const MsgMeta &meta)
+{
+    credit_requests_ = meta.credit_requests();
+    credit_bytes_ = meta.credit_bytes();
+}
+
+/* the credits are granted by the connection */
+void ChannelImpl::ResetCredit()
+{
+    credit_requests_ = 0;
+    credit_bytes_ = 0;
+    recv_bytes_ = 0;
+}
+
+/* a request left the queues, pass the held ones */
+void ChannelImpl::OnSlotFreed()
+{
+    /* the last sent one of the TCP connection is gone, by any path */
+    if (unlikely(has_switch_) && recvq_.empty()) {
+        NewUnixTimer();
+    }
+
+    if (likely(!options_.max_pending && !options_.max_inflight &&
+               !credit_requests_ && !credit_bytes_)) {
+        return;
+    }
+
+    while (!waitq_.empty() && HasCapacity()) {
+        MsgItem item = waitq_.front();
+        waitq_.pop_front();
+
+        if (server_) {
+            CallLocal(item.second, item.second->request());
+            continue;
+        }
+
+        sendq_.push_back(item, item.second->priority());
+    }
+
+    /* the window may be open again */
+    if (conn_ && !sendq_.empty()) {
+        conn_->EnableUpload();
+    }
+}
+
+void ChannelImpl::CallLocal(ClientMessage *msg,
+                            const google::protobuf::Message *request)
+{
+    if (unlikely(!peer_)) {
+        LOG(FATAL) << "the channel isn't opened";
+    }
+
+    msg->StampDeadline();
+
+    LocalCall *cmd = new LocalCall(worker_, peer_, msg->msg_meta());
+    if (!cmd) {
+        LOG(FATAL) << "alloc local call failed!!!";
+    }
+
+    /* the user may release the request once the RPC is finished */
+    if (options_.local_serialization) {
+        request->SerializeToString(&cmd->data_);
+    } else {
+        cmd->request_ = request->New();
+        if (!cmd->request_) {
+            LOG(FATAL) << "alloc message failed!!!";
+        }
+        cmd->request_->CopyFrom(*request);
+    }
+
+    /* it's sent, waiting for the response */
+    recvq_.push_back(MsgItem(msg->id(), msg));
+
+    msg->NewMonitor();
+
+    worker_->LocalCall(cmd);
+}
+
+/* tell the worker as the cancel frame does */
+void ChannelImpl::CancelLocal(ClientMessage *msg)
+{
+    LocalCancel *cmd = new LocalCancel(worker_, peer_, msg->id());
+    if (!cmd) {
+        LOG(FATAL) << "alloc local cancel failed!!!";
+    }
+
+    worker_->LocalCancel(cmd);
+}
+
+void ChannelImpl::CloseLocal()
+{
+    if (!peer_) {
+        return;
+    }
+
+    peer_->Close();
+    peer_->Put();
+    peer_ = NULL;
+    worker_ = NULL;
+}
+
+void ChannelImpl::OnLocalDone(ServerMessage *srv_msg)
+{
+    const MsgMeta &msg_meta = srv_msg->msg_meta();
+
+    MsgQueue::iterator it = find_if(recvq_, msg_meta.sequence());
+    if (it == recvq_.end()) {
+        /* the response crossed the cancel of it */
+        DLOG(INFO) << "find canceled rpc"
+            << ", sequence: "
+            << msg_meta.sequence();
+        return;
+    }
+
+    ClientMessage *cli_msg = it->second;
+    recvq_.erase(it);
+
+    /* cancel watcher */
+    cli_msg->DelMonitor();
+
+    bool rc;
+    google::protobuf::Message *response = srv_msg->response();
+
+    if (msg_meta.code() || !options_.local_serialization) {
+        rc = cli_msg->ParseFromMessage(response, msg_meta);
+    } else {
+        string data;
+        response->SerializeToString(&data);
+        rc = cli_msg->ParseFromArray(data.data(), data.size(), msg_meta);
+    }
+    if (!rc) {
+        LOG(ERROR) << "parse response message failed!!!";
+    }
+
+    cli_msg->Finish();
+    delete cli_msg;
+
+    OnSlotFreed();
+}
+
 list<pair<uint64_t, ClientMessage *> >::iterator
 __always_inline ChannelImpl::find_if(MsgQueue &msgq, uint64_t seq)
 {
@@ -273,6 +709,12 @@ __always_inline ChannelImpl::find_if(MsgQueue &msgq, uint64_t seq)
 
 inline void ChannelImpl::CancelRpc(ClientMessage *msg)
 {
+    /* the cancel frame of a finished call */
+    if (msg->finish()) {
+        delete msg;
+        return;
+    }
+
     /* set cancel flag */
     msg->SetCancel();
 
@@ -288,10 +730,22 @@ inline void ChannelImpl::CancelRpc(ClientMessage *msg)
     delete msg;
 }
 
+/* fail the call beyond the limits at once */
+void ChannelImpl::RejectRpc(ClientMessage *msg)
+{
+    msg->SetBacklog();
+    msg->Finish();
+
+    delete msg;
+}
+
 void ChannelImpl::CancelAllRpc(bool close)
 {
     MsgQueue::iterator it;
 
+    /* waiting for the backoff */
+    retrier_.CancelAll();
+
     for (it = recvq_.begin(); it != recvq_.end(); ++it) {
         CancelRpc(it->second);
     }
@@ -299,9 +753,11 @@ void ChannelImpl::CancelAllRpc(bool close)
     if (cur_send_.second) {
         sendq_.pop_front();
 
-        cur_send_.second->SetCancel();
-        cur_send_.second->DelMonitor();
-        cur_send_.second->Finish();
+        if (!cur_send_.second->finish()) {
+            cur_send_.second->SetCancel();
+            cur_send_.second->DelMonitor();
+            cur_send_.second->Finish();
+        }
 
         if (close) {
             delete cur_send_.second;
@@ -310,15 +766,25 @@ void ChannelImpl::CancelAllRpc(bool close)
         }
     }
 
-    for (it = sendq_.begin(); it != sendq_.end(); ++it) {
+    for (int i = 0; i < kNumPriorities; i++) {
+        MsgQueue &msgq = sendq_.level(i);
+        for (it = msgq.begin(); it != msgq.end(); ++it) {
+            CancelRpc(it->second);
+        }
+    }
+
+    for (it = waitq_.begin(); it != waitq_.end(); ++it) {
         CancelRpc(it->second);
     }
 
     recvq_.clear();
     sendq_.clear();
+    waitq_.clear();
+    recv_bytes_ = 0;
 
+    /* back to the level which pop_front() takes it from */
     if (cur_send_.second) {
-        sendq_.push_back(cur_send_);
+        sendq_.push_back(cur_send_, sendq_.front_level());
     }
 }
 
@@ -328,12 +794,15 @@ void ChannelImpl::StartCancel(ClientMessage *msg)
     msg->DelMonitor();
 
     bool free = true;
+    bool sent = false;
     MsgQueue::iterator it;
     
     /* in recv queue */
     it = find_if(recvq_, msg->id());
     if (it != recvq_.end()) {
         recvq_.erase(it);
+        recv_bytes_ -= msg->request_size();
+        sent = true;
         goto notify;
     }
 
@@ -344,9 +813,14 @@ void ChannelImpl::StartCancel(ClientMessage *msg)
     }
 
     /* in send queue */
-    it = find_if(sendq_, msg->id());
-    if (it != recvq_.end()) {
-        sendq_.erase(it);
+    if (sendq_.erase(msg->id())) {
+        goto notify;
+    }
+
+    /* held for the limits */
+    it = find_if(waitq_, msg->id());
+    if (it != waitq_.end()) {
+        waitq_.erase(it);
     } else {
         /* couldn't be here */
         LOG(FATAL) << "invalid message";
@@ -358,7 +832,29 @@ notify:
      * refer to Connection::Encode().
      */
     msg->Finish();
-    if (free) { delete msg; }
+
+    /* the server is still working on it */
+    if (sent && peer_) {
+        CancelLocal(msg);
+    }
+    if (sent && conn_) {
+        SendCancel(msg);
+    } else if (free) {
+        delete msg;
+    }
+
+    OnSlotFreed();
+}
+
+/* the cancel frame is freed by SendDone() once it's written */
+void ChannelImpl::SendCancel(ClientMessage *msg)
+{
+    msg->ToCancel();
+
+    if (sendq_.empty()) {
+        conn_->EnableUpload();
+    }
+    sendq_.push_back(MsgItem(msg->id(), msg), kPriorityHigh);
 }
 
 void ChannelImpl::OnRpcTimeout(ClientMessage *msg)
@@ -370,6 +866,7 @@ void ChannelImpl::OnRpcTimeout(ClientMessage *msg)
     it = find_if(recvq_, msg->id());
     if (it != recvq_.end()) {
         recvq_.erase(it);
+        recv_bytes_ -= msg->request_size();
         goto notify;
     }
 
@@ -380,9 +877,15 @@ void ChannelImpl::OnRpcTimeout(ClientMessage *msg)
     }
 
     /* in send queue */
-    it = find_if(sendq_, msg->id());
-    if (it != recvq_.end()) {
-        sendq_.erase(it);
+    if (sendq_.erase(msg->id())) {
+        goto notify;
+    }
+
+    /* held for the limits */
+    it = find_if(waitq_, msg->id());
+    if (it != waitq_.end()) {
+        waitq_.erase(it);
+        msg->SetBacklog();
     } else {
         /* couldn't be here */
         LOG(FATAL) << "invalid message";
@@ -395,6 +898,8 @@ notify:
      */
     msg->Finish();
     if (free) { delete msg; }
+
+    OnSlotFreed();
 }
 
 void ChannelImpl::RecvFail()
@@ -410,18 +915,12 @@ void ChannelImpl::RecvFail()
     cur_send_.first = 0;
     cur_send_.second = NULL;
 
-    /* retransmit the finish-send requests */
-    for (MsgQueue::reverse_iterator rit = recvq_.rbegin();
-         rit != recvq_.rend();
-         ++rit) {
-        sendq_.push_front(*rit);
-    }
-    recvq_.clear();
-
     conn_ = new ClientConnection(this);
     if (!conn_) {
         LOG(FATAL) << "alloc channel object failed";
     }
+
+    RequeueSent();
 }
 
 void ChannelImpl::SendFail()
@@ -437,18 +936,48 @@ void ChannelImpl::SendFail()
     cur_send_.first = 0;
     cur_send_.second = NULL;
 
-    /* retransmit the finish-send requests */
-    for (MsgQueue::reverse_iterator rit = recvq_.rbegin();
-         rit != recvq_.rend();
-         ++rit) {
-        sendq_.push_front(*rit);
-    }
-    recvq_.clear();
-
     conn_ = new ClientConnection(this);
     if (!conn_) {
         LOG(FATAL) << "alloc channel object failed";
     }
+
+    RequeueSent();
+}
+
+/* retransmit the finish-send requests, or fail them */
+void ChannelImpl::RequeueSent()
+{
+    ResetCredit();
+
+    /* the new connection goes to the unix domain socket already */
+    has_switch_ = false;
+
+    if (options_.retransmit_on_reconnect) {
+        for (MsgQueue::reverse_iterator rit = recvq_.rbegin();
+             rit != recvq_.rend();
+             ++rit) {
+            sendq_.push_front(*rit, rit->second->priority());
+        }
+        recvq_.clear();
+        return;
+    }
+
+    /* the user may call again in the callbacks */
+    MsgQueue lost;
+    for (MsgQueue::iterator it = recvq_.begin(); it != recvq_.end(); ++it) {
+        lost.push_back(*it);
+    }
+    recvq_.clear();
+
+    for (MsgQueue::iterator it = lost.begin(); it != lost.end(); ++it) {
+        ClientMessage *cli_msg = it->second;
+        cli_msg->DelMonitor();
+        cli_msg->SetConnLost();
+        cli_msg->Finish();
+        delete cli_msg;
+    }
+
+    OnSlotFreed();
 }
 
 bool ChannelImpl::SendNext(Message **msg)
@@ -459,7 +988,20 @@ bool ChannelImpl::SendNext(Message **msg)
         return false;
     }
 
+    /* hold the requests for the unix domain socket */
+    if (unlikely(has_switch_)) {
+        return false;
+    }
+
+    /* hold the requests beyond the window */
+    if (unlikely(WindowFull())) {
+        return false;
+    }
+
     cur_send_ = sendq_.front();
+    if (likely(!cur_send_.second->cancel())) {
+        cur_send_.second->StampDeadline();
+    }
     *msg = cur_send_.second;
 
     return true;
@@ -477,10 +1019,14 @@ void ChannelImpl::SendDone(Message *msg)
     } else {
         sendq_.pop_front();
         recvq_.push_back(cur_send_);
+        recv_bytes_ += cli_msg->request_size();
+        cli_msg->Sent();
     }
 
     cur_send_.first = 0;
     cur_send_.second = NULL;
+
+    OnSlotFreed();
 }
 
 bool ChannelImpl::RecvDone(const char *payload, int meta, int data)
@@ -493,9 +1039,18 @@ bool ChannelImpl::RecvDone(const char *payload, int meta, int data)
         return false;
     }
 
+    if (msg_meta.has_credit_requests() || msg_meta.has_credit_bytes()) {
+        TakeCredit(msg_meta);
+    }
+
     MsgQueue::iterator it = find_if(recvq_, msg_meta.sequence());
     if (it == recvq_.end()) {
-        LOG(WARNING) << "find canceled rpc"
+        /* the server dropped the request which is timeout here */
+        if (msg_meta.code() == kErrDeadline) {
+            return true;
+        }
+        /* the response crossed the cancel of it */
+        DLOG(INFO) << "find canceled rpc"
             << ", from: "
             << host_
             << ":"
@@ -507,10 +1062,15 @@ bool ChannelImpl::RecvDone(const char *payload, int meta, int data)
 
     ClientMessage *cli_msg = it->second;
     recvq_.erase(it);
+    recv_bytes_ -= cli_msg->request_size();
 
     /* cancel watcher */
     cli_msg->DelMonitor();
 
+    QRPC_PROBE3(client_done, cli_msg, this, msg_meta.code());
+
+    loop_->Note(&cli_msg->method()->full_name());
+
     rc = cli_msg->ParseFromArray(payload + meta, data, msg_meta);
     if (!rc) {
         LOG(ERROR) << "parse response message failed!!!";
@@ -519,6 +1079,8 @@ bool ChannelImpl::RecvDone(const char *payload, int meta, int data)
     cli_msg->Finish();
     delete cli_msg;
 
+    OnSlotFreed();
+
     return rc;
 }
 
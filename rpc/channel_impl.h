@@ -14,29 +14,46 @@
 #include "src/qrpc/util/timer.h"
 #include "src/qrpc/util/atomic.h"
 #include "src/qrpc/util/compiler.h"
+#include "src/qrpc/rpc/controller.h"
 #include "src/qrpc/rpc/builtin.pb.h"
+#include "src/qrpc/rpc/retry.h"
 
 namespace qrpc {
 
 class Channel;
 class Compressor;
+class StatsTable;
+class LoopMonitor;
 
 class Message;
+class MsgMeta;
 class ClientMessage;
 
 class Connection;
 class ClientConnection;
 
+class Worker;
+class ServerImpl;
+class ServerMessage;
+class LocalPeer;
+
 class ChannelImpl : public Channel {
 public:
     explicit ChannelImpl(const ChannelOptions &options,
                          const std::string &host, int port,
                          event_base *base);
+    explicit ChannelImpl(const ChannelOptions &options,
+                         ServerImpl *server,
+                         event_base *base);
     virtual ~ChannelImpl();
 
     virtual int Open();
     virtual int Close();
     virtual int Cancel();
+    virtual int SetHedgingPolicy(const std::string &method,
+                                 const HedgingPolicy &policy);
+    virtual int SetRetryPolicy(const std::string &method,
+                               const RetryPolicy &policy);
 
     virtual void CallMethod(const google::protobuf::MethodDescriptor *method,
                             google::protobuf::RpcController *controller,
@@ -54,6 +71,9 @@ public:
     /* for self */
     void CancelAllRpc(bool close);
     void CancelRpc(ClientMessage *msg);
+    void RejectRpc(ClientMessage *msg);
+    void SendCancel(ClientMessage *msg);
+    void RequeueSent();
 
     /* for ClientMessage */
     void StartCancel(ClientMessage *msg);
@@ -63,24 +83,137 @@ public:
     void Keepalive();
     void OnKeepaliveDone();
 
+    /* for unix domain socket */
+    void OnConnected(ClientConnection *conn);
+    void OnConnectFail();
+    void OnProbeDone();
+
+    /* for in-process channel */
+    void OnLocalDone(ServerMessage *msg);
+
     uint64_t              next_sequence()    { return ++sequence_; }
     ClientConnection*     client_connection(){ return conn_;       }
     event_base*           base()       const { return base_;       }
     int                   port()       const { return port_;       }
     const std::string&    host()       const { return host_;       }
+    const std::string&    unix_path()  const { return unix_path_;  }
     std::string&          endpoint()         { return endpoint_;   }
     const ChannelOptions& options()    const { return options_;    }
     Compressor*           compressor() const { return compressor_; }
+    StatsTable*           stats()      const { return stats_;      }
+    LoopMonitor*          loop()       const { return loop_;       }
 
 private:
     typedef std::pair<uint64_t, ClientMessage *> MsgItem;
-    typedef std::list<std::pair<uint64_t, ClientMessage *> > MsgQueue;
+
+    /* the list with its size, which is linear before C++11 */
+    class MsgQueue : private std::list<MsgItem> {
+    public:
+        typedef std::list<MsgItem> Base;
+        typedef Base::iterator iterator;
+        typedef Base::reverse_iterator reverse_iterator;
+
+        MsgQueue() : size_(0) { }
+
+        using Base::begin;
+        using Base::end;
+        using Base::rbegin;
+        using Base::rend;
+        using Base::front;
+        using Base::empty;
+
+        size_t size() const { return size_; }
+
+        void push_back(const MsgItem &item)  { Base::push_back(item); size_++;  }
+        void push_front(const MsgItem &item) { Base::push_front(item); size_++; }
+        void pop_front()                     { Base::pop_front(); size_--;      }
+        void erase(iterator it)              { Base::erase(it); size_--;        }
+        void clear()                         { Base::clear(); size_ = 0;        }
+
+    private:
+        size_t size_;
+    };
+
+    /* the queues of priorities, the higher one is sent first */
+    class SendQueue {
+    public:
+        SendQueue() : level_(0) { }
+
+        bool empty() const { return !size(); }
+
+        size_t size() const {
+            size_t n = 0;
+            for (int i = 0; i < kNumPriorities; i++) { n += queues_[i].size(); }
+            return n;
+        }
+
+        void push_back(const MsgItem &item, int level)  { queues_[level].push_back(item);  }
+        void push_front(const MsgItem &item, int level) { queues_[level].push_front(item); }
+
+        /* the first of the highest priority, kept until pop_front() */
+        MsgItem& front() {
+            level_ = 0;
+            while (queues_[level_].empty()) { level_++; }
+            return queues_[level_].front();
+        }
+        void pop_front() { queues_[level_].pop_front(); }
+
+        /* the level of the item handed out by front() */
+        int front_level() const { return level_; }
+
+        /* false if the message isn't queued */
+        bool erase(uint64_t seq) {
+            for (int i = 0; i < kNumPriorities; i++) {
+                MsgQueue &msgq = queues_[i];
+                for (MsgQueue::iterator it = msgq.begin(); it != msgq.end(); ++it) {
+                    if (it->first == seq) { msgq.erase(it); return true; }
+                }
+            }
+            return false;
+        }
+
+        MsgQueue& level(int level) { return queues_[level]; }
+
+        void clear() {
+            for (int i = 0; i < kNumPriorities; i++) { queues_[i].clear(); }
+        }
+
+    private:
+        MsgQueue queues_[kNumPriorities];
+        int level_;
+    };
 
     MsgQueue::iterator find_if(MsgQueue &msgq, uint64_t seq);
 
+    /* an attempt of the call, without retrying */
+    void StartCall(const google::protobuf::MethodDescriptor *method,
+                   ClientController *controller,
+                   const google::protobuf::Message *request,
+                   google::protobuf::Message *response,
+                   google::protobuf::Closure *done);
+
+    /* bound by max_pending and max_inflight */
+    bool Limited(const google::protobuf::MethodDescriptor *method) const;
+    bool HasCapacity() const;
+    bool WindowFull() const;
+    void OnSlotFreed();
+
+    /* the flow credits of the server */
+    void TakeCredit(const MsgMeta &meta);
+    void ResetCredit();
+
     typedef std::pair<uint64_t, Compressor *> LocalComp;
     typedef std::map<pthread_t, LocalComp>::iterator CompIte;
 
+    void CallLocal(ClientMessage *msg,
+                   const google::protobuf::Message *request);
+    void CancelLocal(ClientMessage *msg);
+    void CloseLocal();
+
+    void NewUnixTimer();
+    void DelUnixTimer();
+    void HandleUnixTimer();
+
     static Compressor* new_compressor_if_not(pthread_t tid);
     static void del_compressor_if_zero(Compressor *target, pthread_t tid);
 
@@ -88,7 +221,18 @@ private:
     uint64_t sequence_;
 
     MsgQueue recvq_;
-    MsgQueue sendq_;
+    SendQueue sendq_;
+
+    /* the calls held for the limits, if wait_for_capacity */
+    MsgQueue waitq_;
+
+    /* the retry policies of methods */
+    Retrier retrier_;
+
+    /* granted by the server in responses, ZERO is unlimited */
+    uint32_t credit_requests_;
+    uint32_t credit_bytes_;
+    uint64_t recv_bytes_;   /* the request bytes of recvq_ */
     MsgItem cur_send_;
     ClientConnection *conn_;
 
@@ -107,10 +251,33 @@ private:
     ClientController controller_;
     internal::MethodClosure0<ChannelImpl> closure_;
 
+    /* the unix domain socket advertised by the server */
+    std::string unix_path_;
+    bool unix_failed_;
+    bool has_probe_;
+    bool has_switch_;
+    bool has_unix_timer_;
+    Timer unix_timer_;
+    StatusRequest probe_request_;
+    StatusResponse probe_response_;
+    ClientController probe_controller_;
+    internal::MethodClosure0<ChannelImpl> probe_closure_;
+
+    /* the server of in-process channel */
+    ServerImpl *server_;
+    Worker *worker_;
+    LocalPeer *peer_;
+
     /* thread local compressor */
     Compressor *compressor_;
     static pthread_mutex_t mutex_;
     static std::map<pthread_t, LocalComp> compressors_;
+
+    /* thread local client stats */
+    StatsTable *stats_;
+
+    /* thread local measure of event loop */
+    LoopMonitor *loop_;
 };
 
 } // namespace qrpc
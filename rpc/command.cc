@@ -5,8 +5,17 @@
 #include "src/qrpc/util/log.h"
 #include "src/qrpc/util/compiler.h"
 #include "src/qrpc/util/atomic.h"
+#include "src/qrpc/util/cycles.h"
 #include "src/qrpc/util/completion.h"
+#include "src/qrpc/util/event_queue.h"
 #include "src/qrpc/rpc/errno.h"
+#include "src/qrpc/rpc/closure.h"
+#include "src/qrpc/rpc/controller.h"
+#include "src/qrpc/rpc/controller_client.h"
+#include "src/qrpc/rpc/controller_server.h"
+#include "src/qrpc/rpc/message.h"
+#include "src/qrpc/rpc/channel.h"
+#include "src/qrpc/rpc/channel_impl.h"
 #include "src/qrpc/rpc/worker.h"
 #include "src/qrpc/rpc/command.h"
 
@@ -66,4 +75,137 @@ void Listen::operator()()
     worker_->HandleListen(this);
 }
 
+LocalPeer::LocalPeer(ChannelImpl *channel, event_base *base)
+    : closed_(false)
+    , ev_queue_(NULL)
+    , channel_(channel)
+{
+    atomic_set(&ref_, 1);
+    pthread_mutex_init(&mutex_, NULL);
+
+    ev_queue_ = new EvQueue(base);
+    if (!ev_queue_) {
+        LOG(FATAL) << "alloc event queue failed!!!";
+    }
+}
+
+LocalPeer::~LocalPeer()
+{
+    assert(closed_ == true);
+
+    pthread_mutex_destroy(&mutex_);
+}
+
+bool LocalPeer::Push(Task *task)
+{
+    bool res = false;
+
+    pthread_mutex_lock(&mutex_);
+    if (!closed_) {
+        res = ev_queue_->Push(task);
+    }
+    pthread_mutex_unlock(&mutex_);
+
+    return res;
+}
+
+void LocalPeer::Close()
+{
+    pthread_mutex_lock(&mutex_);
+    closed_ = true;
+    pthread_mutex_unlock(&mutex_);
+
+    /* drop the undelivered responses */
+    delete ev_queue_;
+    ev_queue_ = NULL;
+    channel_ = NULL;
+}
+
+void LocalPeer::Add(ServerMessage *msg)
+{
+    calls_.insert(std::make_pair(msg->id(), msg));
+}
+
+ServerMessage* LocalPeer::Find(uint64_t sequence) const
+{
+    std::map<uint64_t, ServerMessage *>::const_iterator it = calls_.find(sequence);
+    if (it == calls_.end()) {
+        return NULL;
+    }
+
+    return it->second;
+}
+
+LocalCall::LocalCall(Worker *worker, LocalPeer *peer, const MsgMeta &meta)
+    : worker_(worker)
+    , peer_(peer)
+    , meta_(meta)
+    , created_(rdtsc())
+    , request_(NULL)
+{
+    peer_->Get();
+}
+
+LocalCall::~LocalCall()
+{
+    delete request_;
+    peer_->Put();
+}
+
+void LocalCall::Quit()
+{
+    delete this;
+}
+
+void LocalCall::operator()()
+{
+    worker_->HandleLocalCall(this);
+}
+
+LocalCancel::LocalCancel(Worker *worker, LocalPeer *peer, uint64_t sequence)
+    : worker_(worker)
+    , peer_(peer)
+    , sequence_(sequence)
+{
+    peer_->Get();
+}
+
+LocalCancel::~LocalCancel()
+{
+    peer_->Put();
+}
+
+void LocalCancel::Quit()
+{
+    delete this;
+}
+
+void LocalCancel::operator()()
+{
+    worker_->HandleLocalCancel(this);
+}
+
+LocalDone::LocalDone(LocalPeer *peer, ServerMessage *msg)
+    : peer_(peer)
+    , msg_(msg)
+{
+
+}
+
+LocalDone::~LocalDone()
+{
+    delete msg_;
+}
+
+void LocalDone::Quit()
+{
+    delete this;
+}
+
+void LocalDone::operator()()
+{
+    peer_->channel()->OnLocalDone(msg_);
+    delete this;
+}
+
 } // namespace qrpc
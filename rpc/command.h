@@ -2,16 +2,23 @@
 #define QRPC_RPC_COMMAND_H
 
 #include <stdint.h>
+#include <pthread.h>
+#include <event.h>
+#include <map>
 #include <string>
 
 #include "src/qrpc/util/atomic.h"
 #include "src/qrpc/util/completion.h"
 #include "src/qrpc/util/task.h"
+#include "src/qrpc/rpc/message.pb.h"
 
 namespace qrpc {
 
 class Worker;
 class ServerImpl;
+class ChannelImpl;
+class ServerMessage;
+class EvQueue;
 
 /* accept a new socket */
 class Link : public Task {
@@ -60,6 +67,116 @@ private:
     void operator=(const Listen &);
 };
 
+/*
+ * The in-process channel shared with the workers.
+ *
+ * It's referenced by every pending request, and stops delivering
+ * the responses once the channel is closed.
+ */
+class LocalPeer {
+public:
+    explicit LocalPeer(ChannelImpl *channel, event_base *base);
+
+    void Get() { atomic_inc(&ref_); }
+    void Put() { if (atomic_dec_and_test(&ref_)) { delete this; } }
+
+    /* deliver the task to the channel's thread */
+    bool Push(Task *task);
+
+    /* called by the channel before releasing */
+    void Close();
+
+    ChannelImpl* channel() { return channel_; }
+
+    /* the requests in the worker, used by the worker thread only */
+    void Add(ServerMessage *msg);
+    void Remove(uint64_t sequence) { calls_.erase(sequence); }
+    ServerMessage* Find(uint64_t sequence) const;
+
+private:
+    ~LocalPeer();
+
+private:
+    atomic_t ref_;
+    bool closed_;
+    pthread_mutex_t mutex_;
+    EvQueue *ev_queue_;
+    ChannelImpl *channel_;
+
+    std::map<uint64_t, ServerMessage *> calls_;
+
+private:
+    /* No copying allowed */
+    LocalPeer(const LocalPeer &);
+    void operator=(const LocalPeer &);
+};
+
+/* a request of in-process channel */
+class LocalCall : public Task {
+public:
+    explicit LocalCall(Worker *worker, LocalPeer *peer, const MsgMeta &meta);
+    virtual ~LocalCall();
+
+    virtual void Quit();
+    virtual void operator()();
+
+public:
+    Worker *worker_;
+    LocalPeer *peer_;
+    MsgMeta meta_;
+
+    /* the cycles of calling, the wait in EvQueue is queuing */
+    uint64_t created_;
+
+    /* either the copied or the serialized request */
+    google::protobuf::Message *request_;
+    std::string data_;
+
+private:
+    /* No copying allowed */
+    LocalCall(const LocalCall &);
+    void operator=(const LocalCall &);
+};
+
+/* the cancel of a request of in-process channel */
+class LocalCancel : public Task {
+public:
+    explicit LocalCancel(Worker *worker, LocalPeer *peer, uint64_t sequence);
+    virtual ~LocalCancel();
+
+    virtual void Quit();
+    virtual void operator()();
+
+public:
+    Worker *worker_;
+    LocalPeer *peer_;
+    uint64_t sequence_;
+
+private:
+    /* No copying allowed */
+    LocalCancel(const LocalCancel &);
+    void operator=(const LocalCancel &);
+};
+
+/* a response of in-process channel */
+class LocalDone : public Task {
+public:
+    explicit LocalDone(LocalPeer *peer, ServerMessage *msg);
+    virtual ~LocalDone();
+
+    virtual void Quit();
+    virtual void operator()();
+
+public:
+    LocalPeer *peer_;
+    ServerMessage *msg_;
+
+private:
+    /* No copying allowed */
+    LocalDone(const LocalDone &);
+    void operator=(const LocalDone &);
+};
+
 } // namespace qrpc
 
 #endif /* QRPC_RPC_COMMAND_H */
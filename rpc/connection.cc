@@ -14,8 +14,11 @@
 
 #include "src/qrpc/util/log.h"
 #include "src/qrpc/util/timer.h"
+#include "src/qrpc/util/crc32c.h"
 #include "src/qrpc/util/socket.h"
 #include "src/qrpc/util/compiler.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/util/probe.h"
 #include "src/qrpc/rpc/errno.h"
 #include "src/qrpc/rpc/closure.h"
 #include "src/qrpc/rpc/controller.h"
@@ -30,6 +33,10 @@
 #include "src/qrpc/rpc/server_impl.h"
 #include "src/qrpc/rpc/worker.h"
 #include "src/qrpc/rpc/compressor.h"
+#include "src/qrpc/rpc/shm_transport.h"
+#include "src/qrpc/rpc/http_service.h"
+#include "src/qrpc/rpc/rpcz.h"
+#include "src/qrpc/rpc/loop_monitor.h"
 #include "src/qrpc/rpc/connection.h"
 
 using namespace std;
@@ -61,13 +68,28 @@ Connection::Connection()
     , hdr_meta_(NULL)
     , hdr_data_(NULL)
     , hdr_payload_(NULL)
+    , hdr_crc_(NULL)
+    , checksum_(false)
     , compressor_(NULL)
+    , shm_(NULL)
+    , shm_upload_(false)
+    , accept_shm_(false)
+    , sniff_http_(false)
+    , rpcz_(false)
+    , rstamp_(0)
+    , rtime_(0)
+    , recv_budget_(0)
+    , recv_yield_(false)
+    , loop_(NULL)
+    , peer_(NULL)
 {
 
 }
 
 Connection::~Connection()
 {
+    assert(shm_ == NULL);
+
     free(rbuf_);
     free(wbuf_);
 
@@ -78,6 +100,15 @@ void __always_inline Connection::EnableUpload()
 {
     short events = EV_READ | EV_WRITE | EV_PERSIST;
 
+    /* the ring is always writable, so kick the event once */
+    if (shm_) {
+        if (!shm_upload_) {
+            shm_upload_ = true;
+            event_active(&event_, EV_WRITE, 1);
+        }
+        return;
+    }
+
     if (events == event_get_events(&event_)) {
         return;
     }
@@ -103,6 +134,11 @@ void __always_inline Connection::DisableUpload()
 {
     short events = EV_READ | EV_PERSIST;
 
+    if (shm_) {
+        shm_upload_ = false;
+        return;
+    }
+
     if (events == event_get_events(&event_)) {
         return;
     }
@@ -124,6 +160,21 @@ void __always_inline Connection::DisableUpload()
     }
 }
 
+int __always_inline Connection::WriteHdrSize() const
+{
+    return (checksum_ ? kMsgMaxHdrSize : kMsgHdrSize);
+}
+
+void Connection::AssignWbuf(char *buf)
+{
+    hdr_payload_ = wbuf_ = buf;
+    hdr_data_ = wbuf_ + kMsgPayloadSize;
+    hdr_meta_ = wbuf_ + kMsgPayloadSize + kMsgDataSize;
+    hdr_comp_ = wbuf_ + kMsgPayloadSize + kMsgDataSize + kMsgMetaSize;
+    hdr_crc_ = wbuf_ + kMsgHdrSize;
+    msg_body_ = wbuf_ + WriteHdrSize();
+}
+
 bool Connection::ExpandWbuf(size_t required)
 {
     do {
@@ -136,11 +187,7 @@ bool Connection::ExpandWbuf(size_t required)
         return false;
     }
 
-    hdr_payload_ = wbuf_ = nbuf;
-    hdr_data_ = wbuf_ + kMsgPayloadSize;
-    hdr_meta_ = wbuf_ + kMsgPayloadSize + kMsgDataSize;
-    hdr_comp_ = wbuf_ + kMsgPayloadSize + kMsgDataSize + kMsgMetaSize;
-    msg_body_ = wbuf_ + kMsgHdrSize;
+    AssignWbuf(nbuf);
 
     return true;
 }
@@ -162,8 +209,12 @@ Connection::Status Connection::Encode()
     int meta, data;
     wmsg_->ByteSize(&meta, &data);
 
+    /* the header size may change when the peer enables checksum */
+    int hdr_size = WriteHdrSize();
+    msg_body_ = wbuf_ + hdr_size;
+
     int payload = meta + data;
-    int required = payload + kMsgHdrSize;
+    int required = payload + hdr_size;
 
     if (comp != kNoCompression) {
         compress = true;
@@ -192,13 +243,13 @@ Connection::Status Connection::Encode()
         }
 
 compress:
-        size_t rlen = wsize_ - kMsgHdrSize;
+        size_t rlen = wsize_ - hdr_size;
         int rc = compressor_->Compress(temp, payload, msg_body_, rlen, &rlen);
 
         switch (rc) {
         case kCompOk:
             payload = rlen;
-            required = payload + kMsgHdrSize;
+            required = payload + hdr_size;
             break;
         case kCompBufferTooSmall:
             if (ExpandWbuf(wsize_ * 2)) {
@@ -213,6 +264,12 @@ compress:
         }
     }
 
+    if (checksum_) {
+        uint32_t crc = htonl(Value(msg_body_, payload));
+        memcpy(hdr_crc_, &crc, kMsgCrcSize);
+        comp |= kMsgCrcFlag;
+    }
+
     net_hdr.comp = comp;
     net_hdr.meta = htons(meta);
     net_hdr.data = htonl(data);
@@ -223,6 +280,8 @@ compress:
     memcpy(hdr_data_, &net_hdr.data, kMsgDataSize);
     memcpy(hdr_payload_, &net_hdr.payload, kMsgPayloadSize);
 
+    QRPC_PROBE6(encode, wmsg_, this, meta, data, payload, comp);
+
     wcur_ = wbuf_;
     wbytes_ = required;
 
@@ -239,6 +298,7 @@ Connection::Status Connection::Decode()
     } __attribute__((aligned(1)));
 
     NetHeader *net_hdr = (NetHeader *)rcur_;
+    int hdr_size = kMsgHdrSize;
 
 header:
     if (rmsg_hdr_.payload_) {
@@ -249,19 +309,37 @@ header:
         return kDecodeFragment;
     }
 
-    rmsg_hdr_.compression_ = net_hdr->comp;
+    if (net_hdr->comp & kMsgCrcFlag) {
+        hdr_size += kMsgCrcSize;
+        if (rbytes_ < hdr_size) {
+            return kDecodeFragment;
+        }
+
+        uint32_t crc;
+        memcpy(&crc, rcur_ + kMsgHdrSize, kMsgCrcSize);
+        rmsg_hdr_.crc_ = ntohl(crc);
+        rmsg_hdr_.checksum_ = 1;
+    }
+
+    rmsg_hdr_.compression_ = net_hdr->comp & ~kMsgCrcFlag;
     rmsg_hdr_.meta_ = ntohs(net_hdr->meta);
     rmsg_hdr_.data_ = ntohl(net_hdr->data);
     rmsg_hdr_.payload_ = ntohl(net_hdr->payload);
 
-    rcur_ += kMsgHdrSize;
-    rbytes_ -= kMsgHdrSize;
+    rcur_ += hdr_size;
+    rbytes_ -= hdr_size;
 
 payload:
     if (rbytes_ < rmsg_hdr_.payload_) {
         return kDecodeFragment;
     }
 
+    if (rmsg_hdr_.checksum_ &&
+        rmsg_hdr_.crc_ != Value(rcur_, rmsg_hdr_.payload_)) {
+        LOG(ERROR) << "checksum mismatch, payload: " << rmsg_hdr_.payload_;
+        return kDecodeError;
+    }
+
     if (rmsg_hdr_.compression_ == kNoCompression) {
         rmsg_ = rcur_;
     } else {
@@ -292,6 +370,9 @@ payload:
     rcur_ += rmsg_hdr_.payload_;
     rbytes_ -= rmsg_hdr_.payload_;
 
+    QRPC_PROBE5(decode, this, rmsg_hdr_.meta_, rmsg_hdr_.data_,
+                rmsg_hdr_.payload_, rmsg_hdr_.compression_);
+
     return kDecodeOk;
 
     /* avoid gcc warning */
@@ -343,22 +424,33 @@ read_much:
     }
 
     avail = rsize_ - rbytes_;
-    res = recv(sfd_, rbuf_ + rbytes_, avail, 0);
+    if (shm_) {
+        res = shm_->Read(rbuf_ + rbytes_, avail);
+    } else if (unlikely(accept_shm_)) {
+        res = AcceptShm(rbuf_ + rbytes_, avail);
+    } else {
+        res = recv(sfd_, rbuf_ + rbytes_, avail, 0);
+    }
 
     if (res > 0) {
         rbytes_ += res;
         status = kRecvOk;
+        QRPC_PROBE2(recv, this, res);
         if (res == avail) {
             goto read_much;
         } else {
             goto out;
         }
+    } else if (res == 0 && shm_) {
+        /* the ring is empty */
+        goto out;
     } else if (res == 0) {
         status = kRecvError;
     } else {
         if (errno == EINTR) {
             goto read_much;
         } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            QRPC_PROBE2(recv_again, this, rbytes_);
             goto out;
         } else {
             status = kRecvError;
@@ -373,11 +465,18 @@ out:
 bool Connection::OnRecv()
 {
     bool result = true;
+    int decoded = 0;
+
+    if (recv_yield_) {
+        recv_yield_ = false;
+        evtimer_del(&recv_event_);
+    }
 
     for (; ;) {
         if (rstate_ == kRead) {
             switch (Recv()) {
             case kRecvOk:
+                rtime_ = rdtsc();
                 rstate_ = kParse;
                 break;
             case kRecvAgain:
@@ -392,12 +491,36 @@ bool Connection::OnRecv()
                 break;
             }
         } else if (rstate_ == kParse) {
+            if (unlikely(sniff_http_)) {
+                if (rbytes_ < kHttpSniffSize) {
+                    rstate_ = kWait;
+                    continue;
+                }
+
+                sniff_http_ = false;
+                if (HttpService::IsHttp(rcur_, rbytes_)) {
+                    result = OnHttp();
+                    break;
+                }
+            }
+
             switch (Decode()) {
             case kDecodeOk:
+                if (unlikely(rpcz_)) {
+                    rstamp_ = rdtsc();
+                }
                 RecvDone(rmsg_, rmsg_hdr_.meta_, rmsg_hdr_.data_);
                 memset(&rmsg_hdr_, 0, sizeof(rmsg_hdr_));
                 rmsg_ = NULL;
                 rstate_ = kParse;
+
+                /* parse the rest after polling the other connections */
+                if (recv_budget_ && ++decoded >= recv_budget_) {
+                    struct timeval tv = { 0, 0 };
+                    recv_yield_ = true;
+                    evtimer_add(&recv_event_, &tv);
+                    return true;
+                }
                 break;
             case kDecodeFragment:
                 rstate_ = kWait;
@@ -441,6 +564,9 @@ peek:
 
     switch (Encode()) {
     case kEncodeOk:
+        if (unlikely(rpcz_)) {
+            OnEncoded(wmsg_);
+        }
         break;
     case kEncodeError:
         return kSendError;
@@ -449,22 +575,29 @@ peek:
     }
 
 send:
-    res = send(sfd_, wcur_, wbytes_, MSG_NOSIGNAL);
+    if (shm_) {
+        res = shm_->Write(wcur_, wbytes_);
+    } else {
+        res = send(sfd_, wcur_, wbytes_, MSG_NOSIGNAL);
+    }
 
     if (res > 0) {
         wcur_ += res;
         wbytes_ -= res;
+        QRPC_PROBE3(send, this, res, wbytes_);
         if (wbytes_ == 0) {
             return kSendOk;
         } else {
             return kSendAgain;
         }
     } else if (res == 0) {
+        QRPC_PROBE2(send_again, this, wbytes_);
         return kSendAgain;
     } else {
         if (errno == EINTR) {
             goto send;
         } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            QRPC_PROBE2(send_again, this, wbytes_);
             return kSendAgain;
         } else {
             DLOG(ERROR) << "send msg failed: " << strerror(errno);
@@ -525,20 +658,207 @@ bool Connection::OnSend()
 void Connection::HandleConnectedEvent(int fd, short flags, void *arg)
 {
     Connection *me = (Connection *)arg;
+    LoopScope scope(me->loop_, me->peer_);
 
     if ((flags & EV_READ) && !me->OnRecv()) {
         DLOG(ERROR) << "recv message failed!!!";
+        scope.Closed();
         me->RecvFail();
         return;
     }
 
     if ((flags & EV_WRITE) && !me->OnSend()) {
         DLOG(ERROR) << "send message failed!!!";
+        scope.Closed();
         me->SendFail();
         return;
     }
 }
 
+/*
+ * The first read of a unix domain socket connection, which takes the
+ * shared memory segment if the client offers it.
+ *
+ * @return the bytes read as recv()
+ */
+int Connection::AcceptShm(char *buf, int len)
+{
+    int fds[kShmFds];
+    int nfds = 0;
+
+    int res = ShmTransport::RecvFds(sfd_, buf, len, fds, &nfds);
+    if (res <= 0) {
+        return res;
+    }
+
+    accept_shm_ = false;
+
+    /* a plain unix domain socket client */
+    if (nfds == 0) {
+        return res;
+    }
+
+    if (nfds != kShmFds || res != kShmMagicSize ||
+        memcmp(buf, kShmMagic, kShmMagicSize)) {
+        LOG(ERROR) << "invalid shm handshake";
+        for (int i = 0; i < nfds; ++i) {
+            close(fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    ShmTransport *shm = ShmTransport::Attach(fds);
+    if (!shm) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    event_base *base = event_get_base(&event_);
+
+    if (event_del(&event_)) {
+        LOG(FATAL) << "delete event failed!!!";
+    }
+
+    UseShm(shm, base);
+
+    /* the messages are read from the ring since now */
+    return 0;
+}
+
+/*
+ * Wait for the eventfd of the shared memory, and watch the socket
+ * only for the close of peer.
+ */
+void Connection::UseShm(ShmTransport *shm, event_base *base)
+{
+    assert(shm_ == NULL);
+
+    shm_ = shm;
+    shm_upload_ = false;
+
+    if (event_assign(&event_, base, shm->fd(),
+                     EV_READ | EV_PERSIST,
+                     HandleShmEvent, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+    if (event_add(&event_, 0)) {
+        LOG(FATAL) << "add event failed!!!";
+    }
+
+    if (event_assign(&shm_event_, base, sfd_,
+                     EV_READ | EV_PERSIST,
+                     HandleShmSockEvent, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+    if (event_add(&shm_event_, 0)) {
+        LOG(FATAL) << "add event failed!!!";
+    }
+}
+
+void Connection::DelShm()
+{
+    if (!shm_) {
+        return;
+    }
+
+    event_del(&shm_event_);
+    delete shm_;
+    shm_ = NULL;
+    shm_upload_ = false;
+}
+
+void Connection::HandleShmEvent(int fd, short flags, void *arg)
+{
+    Connection *me = (Connection *)arg;
+    ShmTransport *shm = me->shm_;
+    int spins = 0;
+
+    LoopScope scope(me->loop_, me->peer_);
+
+    if (flags & EV_READ) {
+        shm->Drain();
+    }
+
+    for (; ;) {
+        if (!me->OnRecv()) {
+            DLOG(ERROR) << "recv message failed!!!";
+            scope.Closed();
+            me->RecvFail();
+            return;
+        }
+
+        if (me->shm_upload_ && !me->OnSend()) {
+            DLOG(ERROR) << "send message failed!!!";
+            scope.Closed();
+            me->SendFail();
+            return;
+        }
+
+        /* out of the budget, it goes on after polling */
+        if (me->recv_yield_) {
+            break;
+        }
+
+        /* poll a while before falling asleep */
+        if (shm->Readable()) {
+            spins = 0;
+        } else if (spins++ < shm->spin_count()) {
+            cpu_relax();
+        } else if (shm->Park()) {
+            break;
+        }
+    }
+}
+
+void Connection::UseRecvBudget(int budget, event_base *base)
+{
+    recv_budget_ = budget;
+    if (!recv_budget_) {
+        return;
+    }
+
+    if (event_assign(&recv_event_, base, -1, 0, HandleRecvEvent, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+}
+
+void Connection::DelRecvBudget()
+{
+    if (!recv_budget_) {
+        return;
+    }
+
+    evtimer_del(&recv_event_);
+    recv_yield_ = false;
+}
+
+void Connection::HandleRecvEvent(int fd, short flags, void *arg)
+{
+    Connection *me = (Connection *)arg;
+
+    if (me->shm_) {
+        HandleShmEvent(fd, 0, arg);
+    } else {
+        HandleConnectedEvent(fd, EV_READ, arg);
+    }
+}
+
+void Connection::HandleShmSockEvent(int fd, short flags, void *arg)
+{
+    Connection *me = (Connection *)arg;
+    char buf[64];
+
+    int res = recv(fd, buf, sizeof(buf), 0);
+    if (res < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+
+    /* nothing is expected on the socket except closing */
+    DLOG(ERROR) << "shm peer closed!!!";
+    me->RecvFail();
+}
+
 // -------------------------------------------------------------
 // class ServerConnection
 // -------------------------------------------------------------
@@ -552,12 +872,19 @@ ServerConnection::ServerConnection(Worker *worker, int sfd,
     , connected_(true)
     , local_addr_(local_addr)
     , remote_addr_(remote_addr)
+    , same_host_(false)
+    , credit_requests_(0)
+    , credit_bytes_(0)
+    , requests_(0)
+    , created_(time(NULL))
+    , http_(false)
+    , http_sent_(0)
 {
     const ServerOptions &options = worker->server_impl()->options();
 
     rsize_ = options.min_rbuf_size;
-    if (rsize_ < kMsgHdrSize) {
-        rsize_ = kMsgHdrSize;
+    if (rsize_ < kMsgMaxHdrSize) {
+        rsize_ = kMsgMaxHdrSize;
     }
     rbuf_ = (char *)malloc(rsize_);
     if (!rbuf_) {
@@ -566,20 +893,36 @@ ServerConnection::ServerConnection(Worker *worker, int sfd,
     rcur_ = rbuf_;
 
     wsize_ = options.min_sbuf_size;
-    if (wsize_ < kMsgHdrSize) {
-        wsize_ = kMsgHdrSize;
+    if (wsize_ < kMsgMaxHdrSize) {
+        wsize_ = kMsgMaxHdrSize;
     }
-    wbuf_ = (char *)malloc(wsize_);
-    if (!wbuf_) {
+    char *wbuf = (char *)malloc(wsize_);
+    if (!wbuf) {
         LOG(FATAL) << "alloc write buf failed!!!";
     }
-    hdr_payload_ = wbuf_;
-    hdr_data_ = wbuf_ + kMsgPayloadSize;
-    hdr_meta_ = wbuf_ + kMsgPayloadSize + kMsgDataSize;
-    hdr_comp_ = wbuf_ + kMsgPayloadSize + kMsgDataSize + kMsgMetaSize;
-    msg_body_ = wbuf_ + kMsgHdrSize;
+    AssignWbuf(wbuf);
 
     compressor_ = worker->compressor();
+    UseRecvBudget(options.recv_budget, worker->base());
+
+    /* the client may offer the shared memory over unix domain socket */
+    accept_shm_ = is_unix_addr(local_addr.c_str());
+
+    /* the unix domain socket, or the TCP of the same address */
+    same_host_ = accept_shm_ || !local_addr.compare(0, local_addr.rfind(':'),
+            remote_addr, 0, remote_addr.rfind(':'));
+
+    /* tell the HTTP request from the RPC by the first bytes */
+    sniff_http_ = options.http_service;
+
+    credit_requests_ = options.flow_credit_requests;
+    credit_bytes_ = options.flow_credit_bytes;
+
+    /* take the timestamps of stages for the sampled requests */
+    rpcz_ = (worker->rpcz() != NULL);
+
+    loop_ = worker->loop();
+    peer_ = &remote_addr_;
 
     sfd_ = sfd;
     if (event_assign(&event_, worker->base(), sfd,
@@ -619,6 +962,8 @@ void ServerConnection::CloseConnection()
     }
 
     event_del(&event_);
+    DelShm();
+    DelRecvBudget();
     close(sfd_);
     sfd_ = -1;
     connected_ = false;
@@ -663,6 +1008,140 @@ void ServerConnection::Send(ServerMessage *msg)
     OnRpcResponse(msg);
 }
 
+void ServerConnection::OnEncoded(Message *msg)
+{
+    ServerMessage *srv_msg = (ServerMessage *)msg;
+
+    if (srv_msg->rpcz()) {
+        srv_msg->Stamp(kRpczEncode);
+        srv_msg->rpcz()->response_size = wbytes_;
+    }
+}
+
+const char* ServerConnection::transport()
+{
+    if (http_) {
+        return "http";
+    }
+    if (shm_) {
+        return "shm";
+    }
+    if (is_unix_addr(local_addr_.c_str())) {
+        return "unix";
+    }
+
+    return "tcp";
+}
+
+/*
+ * Switch the connection to HTTP, which is served by the handler of
+ * its own, and closed after the response is sent.
+ */
+bool ServerConnection::OnHttp()
+{
+    http_ = true;
+
+    event_base *base = event_get_base(&event_);
+
+    if (event_del(&event_)) {
+        LOG(FATAL) << "delete event failed!!!";
+    }
+    if (event_assign(&event_, base, sfd_,
+                     EV_READ | EV_PERSIST,
+                     HandleHttpEvent, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+    if (event_add(&event_, 0)) {
+        LOG(FATAL) << "add event failed!!!";
+    }
+
+    /* the request may have been read completely */
+    if (HttpService::HeaderSize(rcur_, rbytes_)) {
+        event_active(&event_, EV_READ, 1);
+    }
+
+    return true;
+}
+
+bool ServerConnection::OnHttpRecv()
+{
+    /* ignore the bytes after the request */
+    if (!http_rsp_.empty()) {
+        return true;
+    }
+
+    int size = HttpService::HeaderSize(rcur_, rbytes_);
+
+    if (!size) {
+        if (Recv() == kRecvError) {
+            return false;
+        }
+        size = HttpService::HeaderSize(rcur_, rbytes_);
+    }
+
+    if (!size) {
+        if (rbytes_ > kHttpMaxHeaderSize) {
+            LOG(ERROR) << "the HTTP request header is too long";
+            return false;
+        }
+        return true;
+    }
+
+    worker_->server_impl()->http_service()->Serve(rcur_, size, &http_rsp_);
+
+    event_base *base = event_get_base(&event_);
+
+    if (event_del(&event_)) {
+        LOG(FATAL) << "delete event failed!!!";
+    }
+    if (event_assign(&event_, base, sfd_,
+                     EV_WRITE | EV_PERSIST,
+                     HandleHttpEvent, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+    if (event_add(&event_, 0)) {
+        LOG(FATAL) << "add event failed!!!";
+    }
+
+    return true;
+}
+
+/* @return false if it's failed or finished */
+bool ServerConnection::OnHttpSend()
+{
+    while (http_sent_ < http_rsp_.size()) {
+        int res = send(sfd_, http_rsp_.data() + http_sent_,
+                       http_rsp_.size() - http_sent_, MSG_NOSIGNAL);
+        if (res > 0) {
+            http_sent_ += res;
+        } else if (res < 0 && errno == EINTR) {
+            continue;
+        } else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else {
+            DLOG(ERROR) << "send HTTP response failed: " << strerror(errno);
+            return false;
+        }
+    }
+
+    return false;
+}
+
+void ServerConnection::HandleHttpEvent(int fd, short flags, void *arg)
+{
+    ServerConnection *me = (ServerConnection *)arg;
+
+    if ((flags & EV_READ) && !me->OnHttpRecv()) {
+        me->RecvFail();
+        return;
+    }
+
+    if ((flags & EV_WRITE) && !me->OnHttpSend()) {
+        me->SendFail();
+        return;
+    }
+}
+
 void ServerConnection::HandleClockKeepalive()
 {
     has_timer_ = false;
@@ -793,7 +1272,7 @@ ServerConnection::OnRpcCancel(const MsgMeta &meta)
     MsgQueue::iterator it;
 
     /* FIXME: Connection::Encode() */
-    if (cur_send_.second->id() == meta.sequence()) {
+    if (cur_send_.second && cur_send_.second->id() == meta.sequence()) {
         return;
     }
 
@@ -816,8 +1295,15 @@ void __always_inline
 ServerConnection::OnRpcRequest(ServerMessage *msg)
 {
     recvq_.push_back(MsgItem(msg->id(), msg));
+    requests_++;
 
-    msg->CallMethod();
+    if (unlikely(credit_requests_ || credit_bytes_)) {
+        worker_->Hold(msg->request_size());
+    }
+
+    QRPC_PROBE2(server_request, msg, this);
+
+    worker_->Serve(msg);
 
     if (!use_clock_) {
         UpdTimerKeepalive();
@@ -838,6 +1324,10 @@ ServerConnection::OnRpcResponse(ServerMessage *msg)
         LOG(FATAL) << "invalid message!!!";
     }
 
+    if (unlikely(credit_requests_ || credit_bytes_)) {
+        worker_->Unhold(msg->request_size());
+    }
+
     if (!connected_) {
         /* TODO: notify user */
         msg->FinishMethod();
@@ -846,12 +1336,40 @@ ServerConnection::OnRpcResponse(ServerMessage *msg)
         return;
     }
 
+    QRPC_PROBE3(server_response, msg, this, msg->msg_meta().code());
+
+    if (unlikely(credit_requests_ || credit_bytes_)) {
+        GrantCredit(msg);
+    }
+
     if (sendq_.empty()) {
         Connection::EnableUpload();
     }
     sendq_.push_back(MsgItem(msg->id(), msg));
 }
 
+/*
+ * The credit is the window of a connection while the worker holds
+ * less than it, and it shrinks in proportion to the excess, e.g.
+ * the connections of a saturated worker share it.
+ */
+static inline uint32_t share_credit(uint64_t credit, uint64_t held)
+{
+    if (!credit || held <= credit) {
+        return credit;
+    }
+
+    /* ZERO is unlimited */
+    credit = credit * credit / held;
+    return credit ? credit : 1;
+}
+
+void ServerConnection::GrantCredit(ServerMessage *msg)
+{
+    msg->SetCredit(share_credit(credit_requests_, worker_->held_requests()),
+                   share_credit(credit_bytes_, worker_->held_bytes()));
+}
+
 void __always_inline
 ServerConnection::OnRpcFinish(ServerMessage *msg)
 {
@@ -866,6 +1384,13 @@ ServerConnection::OnRpcFinish(ServerMessage *msg)
 
     msg->FinishMethod();
 
+    QRPC_PROBE3(server_finish, msg, this, msg->msg_meta().code());
+
+    if (unlikely(msg->rpcz() != NULL)) {
+        msg->Stamp(kRpczSent);
+        worker_->rpcz()->Add(*msg->rpcz());
+    }
+
     delete msg;
 
     if (!use_clock_) {
@@ -914,6 +1439,11 @@ bool ServerConnection::RecvDone(const char *payload, int meta, int data)
 {
     MsgMeta msg_meta;
 
+    /* the client is able to verify the checksum */
+    if (rmsg_hdr_.checksum_) {
+        checksum_ = true;
+    }
+
     bool rc = msg_meta.ParseFromArray(payload, meta);
     if (!rc) {
         LOG(ERROR) << "parse MsgMeta failed!!!";
@@ -931,8 +1461,13 @@ bool ServerConnection::RecvDone(const char *payload, int meta, int data)
         LOG(FATAL) << "alloc server message failed!!!";
     }
 
+    if (unlikely(rpcz_) && worker_->rpcz()->Sample()) {
+        msg->StartRpcz(rstamp_, data);
+    }
+
     rc = msg->ParseFromArray(payload + meta, data, msg_meta);
     if (rc) {
+        msg->Stamp(kRpczParse);
         OnRpcRequest(msg);
     } else {
         LOG(ERROR) << "parse request message failed!!!";
@@ -952,12 +1487,13 @@ ClientConnection::ClientConnection(ChannelImpl *channel)
     , connected_(false)
     , connecting_(false)
     , has_timer_(false)
+    , is_unix_(false)
 {
     const ChannelOptions &options = channel->options();
 
     rsize_ = options.min_rbuf_size;
-    if (rsize_ < kMsgHdrSize) {
-        rsize_ = kMsgHdrSize;
+    if (rsize_ < kMsgMaxHdrSize) {
+        rsize_ = kMsgMaxHdrSize;
     }
     rbuf_ = (char *)malloc(rsize_);
     if (!rbuf_) {
@@ -966,20 +1502,20 @@ ClientConnection::ClientConnection(ChannelImpl *channel)
     rcur_ = rbuf_;
 
     wsize_ = options.min_sbuf_size;
-    if (wsize_ < kMsgHdrSize) {
-        wsize_ = kMsgHdrSize;
+    if (wsize_ < kMsgMaxHdrSize) {
+        wsize_ = kMsgMaxHdrSize;
     }
-    wbuf_ = (char *)malloc(wsize_);
-    if (!wbuf_) {
+    char *wbuf = (char *)malloc(wsize_);
+    if (!wbuf) {
         LOG(FATAL) << "alloc write buf failed!!!";
     }
-    hdr_payload_ = wbuf_;
-    hdr_data_ = wbuf_ + kMsgPayloadSize;
-    hdr_meta_ = wbuf_ + kMsgPayloadSize + kMsgDataSize;
-    hdr_comp_ = wbuf_ + kMsgPayloadSize + kMsgDataSize + kMsgMetaSize;
-    msg_body_ = wbuf_ + kMsgHdrSize;
+    AssignWbuf(wbuf);
 
     compressor_ = channel->compressor();
+    checksum_ = options.frame_checksum;
+
+    loop_ = channel->loop();
+    peer_ = &remote_addr_;
 
     Connect();
 }
@@ -993,6 +1529,7 @@ ClientConnection::~ClientConnection()
     }
 
     event_del(&event_);
+    DelShm();
     close(sfd_);
     sfd_ = -1;
 }
@@ -1027,6 +1564,9 @@ inline void ClientConnection::NewIdle()
 
     has_timer_ = true;
 
+    /* fall back to TCP if the unix domain socket failed */
+    channel_->OnConnectFail();
+
     const ChannelOptions &options = channel_->options();
 
     timer_.Set(channel_->base(), options.retry_interval,
@@ -1055,6 +1595,7 @@ void ClientConnection::HandleWatchEvent()
     connecting_ = false;
 
     has_timer_ = false;
+    channel_->OnConnectFail();
     Connect();
 }
 
@@ -1112,16 +1653,33 @@ void ClientConnection::Connected()
     connecting_ = false;
     connected_ = true;
 
-    if (event_assign(&event_, channel_->base(), sfd_,
-                     EV_READ | EV_WRITE | EV_PERSIST,
-                     HandleConnectedEvent, this)) {
-        LOG(FATAL) << "set event failed!!!";
+    const ChannelOptions &options = channel_->options();
+
+    ShmTransport *shm = NULL;
+    if (is_unix_ && options.shm_ring_size) {
+        shm = ShmTransport::Create(options.shm_ring_size,
+                                   options.shm_spin_count);
+        if (shm && !shm->SendFds(sfd_)) {
+            delete shm;
+            shm = NULL;
+        }
     }
-    if (event_add(&event_, 0)) {
-        LOG(FATAL) << "add event failed!!!";
+
+    if (shm) {
+        UseShm(shm, channel_->base());
+        Connection::EnableUpload();
+    } else {
+        if (event_assign(&event_, channel_->base(), sfd_,
+                         EV_READ | EV_WRITE | EV_PERSIST,
+                         HandleConnectedEvent, this)) {
+            LOG(FATAL) << "set event failed!!!";
+        }
+        if (event_add(&event_, 0)) {
+            LOG(FATAL) << "add event failed!!!";
+        }
     }
 
-    if (channel_->options().heartbeat_interval) {
+    if (options.heartbeat_interval) {
         NewHeartbeat();
         DLOG(INFO) << "start the RPC hearbeat";
     } else {
@@ -1130,6 +1688,8 @@ void ClientConnection::Connected()
 
     local_addr_ = unresolve_desc(sfd_);
     remote_addr_ = unresolve_peer_desc(sfd_);
+
+    channel_->OnConnected(this);
 }
 
 void ClientConnection::HandleConnectingEvent(int fd, short flags, void *arg)
@@ -1200,7 +1760,8 @@ void ClientConnection::Connect()
 
     const ChannelOptions &options = channel_->options();
     int port = channel_->port();
-    const string& host = channel_->host();
+    const string& host = channel_->unix_path().empty()
+                       ? channel_->host() : channel_->unix_path();
 
     err = resolve_addr(host.c_str(), port, &si);
     if (err) {
@@ -1210,6 +1771,8 @@ void ClientConnection::Connect()
         return;
     }
 
+    is_unix_ = (si.family == AF_UNIX);
+
     sfd = socket(si.family, SOCK_STREAM, 0);
     if (sfd == -1) {
         LOG(ERROR) << "socket failed: "
@@ -1226,7 +1789,7 @@ void ClientConnection::Connect()
         return;
     }
 
-    if (set_tcpnodelay(sfd)) {
+    if (si.family != AF_UNIX && set_tcpnodelay(sfd)) {
         LOG(ERROR) << "set tcpnodelay failed: "
             << strerror(errno);
         close(sfd);
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <event.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <list>
 #include <map>
@@ -27,6 +28,8 @@ class Server;
 class ServerImpl;
 class Connection;
 class Compressor;
+class ShmTransport;
+class LoopMonitor;
 
 class Connection {
 protected:
@@ -42,6 +45,12 @@ protected:
     virtual bool SendNext(Message **msg) = 0; 
     virtual bool RecvDone(const char *payload, int meta, int data) = 0;
 
+    /* the first bytes are a HTTP request */
+    virtual bool OnHttp() { return false; }
+
+    /* the message is encoded, only if rpcz is enabled */
+    virtual void OnEncoded(Message *msg) { }
+
 protected:
     enum State {
         kListen         = 0,
@@ -73,6 +82,8 @@ protected:
     };
 
 protected:
+    int WriteHdrSize() const;
+    void AssignWbuf(char *buf);
     bool ExpandWbuf(size_t required);
     bool ExpandRbuf(size_t required);
 
@@ -87,6 +98,18 @@ protected:
 
     static void HandleConnectedEvent(int, short, void *);
 
+    int AcceptShm(char *buf, int len);
+    void UseShm(ShmTransport *shm, event_base *base);
+    void DelShm();
+
+    static void HandleShmEvent(int, short, void *);
+    static void HandleShmSockEvent(int, short, void *);
+
+    void UseRecvBudget(int budget, event_base *base);
+    void DelRecvBudget();
+
+    static void HandleRecvEvent(int, short, void *);
+
 protected:
     int             sfd_;
     State           rstate_;
@@ -110,8 +133,31 @@ protected:
     char*           hdr_meta_;
     char*           hdr_data_;
     char*           hdr_payload_;
+    char*           hdr_crc_;
+    bool            checksum_;
 
     Compressor*     compressor_;
+
+    ShmTransport*   shm_;
+    event           shm_event_;
+    bool            shm_upload_;
+    bool            accept_shm_;
+
+    bool            sniff_http_;
+
+    bool            rpcz_;
+    uint64_t        rstamp_;
+
+    /* the cycles of the latest read, the requests arrive before it */
+    uint64_t        rtime_;
+
+    /* the frames decoded per callback, the rest after polling */
+    int             recv_budget_;
+    bool            recv_yield_;
+    event           recv_event_;
+
+    LoopMonitor*    loop_;
+    std::string*    peer_;
     
 private:
     /* No copying allowed */
@@ -132,6 +178,20 @@ public:
     std::string& local_addr()  { return local_addr_;  }
     std::string& remote_addr() { return remote_addr_; }
 
+    /* for diagnostics */
+    const char* transport();
+    uint64_t requests() const  { return requests_;    }
+    time_t created()    const  { return created_;     }
+
+    /* the cycles of reading the request being received */
+    uint64_t read_time() const { return rtime_;       }
+
+    /* the client runs on this host, sharing the wall clock */
+    bool same_host()     const { return same_host_;   }
+
+    /* false once closed, the requests in process are kept */
+    bool connected()     const { return connected_;   }
+
 private:
     void CloseConnection();
     void ReleaseConnection();
@@ -150,6 +210,7 @@ private:
     void OnRpcFinish(ServerMessage *msg);
     void OnRpcRequest(ServerMessage *msg);
     void OnRpcResponse(ServerMessage *msg);
+    void GrantCredit(ServerMessage *msg);
 
     virtual void SendFail();
     virtual void RecvFail();
@@ -157,6 +218,14 @@ private:
     virtual bool SendNext(Message **msg); 
     virtual bool RecvDone(const char *payload, int meta, int data);
 
+    virtual void OnEncoded(Message *msg);
+
+    /* serve the HTTP request and close */
+    virtual bool OnHttp();
+    bool OnHttpRecv();
+    bool OnHttpSend();
+    static void HandleHttpEvent(int, short, void *);
+
 private:
     typedef std::pair<uint64_t, ServerMessage *> MsgItem;
     typedef std::list<std::pair<uint64_t, ServerMessage *> > MsgQueue;
@@ -178,6 +247,19 @@ private:
 
     std::string local_addr_;
     std::string remote_addr_;
+    bool same_host_;
+
+    /* the flow credits of the client, ZERO is disabled */
+    uint32_t credit_requests_;
+    uint32_t credit_bytes_;
+
+    uint64_t requests_;
+    time_t created_;
+
+    /* the HTTP response being sent */
+    bool http_;
+    std::string http_rsp_;
+    size_t http_sent_;
 };
 
 class ClientConnection : public Connection {
@@ -224,6 +306,7 @@ private:
     bool connected_;
     bool connecting_;
     bool has_timer_; 
+    bool is_unix_;
     Timer timer_;
 
     std::string local_addr_;
@@ -61,6 +61,11 @@ inline bool options_ok(const ControllerOptions &opt)
         return false;
     }
 
+    if (opt.priority < kPriorityHigh || opt.priority > kPriorityLow) {
+        LOG(ERROR) << "invalid priority";
+        return false;
+    }
+
     return true;
 }
 
@@ -16,6 +16,19 @@ enum CompressionType {
     kSnappyCompression  = 3,
 };
 
+/*
+ * The priority classes of calls, the higher ones are sent first
+ * by the channel, and called first by the server once the parsed
+ * requests queue up, see ServerOptions::priority_queue.
+ */
+enum Priority {
+    kPriorityHigh       = 0,
+    kPriorityNormal     = 1,
+    kPriorityLow        = 2,
+};
+
+static const int kNumPriorities = 3;
+
 /*
  * The min compression message size (byte). 
  * If the message's size is less than this value,
@@ -38,14 +51,60 @@ struct ControllerOptions {
      */
     CompressionType compression;
 
+    /*
+     * Collect the latency of stages for the call, see CallTiming.
+     * The server returns its timings in the response meta.
+     *
+     * Default: false
+     */
+    bool collect_timing;
+
+    /*
+     * The priority of the call, e.g. kPriorityHigh for the health
+     * checks and the control plane, kPriorityLow for the batch jobs.
+     *
+     * Default: kPriorityNormal
+     */
+    Priority priority;
+
     /* construct function */
     ControllerOptions()
         : rpc_timeout(1000)
         , compression(kNoCompression)
+        , collect_timing(false)
+        , priority(kPriorityNormal)
     {
     }
 };
 
+/*
+ * The latency of stages of a call in nanoseconds, the stages which
+ * aren't passed (e.g. the in-process channel doesn't encode) are 0.
+ */
+struct CallTiming {
+    /* waiting in the send queue of channel */
+    uint64_t queue_ns;
+
+    /* serializing, compressing and writing the request */
+    uint64_t encode_ns;
+
+    /* the round trip excluding the server time below */
+    uint64_t wire_ns;
+
+    /* from receiving the request to calling the handler */
+    uint64_t server_queue_ns;
+
+    /* from calling the handler to its done closure */
+    uint64_t server_handler_ns;
+
+    /* from CallMethod to the done closure */
+    uint64_t total_ns;
+
+    CallTiming()
+        : queue_ns(0), encode_ns(0), wire_ns(0)
+        , server_queue_ns(0), server_handler_ns(0), total_ns(0) { }
+};
+
 class Controller : public google::protobuf::RpcController {
 public:
     /**
@@ -125,6 +184,12 @@ public:
      */
     virtual void StartCancel() = 0;
 
+    /**
+     * After a call has finished, stores the latency of stages in *timing
+     * and returns true if ControllerOptions::collect_timing is set.
+     */
+    virtual bool GetTiming(CallTiming *timing) const = 0;
+
     /**
      * -------------------- Server-side methods --------------------
      *
@@ -159,6 +224,13 @@ public:
      */
     virtual void NotifyOnCancel(google::protobuf::Closure *callback) = 0;
 
+    /**
+     * Returns the microseconds left before the client gives up on the
+     * request, 0 if it's exceeded, or -1 if the client has no deadline.
+     * The client calls made inside the handler inherit the deadline.
+     */
+    virtual int64_t RemainingUsec() const = 0;
+
 private:
     /* No copying allowed */
     Controller(const Controller &);
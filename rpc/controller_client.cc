@@ -35,7 +35,9 @@ ClientController::ClientController(const ControllerOptions &options)
     : tid_(0)
     , options_(options)
     , code_(0)
+    , has_timing_(false)
     , client_message_(NULL)
+    , cancel_hook_(NULL)
 {
 
 }
@@ -77,7 +79,11 @@ void ClientController::Reset()
     local_addr_ = "";
     remote_addr_ = "";
 
+    has_timing_ = false;
+    timing_ = CallTiming();
+
     client_message_ = NULL;
+    cancel_hook_ = NULL;
 }
 
 bool ClientController::Failed() const
@@ -107,6 +113,13 @@ string ClientController::ErrorText() const
 
 void ClientController::StartCancel()
 {
+    /* the call is waiting for its next attempt, the hook is run once */
+    if (!client_message_ && cancel_hook_) {
+        google::protobuf::Closure *hook = cancel_hook_;
+        cancel_hook_ = NULL;
+        return hook->Run();
+    }
+
     if (!client_message_) {
         LOG(FATAL) << "the controller is initial state";
     }
@@ -117,6 +130,19 @@ void ClientController::StartCancel()
     client_message_->StartCancel();
 }
 
+bool ClientController::GetTiming(CallTiming *timing) const
+{
+    if (client_message_) {
+        LOG(FATAL) << "the RPC is in progress";
+    }
+    if (!has_timing_) {
+        return false;
+    }
+
+    *timing = timing_;
+    return true;
+}
+
 void ClientController::SetFailed(const string &reason)
 {
     LOG(FATAL) << "server-side method";
@@ -133,4 +159,10 @@ void ClientController::NotifyOnCancel(google::protobuf::Closure *callback)
     LOG(FATAL) << "server-side method";
 }
 
+int64_t ClientController::RemainingUsec() const
+{
+    LOG(FATAL) << "server-side method";
+    return -1;
+}
+
 } // namespace qrpc
@@ -31,20 +31,26 @@ public:
     virtual bool Failed() const;
     virtual std::string ErrorText() const;
     virtual void StartCancel();
+    virtual bool GetTiming(CallTiming *timing) const;
 
     /* Server-side methods */
     virtual void SetFailed(const std::string &reason);
     virtual bool IsCanceled() const;
     virtual void NotifyOnCancel(google::protobuf::Closure *callback);
+    virtual int64_t RemainingUsec() const;
 
 public:
     void SetOwnership(ClientMessage *message) {
         assert(!client_message_);
         tid_ = pthread_self();
+        has_timing_ = false;
         client_message_ = message;
     }
     void ResetOwnership() { client_message_ = NULL; }
 
+    /* run by StartCancel() between the attempts of a call, e.g. retried */
+    void SetCancelHook(google::protobuf::Closure *hook) { cancel_hook_ = hook; }
+
     const ControllerOptions& options() const { return options_;    }
     uint32_t code()                    const { return code_;       }
     const std::string& error_text()    const { return error_text_; }
@@ -54,6 +60,7 @@ public:
 
     void SetResponseCode(uint32_t code) { code_ = code; }
     void SetResponseError(const std::string &error) { error_text_ = error; }
+    void SetTiming(const CallTiming &timing) { timing_ = timing; has_timing_ = true; }
 
 private:
     pthread_t tid_;
@@ -65,7 +72,11 @@ private:
     std::string local_addr_;
     std::string remote_addr_;
 
+    bool has_timing_;
+    CallTiming timing_;
+
     ClientMessage *client_message_;
+    google::protobuf::Closure *cancel_hook_;
 };
 
 } // namespace qrpc
@@ -19,6 +19,7 @@
 #include "src/qrpc/util/random.h"
 #include "src/qrpc/util/completion.h"
 #include "src/qrpc/util/socket.h"
+#include "src/qrpc/util/cycles.h"
 #include "src/qrpc/rpc/errno.h"
 #include "src/qrpc/rpc/closure.h"
 #include "src/qrpc/rpc/controller.h"
@@ -53,8 +54,7 @@ string ServerController::LocalAddress() const
         LOG(FATAL) << "the RPC is running in other thread context";
     }
 
-    ServerConnection *conn = srv_msg_->server_connection();
-    return conn->local_addr();
+    return srv_msg_->local_addr();
 }
 
 string ServerController::RemoteAddress() const
@@ -63,8 +63,7 @@ string ServerController::RemoteAddress() const
         LOG(FATAL) << "the RPC is running in other thread context";
     }
 
-    ServerConnection *conn = srv_msg_->server_connection();
-    return conn->remote_addr();
+    return srv_msg_->remote_addr();
 }
 
 void ServerController::Reset()
@@ -89,6 +88,12 @@ void ServerController::StartCancel()
     LOG(FATAL) << "client-side method";
 }
 
+bool ServerController::GetTiming(CallTiming *timing) const
+{
+    LOG(FATAL) << "client-side method";
+    return false;
+}
+
 void ServerController::SetFailed(const string &reason)
 {
     if (tid_ != pthread_self()) {
@@ -125,4 +130,19 @@ void ServerController::NotifyOnCancel(google::protobuf::Closure *callback)
     }
 }
 
+int64_t ServerController::RemainingUsec() const
+{
+    if (tid_ != pthread_self()) {
+        LOG(FATAL) << "the RPC is running in other thread context";
+    }
+
+    uint64_t deadline = srv_msg_->deadline();
+    if (!deadline) {
+        return -1;
+    }
+
+    uint64_t now = rdtsc();
+    return now < deadline ? cycles_to_usec(deadline - now) : 0;
+}
+
 } // namespace qrpc
@@ -31,17 +31,22 @@ public:
     virtual bool Failed() const;
     virtual std::string ErrorText() const;
     virtual void StartCancel();
+    virtual bool GetTiming(CallTiming *timing) const;
 
     /* Server-side methods */
     virtual void SetFailed(const std::string &reason);
     virtual bool IsCanceled() const;
     virtual void NotifyOnCancel(google::protobuf::Closure *callback);
+    virtual int64_t RemainingUsec() const;
 
 public:
+    /* the callback may finish the RPC, which is freed then */
     inline void CancelRequest() {
         assert(cancel_ == false);
         cancel_ = true;
-        if (closure_) { closure_->Run(); closure_ = NULL; }
+        google::protobuf::Closure *closure = closure_;
+        closure_ = NULL;
+        if (closure) { closure->Run(); }
     }
 
     inline void FinishRequest() {
@@ -22,6 +22,11 @@ const string& rerror(int rc)
         /* kErrTimeout  */  "the RPC is timeout",
         /* kErrResponse */  "the RPC's response message error",
         /* kErrUserDef  */  "identify app's error text",
+        /* kErrDeadline */  "the RPC's deadline is exceeded",
+        /* kErrOverload */  "the server is overloaded, retry later",
+        /* kErrBacklog  */  "the channel's queue is full",
+        /* kErrRateLimit*/  "the rate limit is exceeded, retry later",
+        /* kErrConnLost */  "the connection is lost",
     };
 
     static string what_is_the_fuck = "Are you fucking kidding me";
@@ -38,6 +43,11 @@ const string& rerror(int rc)
     case kErrCancel:
     case kErrTimeout:
     case kErrResponse:
+    case kErrDeadline:
+    case kErrOverload:
+    case kErrBacklog:
+    case kErrRateLimit:
+    case kErrConnLost:
         return err_msg[rc];
     case kErrUserDef:
         LOG(FATAL) << "shouldn't run here";
@@ -18,6 +18,11 @@ enum Code {
     kErrTimeout = 9,    /* the RPC is timeout               */
     kErrResponse= 10,   /* the RPC's response message error */
     kErrUserDef = 11,   /* identify app's error text        */
+    kErrDeadline= 12,   /* the RPC's deadline is exceeded   */
+    kErrOverload= 13,   /* the server is overloaded, retry  */
+    kErrBacklog = 14,   /* the channel's queue is full      */
+    kErrRateLimit=15,   /* the rate limit is exceeded       */
+    kErrConnLost= 16,   /* the connection is lost           */
 };
 
 extern const std::string& rerror(int rc);
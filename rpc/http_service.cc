@@ -0,0 +1,550 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/service.h>
+#include <google/protobuf/descriptor.h>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/rpc/errno.h"
+#include "src/qrpc/rpc/stats.h"
+#include "src/qrpc/rpc/rpcz.h"
+#include "src/qrpc/rpc/trace.h"
+#include "src/qrpc/rpc/loop_monitor.h"
+#include "src/qrpc/rpc/worker.h"
+#include "src/qrpc/rpc/builtin.h"
+#include "src/qrpc/rpc/server.h"
+#include "src/qrpc/rpc/server_impl.h"
+#include "src/qrpc/rpc/http_service.h"
+
+using namespace std;
+using namespace google::protobuf;
+
+namespace qrpc {
+
+namespace {
+
+/* the fixed buckets (seconds) of Prometheus histogram */
+const double kLatencyBuckets[] = {
+    0.00001, 0.000025, 0.00005,
+    0.0001, 0.00025, 0.0005,
+    0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5,
+    1, 2.5, 5, 10,
+};
+
+void append_format(string *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* the fixed buckets of counts */
+const uint64_t kCountBuckets[] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 256, 1024,
+};
+
+void append_format(string *out, const char *fmt, ...)
+{
+    char buf[512];
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n >= sizeof(buf)) {
+        n = sizeof(buf) - 1;
+    }
+
+    out->append(buf, n);
+}
+
+void metrics_of(const StatsMap &stats, const char *side, string *body)
+{
+    StatsMap::const_iterator ite = stats.begin();
+
+    for (; ite != stats.end(); ++ite) {
+        const char *method = ite->first.c_str();
+        const MethodStats &ms = ite->second;
+        const Histogram &hist = ms.latency();
+
+        append_format(body, "qrpc_requests_total{side=\"%s\",method=\"%s\"} %llu\n",
+                      side, method, (unsigned long long)ms.count());
+
+        for (int i = 1; i < kStatsCodes; i++) {
+            if (!ms.errors(i)) {
+                continue;
+            }
+            append_format(body, "qrpc_errors_total{side=\"%s\",method=\"%s\",code=\"%d\"} %llu\n",
+                          side, method, i, (unsigned long long)ms.errors(i));
+        }
+
+        for (size_t i = 0; i < sizeof(kLatencyBuckets) / sizeof(double); i++) {
+            uint64_t le = usec_to_cycles((uint64_t)(kLatencyBuckets[i] * 1000000));
+            append_format(body, "qrpc_latency_seconds_bucket{side=\"%s\",method=\"%s\",le=\"%g\"} %llu\n",
+                          side, method, kLatencyBuckets[i],
+                          (unsigned long long)hist.CountBelow(le));
+        }
+        append_format(body, "qrpc_latency_seconds_bucket{side=\"%s\",method=\"%s\",le=\"+Inf\"} %llu\n",
+                      side, method, (unsigned long long)hist.count());
+        append_format(body, "qrpc_latency_seconds_sum{side=\"%s\",method=\"%s\"} %.9f\n",
+                      side, method, cycles_to_nsec(hist.sum()) / 1e9);
+        append_format(body, "qrpc_latency_seconds_count{side=\"%s\",method=\"%s\"} %llu\n",
+                      side, method, (unsigned long long)hist.count());
+    }
+}
+
+void limiter_of(const char *name, const ConcurrencyLimiter *limiter,
+                string *body)
+{
+    append_format(body, "qrpc_concurrency_limit{limiter=\"%s\"} %d\n",
+                  name, limiter->limit());
+    append_format(body, "qrpc_concurrency_inflight{limiter=\"%s\"} %d\n",
+                  name, limiter->inflight());
+    append_format(body, "qrpc_concurrency_rejected_total{limiter=\"%s\"} %u\n",
+                  name, limiter->rejected());
+}
+
+void rate_limit_of(const char *kind, const char *name,
+                   const RateLimiter *limiter, string *body)
+{
+    append_format(body, "qrpc_rate_limit{%s=\"%s\"} %d\n",
+                  kind, name, limiter->rate());
+    append_format(body, "qrpc_rate_limited_total{%s=\"%s\"} %u\n",
+                  kind, name, limiter->rejected());
+}
+
+/* the histogram of cycles in seconds */
+void seconds_of(const char *metric, const char *loop,
+                const Histogram &hist, string *body)
+{
+    for (size_t i = 0; i < sizeof(kLatencyBuckets) / sizeof(double); i++) {
+        uint64_t le = usec_to_cycles((uint64_t)(kLatencyBuckets[i] * 1000000));
+        append_format(body, "%s_bucket{loop=\"%s\",le=\"%g\"} %llu\n",
+                      metric, loop, kLatencyBuckets[i],
+                      (unsigned long long)hist.CountBelow(le));
+    }
+    append_format(body, "%s_bucket{loop=\"%s\",le=\"+Inf\"} %llu\n",
+                  metric, loop, (unsigned long long)hist.count());
+    append_format(body, "%s_sum{loop=\"%s\"} %.9f\n",
+                  metric, loop, cycles_to_nsec(hist.sum()) / 1e9);
+    append_format(body, "%s_count{loop=\"%s\"} %llu\n",
+                  metric, loop, (unsigned long long)hist.count());
+}
+
+/* the histogram of counts */
+void counts_of(const char *metric, const char *loop,
+               const Histogram &hist, string *body)
+{
+    for (size_t i = 0; i < sizeof(kCountBuckets) / sizeof(uint64_t); i++) {
+        append_format(body, "%s_bucket{loop=\"%s\",le=\"%llu\"} %llu\n",
+                      metric, loop, (unsigned long long)kCountBuckets[i],
+                      (unsigned long long)hist.CountBelow(kCountBuckets[i]));
+    }
+    append_format(body, "%s_bucket{loop=\"%s\",le=\"+Inf\"} %llu\n",
+                  metric, loop, (unsigned long long)hist.count());
+    append_format(body, "%s_sum{loop=\"%s\"} %llu\n",
+                  metric, loop, (unsigned long long)hist.sum());
+    append_format(body, "%s_count{loop=\"%s\"} %llu\n",
+                  metric, loop, (unsigned long long)hist.count());
+}
+
+void loops_of(const vector<LoopStats> &loops, string *body)
+{
+    body->append("# HELP qrpc_loop_iteration_seconds The iterations of event loops, with the poll before callbacks.\n");
+    body->append("# TYPE qrpc_loop_iteration_seconds histogram\n");
+    body->append("# HELP qrpc_loop_callback_seconds The callbacks of event loops.\n");
+    body->append("# TYPE qrpc_loop_callback_seconds histogram\n");
+    body->append("# HELP qrpc_loop_poll_seconds The time outside callbacks, mostly epoll_wait.\n");
+    body->append("# TYPE qrpc_loop_poll_seconds histogram\n");
+    body->append("# HELP qrpc_loop_ready_events The callbacks run in an iteration.\n");
+    body->append("# TYPE qrpc_loop_ready_events histogram\n");
+    body->append("# HELP qrpc_loop_queue_depth The tasks in the event queue when popping one.\n");
+    body->append("# TYPE qrpc_loop_queue_depth histogram\n");
+    body->append("# HELP qrpc_loop_queue_wait_seconds The time of tasks in the event queue.\n");
+    body->append("# TYPE qrpc_loop_queue_wait_seconds histogram\n");
+    body->append("# HELP qrpc_loop_busy_seconds_total The time in callbacks, its rate is the saturation.\n");
+    body->append("# TYPE qrpc_loop_busy_seconds_total counter\n");
+    body->append("# HELP qrpc_loop_slow_callbacks_total The callbacks slower than slow_callback_usec.\n");
+    body->append("# TYPE qrpc_loop_slow_callbacks_total counter\n");
+
+    for (size_t i = 0; i < loops.size(); i++) {
+        const LoopStats &ls = loops[i];
+        const char *loop = ls.name.c_str();
+
+        seconds_of("qrpc_loop_iteration_seconds", loop, ls.iteration, body);
+        seconds_of("qrpc_loop_callback_seconds", loop, ls.callback, body);
+        seconds_of("qrpc_loop_poll_seconds", loop, ls.poll, body);
+        counts_of("qrpc_loop_ready_events", loop, ls.ready, body);
+        counts_of("qrpc_loop_queue_depth", loop, ls.queue_depth, body);
+        seconds_of("qrpc_loop_queue_wait_seconds", loop, ls.queue_wait, body);
+
+        append_format(body, "qrpc_loop_busy_seconds_total{loop=\"%s\"} %.9f\n",
+                      loop, cycles_to_nsec(ls.busy) / 1e9);
+        append_format(body, "qrpc_loop_slow_callbacks_total{loop=\"%s\"} %llu\n",
+                      loop, (unsigned long long)ls.slow);
+    }
+}
+
+/* the hex value of the query argument, 0 if absent */
+uint64_t query_hex(const string &args, const string &name)
+{
+    string key = name + "=";
+    size_t pos = 0;
+
+    while (pos < args.size()) {
+        size_t end = args.find('&', pos);
+        if (end == string::npos) {
+            end = args.size();
+        }
+        if (!args.compare(pos, key.size(), key)) {
+            string value = args.substr(pos + key.size(), end - pos - key.size());
+            return strtoull(value.c_str(), NULL, 16);
+        }
+        pos = end + 1;
+    }
+
+    return 0;
+}
+
+} // anonymous namespace
+
+HttpService::HttpService(ServerImpl *server)
+    : server_(server)
+    , start_(time(NULL))
+{
+
+}
+
+HttpService::~HttpService()
+{
+
+}
+
+bool HttpService::IsHttp(const char *buf, int len)
+{
+    if (len < kHttpSniffSize) {
+        return false;
+    }
+
+    /*
+     * The frame header begins with the payload size in network order,
+     * these prefixes mean the payloads over 1GB which never happen.
+     */
+    return !memcmp(buf, "GET ", 4)
+        || !memcmp(buf, "HEAD", 4)
+        || !memcmp(buf, "POST", 4);
+}
+
+int HttpService::HeaderSize(const char *buf, int len)
+{
+    for (int i = 3; i < len; i++) {
+        if (buf[i] == '\n' && buf[i - 1] == '\r' &&
+            buf[i - 2] == '\n' && buf[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+void HttpService::Serve(const char *request, int len, string *response)
+{
+    string line(request, len);
+    size_t eol = line.find("\r\n");
+    if (eol != string::npos) {
+        line.resize(eol);
+    }
+
+    /* request line: method path version */
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.find(' ', sp1 + 1);
+
+    string method = line.substr(0, sp1);
+    string path;
+    if (sp1 != string::npos) {
+        path = line.substr(sp1 + 1, sp2 == string::npos ? string::npos : sp2 - sp1 - 1);
+    }
+
+    string args;
+    size_t query = path.find('?');
+    if (query != string::npos) {
+        args = path.substr(query + 1);
+        path.resize(query);
+    }
+
+    int code = 200;
+    const char *reason = "OK";
+    const char *type = "text/plain; charset=utf-8";
+    string body;
+
+    if (method != "GET" && method != "HEAD") {
+        code = 405;
+        reason = "Method Not Allowed";
+        body = "only GET and HEAD are supported\n";
+    } else if (path == "/metrics") {
+        type = "text/plain; version=0.0.4; charset=utf-8";
+        Metrics(&body);
+    } else if (path == "/connections") {
+        Connections(&body);
+    } else if (path == "/status" || path == "/") {
+        Status(&body);
+    } else if (path == "/flags") {
+        Flags(&body);
+    } else if (path == "/rpcz") {
+        Rpcz(&body);
+    } else if (path == "/traces") {
+        Traces(query_hex(args, "trace_id"), &body);
+    } else {
+        code = 404;
+        reason = "Not Found";
+        body = "try /metrics, /connections, /status, /flags, /rpcz or /traces\n";
+    }
+
+    response->clear();
+    append_format(response, "HTTP/1.0 %d %s\r\n", code, reason);
+    append_format(response, "Content-Type: %s\r\n", type);
+    append_format(response, "Content-Length: %zu\r\n", body.size());
+    response->append("Connection: close\r\n\r\n");
+
+    if (method != "HEAD") {
+        response->append(body);
+    }
+}
+
+void HttpService::Metrics(string *body)
+{
+    StatsMap server_stats;
+    server_->MergeStats(&server_stats);
+
+    StatsMap client_stats;
+    merge_client_stats(&client_stats);
+
+    body->append("# HELP qrpc_requests_total The finished RPCs.\n");
+    body->append("# TYPE qrpc_requests_total counter\n");
+    body->append("# HELP qrpc_errors_total The failed RPCs by error code.\n");
+    body->append("# TYPE qrpc_errors_total counter\n");
+    body->append("# HELP qrpc_latency_seconds The latency of RPCs.\n");
+    body->append("# TYPE qrpc_latency_seconds histogram\n");
+
+    metrics_of(server_stats, "server", body);
+    metrics_of(client_stats, "client", body);
+
+    vector<LoopStats> loops;
+    server_->DumpLoops(&loops);
+    loops_of(loops, body);
+
+    if (server_->limiter() || !server_->limiters().empty()) {
+        body->append("# HELP qrpc_concurrency_limit The max requests in process.\n");
+        body->append("# TYPE qrpc_concurrency_limit gauge\n");
+        body->append("# HELP qrpc_concurrency_inflight The requests in process.\n");
+        body->append("# TYPE qrpc_concurrency_inflight gauge\n");
+        body->append("# HELP qrpc_concurrency_rejected_total The overloaded requests.\n");
+        body->append("# TYPE qrpc_concurrency_rejected_total counter\n");
+    }
+
+    if (server_->limiter()) {
+        limiter_of("server", server_->limiter(), body);
+    }
+
+    const ServerImpl::LimiterMap &limiters = server_->limiters();
+    ServerImpl::LimiterMap::const_iterator lit = limiters.begin();
+    for (; lit != limiters.end(); ++lit) {
+        limiter_of(lit->first->full_name().c_str(), lit->second, body);
+    }
+
+    const ServerImpl::MethodRateMap &method_rates = server_->method_rates();
+    const ServerImpl::ServiceRateMap &service_rates = server_->service_rates();
+    const ServerImpl::ClientRateMap &client_rates = server_->client_rates();
+
+    if (!method_rates.empty() || !service_rates.empty() ||
+        !client_rates.empty()) {
+        body->append("# HELP qrpc_rate_limit The requests per second allowed.\n");
+        body->append("# TYPE qrpc_rate_limit gauge\n");
+        body->append("# HELP qrpc_rate_limited_total The requests over the rate limit.\n");
+        body->append("# TYPE qrpc_rate_limited_total counter\n");
+    }
+
+    ServerImpl::MethodRateMap::const_iterator mit = method_rates.begin();
+    for (; mit != method_rates.end(); ++mit) {
+        rate_limit_of("method", mit->first->full_name().c_str(),
+                      mit->second, body);
+    }
+
+    ServerImpl::ServiceRateMap::const_iterator sit = service_rates.begin();
+    for (; sit != service_rates.end(); ++sit) {
+        rate_limit_of("service", sit->first->full_name().c_str(),
+                      sit->second, body);
+    }
+
+    ServerImpl::ClientRateMap::const_iterator cit = client_rates.begin();
+    for (; cit != client_rates.end(); ++cit) {
+        rate_limit_of("client", cit->first.c_str(), cit->second, body);
+    }
+
+    const vector<Worker *> &workers = server_->workers();
+
+    if (server_->options().queue_delay_target_usec ||
+        server_->options().priority_queue ||
+        server_->options().fair_queue) {
+        body->append("# HELP qrpc_ready_queue_depth The parsed requests waiting in the worker.\n");
+        body->append("# TYPE qrpc_ready_queue_depth gauge\n");
+        body->append("# HELP qrpc_ready_queue_overloaded 1 if the queue delay stays above the target.\n");
+        body->append("# TYPE qrpc_ready_queue_overloaded gauge\n");
+        body->append("# HELP qrpc_ready_queue_shed_total The requests dropped by the queue delay.\n");
+        body->append("# TYPE qrpc_ready_queue_shed_total counter\n");
+
+        for (size_t i = 0; i < workers.size(); i++) {
+            string loop = workers[i]->thread()->name();
+
+            append_format(body, "qrpc_ready_queue_depth{loop=\"%s\"} %d\n",
+                          loop.c_str(), workers[i]->queued());
+            append_format(body, "qrpc_ready_queue_overloaded{loop=\"%s\"} %d\n",
+                          loop.c_str(), workers[i]->overloaded());
+            append_format(body, "qrpc_ready_queue_shed_total{loop=\"%s\"} %llu\n",
+                          loop.c_str(), (unsigned long long)workers[i]->shed());
+        }
+    }
+
+    size_t conns = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        conns += workers[i]->num_connections();
+    }
+
+    body->append("# HELP qrpc_connections The connections of the server.\n");
+    body->append("# TYPE qrpc_connections gauge\n");
+    append_format(body, "qrpc_connections %zu\n", conns);
+
+    body->append("# HELP qrpc_uptime_seconds The running time of the server.\n");
+    body->append("# TYPE qrpc_uptime_seconds gauge\n");
+    append_format(body, "qrpc_uptime_seconds %ld\n", (long)(time(NULL) - start_));
+}
+
+void HttpService::Connections(string *body)
+{
+    const vector<Worker *> &workers = server_->workers();
+
+    body->append("worker\ttransport\tlocal\tremote\trequests\tage_s\n");
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->DumpConnections(i, body);
+    }
+}
+
+void HttpService::Status(string *body)
+{
+    append_format(body, "pid: %d\n", (int)getpid());
+    append_format(body, "uptime_s: %ld\n", (long)(time(NULL) - start_));
+    append_format(body, "workers: %zu\n", server_->workers().size());
+
+    const vector<pair<string, int> > &endpoints = server_->endpoints();
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        append_format(body, "endpoint: %s:%d\n",
+                      endpoints[i].first.c_str(), endpoints[i].second);
+    }
+
+    const map<string, Service *> &services = server_->services();
+    map<string, Service *>::const_iterator ite = services.begin();
+
+    for (; ite != services.end(); ++ite) {
+        const ServiceDescriptor *desc = ite->second->GetDescriptor();
+
+        append_format(body, "service: %s\n", desc->full_name().c_str());
+        for (int i = 0; i < desc->method_count(); i++) {
+            append_format(body, "  method: %s\n", desc->method(i)->name().c_str());
+        }
+    }
+}
+
+void HttpService::Flags(string *body)
+{
+    const ServerOptions &opt = server_->options();
+
+    append_format(body, "rbuf_size: %d\n", opt.rbuf_size);
+    append_format(body, "sbuf_size: %d\n", opt.sbuf_size);
+    append_format(body, "min_rbuf_size: %d\n", opt.min_rbuf_size);
+    append_format(body, "max_rbuf_size: %d\n", opt.max_rbuf_size);
+    append_format(body, "min_sbuf_size: %d\n", opt.min_sbuf_size);
+    append_format(body, "max_sbuf_size: %d\n", opt.max_sbuf_size);
+    append_format(body, "keep_alive_time: %d\n", opt.keep_alive_time);
+    append_format(body, "num_worker_thread: %d\n", opt.num_worker_thread);
+    append_format(body, "http_service: %d\n", opt.http_service);
+    append_format(body, "rpcz_sample_rate: %d\n", opt.rpcz_sample_rate);
+    append_format(body, "rpcz_capacity: %d\n", opt.rpcz_capacity);
+    append_format(body, "slow_callback_usec: %d\n", opt.slow_callback_usec);
+    append_format(body, "max_concurrency: %d\n", opt.max_concurrency);
+    append_format(body, "auto_concurrency: %d\n", opt.auto_concurrency);
+    append_format(body, "queue_delay_target_usec: %d\n", opt.queue_delay_target_usec);
+    append_format(body, "queue_delay_interval_usec: %d\n", opt.queue_delay_interval_usec);
+    append_format(body, "priority_queue: %d\n", opt.priority_queue);
+    append_format(body, "flow_credit_requests: %d\n", opt.flow_credit_requests);
+    append_format(body, "flow_credit_bytes: %d\n", opt.flow_credit_bytes);
+    append_format(body, "recv_budget: %d\n", opt.recv_budget);
+    append_format(body, "fair_queue: %d\n", opt.fair_queue);
+}
+
+void HttpService::Rpcz(string *body)
+{
+    if (!server_->options().rpcz_sample_rate) {
+        body->append("rpcz is disabled, see ServerOptions::rpcz_sample_rate\n");
+        return;
+    }
+
+    vector<RpczSpan> spans;
+    server_->DumpRpcz(&spans);
+
+    uint64_t now = rdtsc();
+
+    /* the microseconds of stages since receiving the request */
+    body->append("age_ms\tmethod\tremote\tcode\treq_bytes\trsp_bytes"
+                 "\tparse_us\thandler_us\tdone_us\tencode_us\tsent_us\n");
+
+    for (size_t i = 0; i < spans.size(); i++) {
+        const RpczSpan &span = spans[i];
+        const uint64_t *stamps = span.stamps;
+        uint64_t recv = stamps[kRpczRecv];
+
+        append_format(body, "%llu\t%s\t%s\t%u\t%u\t%u\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+                      (unsigned long long)cycles_to_usec(now - recv) / 1000,
+                      span.method.c_str(), span.remote.c_str(), span.code,
+                      span.request_size, span.response_size,
+                      cycles_to_nsec(stamps[kRpczParse] - recv) / 1e3,
+                      cycles_to_nsec(stamps[kRpczHandler] - recv) / 1e3,
+                      cycles_to_nsec(stamps[kRpczDone] - recv) / 1e3,
+                      cycles_to_nsec(stamps[kRpczEncode] - recv) / 1e3,
+                      cycles_to_nsec(stamps[kRpczSent] - recv) / 1e3);
+    }
+}
+
+void HttpService::Traces(uint64_t trace_id, string *body)
+{
+    vector<TraceSpan> spans;
+    server_->DumpTraces(trace_id, &spans);
+
+    body->append("trace_id\tspan_id\tparent_span\tside\tmethod\tcode\tstart_us\tduration_us\n");
+
+    for (size_t i = 0; i < spans.size(); i++) {
+        const TraceSpan &span = spans[i];
+
+        append_format(body, "%016llx\t%016llx\t%016llx\t%s\t%s\t%u\t%llu\t%.1f\n",
+                      (unsigned long long)span.trace_id,
+                      (unsigned long long)span.span_id,
+                      (unsigned long long)span.parent_span,
+                      span.server ? "server" : "client",
+                      span.method.c_str(), span.code,
+                      (unsigned long long)span.start_us,
+                      span.duration_ns / 1e3);
+    }
+}
+
+} // namespace qrpc
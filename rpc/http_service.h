@@ -0,0 +1,66 @@
+#ifndef QRPC_RPC_HTTP_SERVICE_H
+#define QRPC_RPC_HTTP_SERVICE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+namespace qrpc {
+
+class ServerImpl;
+
+/* the bytes to tell a HTTP request from the RPC frame header */
+static const int kHttpSniffSize = 4;
+
+/* the max size of HTTP request header */
+static const int kHttpMaxHeaderSize = 8192;
+
+/*
+ * The diagnostics served over HTTP on the RPC ports,
+ * the connection is closed after the response as HTTP/1.0.
+ *
+ *   /metrics      the method stats in Prometheus text format
+ *   /connections  the connections of workers
+ *   /status       the endpoints and services of the server
+ *   /flags        the server options
+ *   /rpcz         the sampled requests with the stages
+ *   /traces       the spans of sampled traces, ?trace_id=<hex>
+ */
+class HttpService {
+public:
+    explicit HttpService(ServerImpl *server);
+    ~HttpService();
+
+    /* whether the first kHttpSniffSize bytes are a HTTP request */
+    static bool IsHttp(const char *buf, int len);
+
+    /*
+     * The length of request header ending with an empty line,
+     * 0 if it's incomplete.
+     */
+    static int HeaderSize(const char *buf, int len);
+
+    /* serve the request header, and make the whole response */
+    void Serve(const char *request, int len, std::string *response);
+
+private:
+    void Metrics(std::string *body);
+    void Connections(std::string *body);
+    void Status(std::string *body);
+    void Flags(std::string *body);
+    void Rpcz(std::string *body);
+    void Traces(uint64_t trace_id, std::string *body);
+
+private:
+    ServerImpl *server_;
+    time_t start_;
+
+private:
+    /* No copying allowed */
+    HttpService(const HttpService &);
+    void operator=(const HttpService &);
+};
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_HTTP_SERVICE_H */
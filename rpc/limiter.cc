@@ -0,0 +1,232 @@
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/rpc/limiter.h"
+
+namespace qrpc {
+
+/* the latency is taken as no queuing below it */
+static const double kLimitTolerance = 1.5;
+
+/* the weight of the new limit */
+static const double kLimitSmoothing = 0.5;
+
+/* the tokens a worker takes from the bucket at most at a time */
+static const int kRateMaxBatch = 64;
+
+// -------------------------------------------------------------
+// class ConcurrencyLimiter
+// -------------------------------------------------------------
+
+ConcurrencyLimiter::ConcurrencyLimiter(int max_limit, bool adaptive)
+    : max_limit_(max_limit)
+    , adaptive_(adaptive)
+    , limit_(max_limit)
+    , peak_(0)
+    , window_start_(rdtsc())
+    , window_(usec_to_cycles(kLimitWindowUsec))
+    , estimate_(max_limit)
+    , min_latency_(0)
+    , windows_(0)
+{
+    atomic_set(&inflight_, 0);
+    atomic_set(&rejected_, 0);
+    atomic_set(&samples_, 0);
+    atomic64_set(&sum_, 0);
+
+    if (adaptive_ && max_limit_ > kLimitInitial) {
+        limit_ = kLimitInitial;
+        estimate_ = kLimitInitial;
+    }
+
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+ConcurrencyLimiter::~ConcurrencyLimiter()
+{
+    pthread_mutex_destroy(&mutex_);
+}
+
+void ConcurrencyLimiter::Sample(uint64_t cycles)
+{
+    atomic64_add(cycles, &sum_);
+
+    if (atomic_inc_return(&samples_) < kLimitWindowSamples) {
+        return;
+    }
+
+    uint64_t now = rdtsc();
+    if (now - window_start_ < window_) {
+        return;
+    }
+
+    /* the others go on, someone is closing the window */
+    if (pthread_mutex_trylock(&mutex_)) {
+        return;
+    }
+
+    Update(now);
+
+    pthread_mutex_unlock(&mutex_);
+}
+
+void ConcurrencyLimiter::Update(uint64_t now)
+{
+    /* closed by the one who held the lock just now */
+    int n = atomic_read(&samples_);
+    if (n < kLimitWindowSamples || now - window_start_ < window_) {
+        return;
+    }
+
+    long sum = atomic64_read(&sum_);
+    atomic64_sub(sum, &sum_);
+    atomic_sub(n, &samples_);
+
+    int peak = peak_;
+    peak_ = 0;
+    window_start_ = now;
+
+    double latency = (double)sum / n;
+
+    if (!min_latency_ || latency < min_latency_ ||
+        ++windows_ >= kLimitResetWindows) {
+        min_latency_ = latency;
+        windows_ = 0;
+    }
+
+    double gradient = kLimitTolerance * min_latency_ / latency;
+    if (gradient > 1.0) {
+        gradient = 1.0;
+    } else if (gradient < 0.5) {
+        gradient = 0.5;
+    }
+
+    double target = estimate_ * gradient + sqrt(estimate_);
+
+    /* don't grow it if the requests are too few to reach it */
+    if (target > estimate_ && peak * 2 < limit_) {
+        target = estimate_;
+    }
+
+    estimate_ = estimate_ * (1 - kLimitSmoothing) + target * kLimitSmoothing;
+    if (estimate_ < 1) {
+        estimate_ = 1;
+    } else if (estimate_ > max_limit_) {
+        estimate_ = max_limit_;
+    }
+
+    limit_ = (int)estimate_;
+}
+
+// -------------------------------------------------------------
+// class QueueDelay
+// -------------------------------------------------------------
+
+QueueDelay::QueueDelay(int target_usec, int interval_usec)
+    : target_(usec_to_cycles(target_usec))
+    , interval_(usec_to_cycles(interval_usec))
+    , first_above_(0)
+    , overloaded_(false)
+{
+
+}
+
+void QueueDelay::Sample(uint64_t delay, uint64_t now)
+{
+    if (delay < target_) {
+        first_above_ = 0;
+        overloaded_ = false;
+        return;
+    }
+
+    if (!first_above_) {
+        first_above_ = now + interval_;
+    } else if (now >= first_above_) {
+        overloaded_ = true;
+    }
+}
+
+// -------------------------------------------------------------
+// class RateLimiter
+// -------------------------------------------------------------
+
+RateLimiter::RateLimiter(int rate, int burst, int shards)
+    : rate_(rate)
+    , burst_(burst ? burst : rate)
+    , batch_(1)
+    , shards_(NULL)
+    , tokens_(burst_)
+    , last_(rdtsc())
+    , cycles_per_token_((double)usec_to_cycles(1000000) / rate)
+{
+    atomic_set(&rejected_, 0);
+
+    /* a quarter of the burst is held by the workers at most */
+    batch_ = burst_ / (4 * shards);
+    if (batch_ < 1) {
+        batch_ = 1;
+    } else if (batch_ > kRateMaxBatch) {
+        batch_ = kRateMaxBatch;
+    }
+
+    shards_ = new Shard[shards];
+    if (!shards_) {
+        LOG(FATAL) << "alloc rate limiter shards failed!!!";
+    }
+    for (int i = 0; i < shards; i++) {
+        shards_[i].tokens = 0;
+        shards_[i].retry = 0;
+    }
+
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+RateLimiter::~RateLimiter()
+{
+    delete [] shards_;
+    pthread_mutex_destroy(&mutex_);
+}
+
+bool RateLimiter::Refill(Shard *shard)
+{
+    uint64_t now = rdtsc();
+    if (now < shard->retry) {
+        atomic_inc(&rejected_);
+        return false;
+    }
+
+    int take = 0;
+
+    pthread_mutex_lock(&mutex_);
+
+    if (now > last_) {
+        tokens_ += (now - last_) / cycles_per_token_;
+        if (tokens_ > burst_) {
+            tokens_ = burst_;
+        }
+        last_ = now;
+    }
+
+    if (tokens_ >= 1) {
+        take = tokens_ < batch_ ? (int)tokens_ : batch_;
+        tokens_ -= take;
+    } else {
+        shard->retry = now + (uint64_t)((1 - tokens_) * cycles_per_token_);
+    }
+
+    pthread_mutex_unlock(&mutex_);
+
+    if (!take) {
+        atomic_inc(&rejected_);
+        return false;
+    }
+
+    shard->tokens = take - 1;
+
+    return true;
+}
+
+} // namespace qrpc
@@ -0,0 +1,204 @@
+#ifndef QRPC_RPC_LIMITER_H
+#define QRPC_RPC_LIMITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "src/qrpc/util/atomic.h"
+#include "src/qrpc/util/compiler.h"
+
+namespace qrpc {
+
+/* the upper bound of adaptive limit if it isn't specified */
+static const int kLimitMax = 10000;
+
+/* the limit to start with, it grows if the latency stays low */
+static const int kLimitInitial = 32;
+
+/* a window is closed after both of them */
+static const int kLimitWindowUsec = 20000;
+static const int kLimitWindowSamples = 32;
+
+/* forget the min latency after the windows, it may be changed */
+static const int kLimitResetWindows = 500;
+
+/*
+ * Bound the requests in process of the server or a method.
+ *
+ * The adaptive limit follows the gradient of latency (like TCP Vegas),
+ * per window of samples:
+ *
+ *   gradient = clamp(1.5 * min_latency / latency, 0.5, 1)
+ *   limit = limit * gradient + sqrt(limit)
+ *
+ * So the limit shrinks once the requests queue up, and probes for the
+ * capacity by sqrt(limit) while the latency stays near the min.
+ *
+ * It's shared by the workers, Acquire() and Release() are lock free,
+ * and the window is closed by the worker which takes the lock.
+ */
+class ConcurrencyLimiter {
+public:
+    /* adaptive in [1, max_limit], or fixed at max_limit */
+    ConcurrencyLimiter(int max_limit, bool adaptive);
+    ~ConcurrencyLimiter();
+
+    /* take a slot, false if the limit is reached */
+    __always_inline bool Acquire() {
+        int n = atomic_inc_return(&inflight_);
+        if (unlikely(n > limit_)) {
+            atomic_dec(&inflight_);
+            atomic_inc(&rejected_);
+            return false;
+        }
+        if (n > peak_) { peak_ = n; }
+        return true;
+    }
+
+    /* give back the slot taken 'cycles' ago */
+    __always_inline void Release(uint64_t cycles) {
+        atomic_dec(&inflight_);
+        if (adaptive_) { Sample(cycles); }
+    }
+
+    /* give back the slot without the latency */
+    void Cancel() { atomic_dec(&inflight_); }
+
+    int limit()      const { return limit_;                       }
+    int max_limit()  const { return max_limit_;                   }
+    bool adaptive()  const { return adaptive_;                    }
+    int inflight()   const { return atomic_read(&inflight_);      }
+    uint32_t rejected() const { return atomic_read(&rejected_);   }
+    uint64_t min_latency() const { return (uint64_t)min_latency_; }
+
+private:
+    void Sample(uint64_t cycles);
+    void Update(uint64_t now);
+
+private:
+    const int max_limit_;
+    const bool adaptive_;
+    volatile int limit_;
+
+    atomic_t inflight_;
+    atomic_t rejected_;
+
+    /* the window being sampled */
+    atomic_t samples_;
+    qrpc::atomic64_t sum_;     /* nested in qrpc by util/atomic.h */
+    volatile int peak_;
+    volatile uint64_t window_start_;
+    uint64_t window_;
+
+    /* updated with the mutex */
+    double estimate_;
+    double min_latency_;
+    int windows_;
+    pthread_mutex_t mutex_;
+
+private:
+    /* No copying allowed */
+    ConcurrencyLimiter(const ConcurrencyLimiter &);
+    void operator=(const ConcurrencyLimiter &);
+};
+
+/*
+ * Detect the standing queue of a worker like CoDel: it's overloaded
+ * once the oldest request has waited longer than the target for an
+ * interval, and it's over once the oldest is below the target.
+ *
+ * In overload the queue is served LIFO, so the new requests still meet
+ * their deadlines, and the non-critical ones older than the target are
+ * dropped. The critical ones are kept and served FIFO, so the old ones
+ * don't expire behind the new. Used by the worker thread only.
+ */
+class QueueDelay {
+public:
+    QueueDelay(int target_usec, int interval_usec);
+
+    /* the oldest request has waited 'delay' cycles, 0 if it's empty */
+    void Sample(uint64_t delay, uint64_t now);
+
+    /* the request waited 'delay' cycles is too old in overload */
+    bool Expired(uint64_t delay) const {
+        return overloaded_ && delay > target_;
+    }
+
+    bool overloaded() const { return overloaded_; }
+
+private:
+    uint64_t target_;
+    uint64_t interval_;
+    uint64_t first_above_;
+    bool overloaded_;
+
+private:
+    /* No copying allowed */
+    QueueDelay(const QueueDelay &);
+    void operator=(const QueueDelay &);
+};
+
+/*
+ * The token bucket of a method, a service or a client, which is
+ * refilled at 'rate' per second up to 'burst'.
+ *
+ * The tokens are taken by the workers in batches into the shards of
+ * their own, so the bucket is locked once per batch. A shard which
+ * finds the bucket empty doesn't lock it again until the next token.
+ */
+class RateLimiter {
+public:
+    /* the tokens (requests) per second, 'burst' is 'rate' if ZERO */
+    RateLimiter(int rate, int burst, int shards);
+    ~RateLimiter();
+
+    /* take a token by the worker of 'shard', false if it's run out */
+    __always_inline bool Acquire(int shard) {
+        Shard *s = &shards_[shard];
+        if (likely(s->tokens > 0)) {
+            s->tokens--;
+            return true;
+        }
+        return Refill(s);
+    }
+
+    /* give back the token taken by 'shard', e.g. rejected by another bucket */
+    void Release(int shard) { shards_[shard].tokens++; }
+
+    int rate()  const { return rate_;  }
+    int burst() const { return burst_; }
+    uint32_t rejected() const { return atomic_read(&rejected_); }
+
+private:
+    /* taken by one worker, padded against false sharing */
+    struct Shard {
+        uint64_t retry;         /* the cycles to try the bucket again */
+        int tokens;
+        char pad[64 - sizeof(uint64_t) - sizeof(int)];
+    };
+
+    bool Refill(Shard *shard);
+
+private:
+    const int rate_;
+    const int burst_;
+    int batch_;
+
+    Shard *shards_;
+    atomic_t rejected_;
+
+    /* updated with the mutex */
+    double tokens_;
+    uint64_t last_;
+    double cycles_per_token_;
+    pthread_mutex_t mutex_;
+
+private:
+    /* No copying allowed */
+    RateLimiter(const RateLimiter &);
+    void operator=(const RateLimiter &);
+};
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_LIMITER_H */
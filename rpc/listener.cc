@@ -37,6 +37,7 @@ namespace qrpc {
 
 Listener::Listener(ServerImpl *server_impl)
     : fd_(-1)
+    , family_(AF_UNSPEC)
     , server_impl_(server_impl)
 {
 
@@ -50,6 +51,9 @@ Listener::~Listener()
     if (fd_ != -1) {
         close(fd_);
     }
+    if (!path_.empty()) {
+        unlink(path_.c_str());
+    }
 }
 
 bool Listener::Start(sockinfo &si)
@@ -111,12 +115,17 @@ bool Listener::BuildSocket(sockinfo &si)
         return false;
     }
     
-    if (set_tcpnodelay(sfd)) {
+    if (si.family != AF_UNIX && set_tcpnodelay(sfd)) {
         LOG(ERROR) << "set tcpnodelay failed!!!";
         close(sfd);
         return false;
     }
     
+    /* remove the stale socket file */
+    if (si.family == AF_UNIX) {
+        unlink(si.addr.un.sun_path);
+    }
+
     err = bind(sfd, (sockaddr *)&si.addr, si.addrlen);
     if (err == -1) {
         LOG(ERROR) << "bind network address failed!!!";
@@ -132,6 +141,10 @@ bool Listener::BuildSocket(sockinfo &si)
     }
 
     fd_ = sfd;
+    family_ = si.family;
+    if (si.family == AF_UNIX) {
+        path_ = si.addr.un.sun_path;
+    }
     return true;
 }
 
@@ -167,11 +180,12 @@ void Listener::HandleAccept(int fd, short what, void *data)
 {
     Listener *me = (Listener *)data;
     int sfd;
-    sockaddr addr;
-    socklen_t len = sizeof(addr);
+    sockinfo si;
+    sockaddr *addr = (sockaddr *)&si.addr;
+    socklen_t len = sizeof(si.addr);
 
     for (; ;) {
-        sfd = accept(fd, &addr, &len);
+        sfd = accept(fd, addr, &len);
 
         if (likely(fd > 0)) {
             break;
@@ -189,7 +203,7 @@ void Listener::HandleAccept(int fd, short what, void *data)
         return;
     }
 
-    string peer = unresolve_addr(&addr, len);
+    string peer = unresolve_addr(addr, len);
     
     const ServerOptions& opt = me->server_impl_->options();
 
@@ -211,7 +225,7 @@ void Listener::HandleAccept(int fd, short what, void *data)
         return;
     }
 
-    if (set_tcpnodelay(sfd)) {
+    if (me->family_ != AF_UNIX && set_tcpnodelay(sfd)) {
         close(sfd);
         LOG(ERROR) << "set tcpnodelay failed: " << strerror(errno);
         return;
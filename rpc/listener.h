@@ -29,9 +29,13 @@ private:
 
 private:
     int fd_;
+    int family_;
     event event_;
     std::string endpoint_;
 
+    /* path of unix domain socket */
+    std::string path_;
+
     ServerImpl *server_impl_;
 
 private:
@@ -0,0 +1,224 @@
+#include <sys/prctl.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/rpc/loop_monitor.h"
+
+using namespace std;
+
+namespace qrpc {
+
+namespace {
+
+typedef map<pthread_t, pair<int, LoopMonitor *> > LoopMap;
+typedef LoopMap::iterator LoopIte;
+
+LoopMap client_loops;
+pthread_mutex_t loop_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+} // anonymous namespace
+
+LoopMonitor::LoopMonitor(const string &name, int slow_usec)
+    : base_(NULL)
+    , slow_(slow_usec ? usec_to_cycles(slow_usec) : 0)
+    , in_iter_(false)
+    , iter_poll_(0)
+    , iter_busy_(0)
+    , iter_ready_(0)
+    , last_end_(0)
+    , method_(NULL)
+{
+    stats_.name = name;
+    stats_.start = rdtsc();
+}
+
+LoopMonitor::~LoopMonitor()
+{
+    Bind(NULL);
+}
+
+void LoopMonitor::Bind(event_base *base)
+{
+    if (base_) {
+        event_del(&mark_);
+    }
+
+    base_ = base;
+    in_iter_ = false;
+
+    if (base_ && event_assign(&mark_, base_, -1, 0, HandleMark, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+}
+
+uint64_t LoopMonitor::Begin()
+{
+    method_ = NULL;
+    return rdtsc();
+}
+
+void LoopMonitor::End(uint64_t start, const string *peer)
+{
+    uint64_t end = rdtsc();
+
+    Account(start, end);
+
+    if (unlikely(slow_ && end - start > slow_)) {
+        Warn(end - start, peer ? "connection" : "closed connection", peer);
+    }
+}
+
+void LoopMonitor::EndCallback(uint64_t start, const char *what)
+{
+    uint64_t end = rdtsc();
+
+    Account(start, end);
+
+    if (unlikely(slow_ && end - start > slow_)) {
+        Warn(end - start, what, NULL);
+    }
+}
+
+void LoopMonitor::OnTask(size_t depth, uint64_t wait, uint64_t run)
+{
+    uint64_t end = rdtsc();
+
+    stats_.queue_depth.Add(depth);
+    stats_.queue_wait.Add(wait);
+
+    Account(end - run, end);
+
+    if (unlikely(slow_ && run > slow_)) {
+        Warn(run, "queued task", NULL);
+    }
+    method_ = NULL;
+}
+
+void LoopMonitor::Account(uint64_t start, uint64_t end)
+{
+    /* the first callback after epoll_wait */
+    if (!in_iter_ && base_) {
+        in_iter_ = true;
+        event_active(&mark_, EV_TIMEOUT, 0);
+
+        iter_poll_ = last_end_ && start > last_end_ ? start - last_end_ : 0;
+        iter_busy_ = 0;
+        iter_ready_ = 0;
+
+        if (last_end_) {
+            stats_.poll.Add(iter_poll_);
+        }
+    }
+
+    iter_busy_ += end - start;
+    iter_ready_++;
+    last_end_ = end;
+
+    stats_.callback.Add(end - start);
+    stats_.busy += end - start;
+}
+
+void LoopMonitor::HandleMark(int fd, short flags, void *arg)
+{
+    LoopMonitor *me = (LoopMonitor *)arg;
+
+    me->in_iter_ = false;
+    me->stats_.iteration.Add(me->iter_poll_ + me->iter_busy_);
+    me->stats_.ready.Add(me->iter_ready_);
+}
+
+void LoopMonitor::Warn(uint64_t cycles, const char *what, const string *peer)
+{
+    stats_.slow++;
+
+    LOG(WARNING) << "slow callback of " << stats_.name
+        << ": " << cycles_to_usec(cycles) << "us"
+        << ", " << what
+        << (peer ? ": " : "") << (peer ? peer->c_str() : "")
+        << ", method: " << (method_ ? method_->c_str() : "none");
+}
+
+void LoopMonitor::Snapshot(LoopStats *stats) const
+{
+    *stats = stats_;
+}
+
+// -------------------------------------------------------------
+// the monitors of channel threads
+// -------------------------------------------------------------
+
+LoopMonitor* new_loop_monitor_if_not(pthread_t tid, event_base *base,
+                                     int slow_usec)
+{
+    LoopMonitor *target = NULL;
+
+    pthread_mutex_lock(&loop_mutex);
+
+    LoopIte ite = client_loops.find(tid);
+
+    if (ite != client_loops.end()) {
+        ite->second.first++;
+        target = ite->second.second;
+    } else {
+        char name[17] = { 0 };
+        prctl(PR_GET_NAME, name, 0, 0, 0);
+
+        LoopMonitor *new_loop = new LoopMonitor(string("client/") + name,
+                                                slow_usec);
+        if (!new_loop) {
+            LOG(FATAL) << "out of memory";
+        }
+        new_loop->Bind(base);
+
+        target = new_loop;
+        client_loops.insert(make_pair(tid, make_pair(1, new_loop)));
+    }
+
+    pthread_mutex_unlock(&loop_mutex);
+
+    return target;
+}
+
+void del_loop_monitor_if_zero(LoopMonitor *source, pthread_t tid)
+{
+    LoopMonitor *target = NULL;
+
+    pthread_mutex_lock(&loop_mutex);
+
+    LoopIte ite = client_loops.find(tid);
+
+    if (ite != client_loops.end()) {
+        assert(ite->second.second == source);
+        if (!--ite->second.first) {
+            target = source;
+            client_loops.erase(ite);
+        }
+    } else {
+        LOG(FATAL) << "invalid local loop monitor";
+    }
+
+    pthread_mutex_unlock(&loop_mutex);
+
+    if (target) { delete target; }
+}
+
+void dump_channel_loops(vector<LoopStats> *loops)
+{
+    pthread_mutex_lock(&loop_mutex);
+
+    LoopIte ite = client_loops.begin();
+    for (; ite != client_loops.end(); ++ite) {
+        loops->push_back(LoopStats());
+        ite->second.second->Snapshot(&loops->back());
+    }
+
+    pthread_mutex_unlock(&loop_mutex);
+}
+
+} // namespace qrpc
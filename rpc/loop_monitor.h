@@ -0,0 +1,129 @@
+#ifndef QRPC_RPC_LOOP_MONITOR_H
+#define QRPC_RPC_LOOP_MONITOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <event.h>
+#include <string>
+#include <vector>
+
+#include "src/qrpc/util/compiler.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/rpc/stats.h"
+
+namespace qrpc {
+
+/*
+ * The snapshot of an event loop, the durations are in cycles.
+ *
+ * An iteration is the callbacks run after one epoll_wait, plus the
+ * time outside the callbacks before them (poll), which is mostly
+ * epoll_wait, and the timers and libevent itself.
+ */
+struct LoopStats {
+    std::string name;
+
+    Histogram iteration;
+    Histogram callback;
+    Histogram poll;
+    Histogram ready;        /* the callbacks of an iteration */
+
+    Histogram queue_depth;  /* the tasks of EvQueue, taken on popping */
+    Histogram queue_wait;   /* the time of tasks in EvQueue */
+
+    uint64_t busy;          /* the cycles of callbacks */
+    uint64_t slow;          /* the callbacks slower than the threshold */
+    uint64_t start;         /* the cycles of creating the monitor */
+
+    LoopStats() : busy(0), slow(0), start(0) { }
+};
+
+/*
+ * Measure the callbacks of an event base, written by the loop thread
+ * only, the readers take the snapshot without locking.
+ *
+ * The first callback after epoll_wait activates a marker event, which
+ * is queued behind the ready events and ends the iteration.
+ */
+class LoopMonitor {
+public:
+    /* warn the callbacks slower than slow_usec, 0 means never */
+    LoopMonitor(const std::string &name, int slow_usec);
+    ~LoopMonitor();
+
+    /* the event base of loop, NULL to unbind it before freeing the base */
+    void Bind(event_base *base);
+
+    /* a callback starts, returns the start cycles */
+    uint64_t Begin();
+
+    /* the callback is done, peer is NULL if the connection is closed */
+    void End(uint64_t start, const std::string *peer);
+
+    /* the callback of the loop itself is done */
+    void EndCallback(uint64_t start, const char *what);
+
+    /* the method handled in the current callback */
+    void Note(const std::string *method) { method_ = method; }
+
+    /* a task of EvQueue is done, the callback of EvQueue::Monitor */
+    void OnTask(size_t depth, uint64_t wait, uint64_t run);
+
+    /* copy the stats, called by any thread */
+    void Snapshot(LoopStats *stats) const;
+
+private:
+    void Account(uint64_t start, uint64_t end);
+    void Warn(uint64_t cycles, const char *what, const std::string *peer);
+
+    static void HandleMark(int fd, short flags, void *arg);
+
+private:
+    event_base *base_;
+    event mark_;
+    uint64_t slow_;
+
+    /* the iteration being run */
+    bool in_iter_;
+    uint64_t iter_poll_;
+    uint64_t iter_busy_;
+    uint64_t iter_ready_;
+    uint64_t last_end_;
+
+    const std::string *method_;
+
+    LoopStats stats_;
+
+private:
+    /* No copying allowed */
+    LoopMonitor(const LoopMonitor &);
+    void operator=(const LoopMonitor &);
+};
+
+/* measure a callback of connection, whose peer may be closed inside */
+class LoopScope {
+public:
+    LoopScope(LoopMonitor *loop, const std::string *peer)
+        : loop_(loop), peer_(peer), start_(loop->Begin()) { }
+    ~LoopScope() { loop_->End(start_, peer_); }
+
+    /* the connection may be released */
+    void Closed() { peer_ = NULL; }
+
+private:
+    LoopMonitor *loop_;
+    const std::string *peer_;
+    uint64_t start_;
+};
+
+/* the monitor shared by the channels of the same thread */
+extern LoopMonitor* new_loop_monitor_if_not(pthread_t tid, event_base *base,
+                                            int slow_usec);
+extern void del_loop_monitor_if_zero(LoopMonitor *loop, pthread_t tid);
+
+/* the snapshots of the channel threads */
+extern void dump_channel_loops(std::vector<LoopStats> *loops);
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_LOOP_MONITOR_H */
@@ -4,6 +4,7 @@
 
 #include "src/qrpc/util/log.h"
 #include "src/qrpc/util/compiler.h"
+#include "src/qrpc/util/probe.h"
 #include "src/qrpc/rpc/errno.h"
 #include "src/qrpc/rpc/closure.h"
 #include "src/qrpc/rpc/controller.h"
@@ -17,6 +18,7 @@
 #include "src/qrpc/rpc/server_impl.h"
 #include "src/qrpc/rpc/message.h"
 #include "src/qrpc/rpc/message.pb.h"
+#include "src/qrpc/rpc/command.h"
 #include "src/qrpc/rpc/connection.h"
 
 using namespace std;
@@ -24,6 +26,28 @@ using namespace google::protobuf;
 
 namespace qrpc {
 
+// -------------------------------------------------------------
+// the deadline of handler
+// -------------------------------------------------------------
+
+static __thread uint64_t tls_deadline = 0;
+
+uint64_t current_deadline()
+{
+    return tls_deadline;
+}
+
+DeadlineScope::DeadlineScope(uint64_t deadline)
+    : saved_(tls_deadline)
+{
+    tls_deadline = deadline;
+}
+
+DeadlineScope::~DeadlineScope()
+{
+    tls_deadline = saved_;
+}
+
 // -------------------------------------------------------------
 // class Message
 // -------------------------------------------------------------
@@ -37,8 +61,13 @@ Message::~Message()
 // class ServerMessage
 // -------------------------------------------------------------
 
+/* the endpoint of in-process channel */
+static string kLocalAddr = "inproc";
+
 ServerMessage::ServerMessage(ServerConnection *conn)
-    : conn_(conn)
+    : worker_(conn->worker())
+    , peer_(NULL)
+    , conn_(conn)
     , compression_type_(0)
     , request_(NULL)
     , response_(NULL)
@@ -46,14 +75,247 @@ ServerMessage::ServerMessage(ServerConnection *conn)
     , method_(NULL)
     , controller_(this)
     , closure_(this, &ServerMessage::OnRpcDone, false)
+    , start_(rdtsc())
+    , stats_(NULL)
+    , received_(conn->read_time())
+    , rpcz_(NULL)
+    , parent_span_(0)
+    , trace_start_(0)
+    , timing_(false)
+    , handler_start_(0)
+    , deadline_(0)
+    , server_limiter_(NULL)
+    , method_limiter_(NULL)
+    , reject_(0)
+    , request_size_(0)
+    , priority_(kPriorityNormal)
 {
+    trace_.trace_id = 0;
+    trace_.span_id = 0;
+    trace_.sampled = false;
 
 }
 
+ServerMessage::ServerMessage(Worker *worker, LocalPeer *peer,
+                             uint64_t received)
+    : worker_(worker)
+    , peer_(peer)
+    , conn_(NULL)
+    , compression_type_(0)
+    , request_(NULL)
+    , response_(NULL)
+    , service_(NULL)
+    , method_(NULL)
+    , controller_(this)
+    , closure_(this, &ServerMessage::OnRpcDone, false)
+    , start_(rdtsc())
+    , stats_(NULL)
+    , received_(received)
+    , rpcz_(NULL)
+    , parent_span_(0)
+    , trace_start_(0)
+    , timing_(false)
+    , handler_start_(0)
+    , deadline_(0)
+    , server_limiter_(NULL)
+    , method_limiter_(NULL)
+    , reject_(0)
+    , request_size_(0)
+    , priority_(kPriorityNormal)
+{
+    trace_.trace_id = 0;
+    trace_.span_id = 0;
+    trace_.sampled = false;
+    peer_->Get();
+}
+
 ServerMessage::~ServerMessage()
 {
     delete request_;
     delete response_;
+    delete rpcz_;
+
+    /* admitted but never served, e.g. the body is broken */
+    if (unlikely(server_limiter_ != NULL)) { server_limiter_->Cancel(); }
+    if (unlikely(method_limiter_ != NULL)) { method_limiter_->Cancel(); }
+
+    if (peer_) {
+        peer_->Put();
+    }
+}
+
+string& ServerMessage::local_addr()
+{
+    return conn_ ? conn_->local_addr() : kLocalAddr;
+}
+
+string& ServerMessage::remote_addr()
+{
+    return conn_ ? conn_->remote_addr() : kLocalAddr;
+}
+
+void ServerMessage::StartRpcz(uint64_t recv, int request_size)
+{
+    rpcz_ = new RpczSpan();
+    if (!rpcz_) {
+        LOG(FATAL) << "alloc rpcz span failed!!!";
+    }
+
+    rpcz_->remote = remote_addr();
+    rpcz_->request_size = request_size;
+    rpcz_->stamps[kRpczRecv] = recv;
+}
+
+void ServerMessage::TakeTrace(const MsgMeta &meta)
+{
+    if (!meta.trace_id()) {
+        return;
+    }
+
+    trace_.trace_id = meta.trace_id();
+    trace_.span_id = meta.span_id();
+    trace_.sampled = meta.sampled();
+    parent_span_ = meta.parent_span();
+
+    if (trace_.sampled) {
+        trace_start_ = wall_usec();
+    }
+}
+
+void ServerMessage::TakeDeadline(const MsgMeta &meta)
+{
+    if (!meta.has_timeout_us()) {
+        return;
+    }
+
+    /* the time on wire is unknown, it's counted from receiving */
+    deadline_ = received_ + usec_to_cycles(meta.timeout_us());
+
+    /* the clock is shared, count the time in the socket buffer too */
+    if (meta.has_deadline_us() && (!conn_ || conn_->same_host())) {
+        uint64_t now = wall_usec();
+        uint64_t left = meta.deadline_us() > now ? meta.deadline_us() - now : 0;
+        uint64_t deadline = rdtsc() + usec_to_cycles(left);
+        if (deadline < deadline_) {
+            deadline_ = deadline;
+        }
+    }
+}
+
+void ServerMessage::RecordTrace()
+{
+    TraceSpan span;
+
+    span.trace_id = trace_.trace_id;
+    span.span_id = trace_.span_id;
+    span.parent_span = parent_span_;
+    span.method = method_ ? method_->full_name() : meta_.method();
+    span.server = true;
+    span.code = controller_.code();
+    span.start_us = trace_start_;
+    span.duration_ns = cycles_to_nsec(rdtsc() - start_);
+
+    record_trace_span(span);
+}
+
+void ServerMessage::RejectMethod()
+{
+    controller_.SetResponseCode(method_ ? kErrField : kErrNotSrv);
+    OnRpcDone();
+}
+
+/* the client has given up, or the server is overloaded */
+void ServerMessage::DropMethod(uint32_t code)
+{
+    controller_.SetResponseCode(code);
+    OnRpcDone();
+}
+
+/*
+ * Take the tokens of the client, the method and its service. The
+ * client goes first, so its excess doesn't take the shared tokens,
+ * and the tokens taken are given back if a later bucket rejects it,
+ * or Admit() does, see Unthrottle().
+ */
+bool ServerMessage::Throttle(const MsgMeta &meta)
+{
+    if (method_->service() == BuiltinService::descriptor()) {
+        return true;
+    }
+
+    ServerImpl *srv_impl = worker_->server_impl();
+    int shard = worker_->index();
+
+    RateLimiter *client = NULL;
+    if (meta.has_client_id()) {
+        client = srv_impl->ClientRate(meta.client_id());
+    }
+    RateLimiter *method = srv_impl->MethodRate(method_);
+    RateLimiter *service = srv_impl->ServiceRate(method_->service());
+
+    if (client && !client->Acquire(shard)) {
+        return false;
+    }
+    if (method && !method->Acquire(shard)) {
+        if (client) { client->Release(shard); }
+        return false;
+    }
+    if (service && !service->Acquire(shard)) {
+        if (method) { method->Release(shard); }
+        if (client) { client->Release(shard); }
+        return false;
+    }
+
+    return true;
+}
+
+/* give back the tokens taken by Throttle(), it's rejected by Admit() */
+void ServerMessage::Unthrottle(const MsgMeta &meta)
+{
+    if (method_->service() == BuiltinService::descriptor()) {
+        return;
+    }
+
+    ServerImpl *srv_impl = worker_->server_impl();
+    int shard = worker_->index();
+    RateLimiter *limiter;
+
+    if (meta.has_client_id()) {
+        limiter = srv_impl->ClientRate(meta.client_id());
+        if (limiter) { limiter->Release(shard); }
+    }
+
+    limiter = srv_impl->MethodRate(method_);
+    if (limiter) { limiter->Release(shard); }
+
+    limiter = srv_impl->ServiceRate(method_->service());
+    if (limiter) { limiter->Release(shard); }
+}
+
+/* take the slots of the server and the method */
+bool ServerMessage::Admit()
+{
+    /* the builtin service is for diagnostics and heartbeat */
+    if (method_->service() == BuiltinService::descriptor()) {
+        return true;
+    }
+
+    ServerImpl *srv_impl = worker_->server_impl();
+    ConcurrencyLimiter *server = srv_impl->limiter();
+    ConcurrencyLimiter *method = srv_impl->MethodLimiter(method_);
+
+    if (server && !server->Acquire()) {
+        return false;
+    }
+    if (method && !method->Acquire()) {
+        if (server) { server->Cancel(); }
+        return false;
+    }
+
+    server_limiter_ = server;
+    method_limiter_ = method;
+
+    return true;
 }
 
 void ServerMessage::OnRpcDone()
@@ -67,8 +329,51 @@ void ServerMessage::OnRpcDone()
         meta_.set_code(controller_.code());
         meta_.set_error_text(controller_.error_text());
     }
-    
-    conn_->Send(this);
+
+    if (unlikely(timing_ && handler_start_)) {
+        meta_.set_server_queue_ns(cycles_to_nsec(handler_start_ - start_));
+        meta_.set_server_handler_ns(cycles_to_nsec(rdtsc() - handler_start_));
+    }
+
+    if (stats_) {
+        stats_->Record(controller_.code(), rdtsc() - start_);
+    }
+
+    /* the latency since read, including the requests ahead of it */
+    if (server_limiter_ || method_limiter_) {
+        uint64_t elapsed = rdtsc() - received_;
+        if (server_limiter_) { server_limiter_->Release(elapsed); }
+        if (method_limiter_) { method_limiter_->Release(elapsed); }
+        server_limiter_ = NULL;
+        method_limiter_ = NULL;
+    }
+
+    if (unlikely(trace_.sampled)) {
+        RecordTrace();
+    }
+
+    if (unlikely(rpcz_ != NULL)) {
+        rpcz_->Stamp(kRpczDone);
+        rpcz_->code = controller_.code();
+        rpcz_->method = method_->full_name();
+    }
+
+    if (conn_) {
+        conn_->Send(this);
+        return;
+    }
+
+    /* hand over the response to the in-process channel */
+    peer_->Remove(id());
+    FinishMethod();
+
+    LocalDone *cmd = new LocalDone(peer_, this);
+    if (!cmd) {
+        LOG(FATAL) << "alloc local done failed!!!";
+    }
+    if (!peer_->Push(cmd)) {
+        cmd->Quit();
+    }
 }
 
 int ServerMessage::CompressionType() const
@@ -120,10 +425,9 @@ bool ServerMessage::SerializeToArray(char *data, int len) const
     return true;
 }
 
-bool ServerMessage::ParseFromArray(const char *data, int len, const MsgMeta &meta)
+bool ServerMessage::FindMethod(const MsgMeta &meta)
 {
-    Worker *worker = conn_->worker();
-    ServerImpl *srv_impl = worker->server_impl();
+    ServerImpl *srv_impl = worker_->server_impl();
 
     service_ = srv_impl->Find(meta);
     if (!service_) {
@@ -145,18 +449,122 @@ bool ServerMessage::ParseFromArray(const char *data, int len, const MsgMeta &met
         return false;
     }
 
-    request_  = service_->GetRequestPrototype(method_).New();
     response_ = service_->GetResponsePrototype(method_).New();
-    if (!request_ || !response_) {
+    if (!response_) {
         LOG(FATAL) << "alloc message failed!!!";
     }
 
-    compression_type_ = meta.compression_type();
+    compression_type_ = srv_impl->ResponseCompression(method_, meta);
+    stats_ = worker_->stats()->Get(method_);
+
+    TakePriority(meta);
+
+    if (srv_impl->options().fair_queue) {
+        TakeClient(meta);
+    }
+
+    return true;
+}
+
+void ServerMessage::TakePriority(const MsgMeta &meta)
+{
+    /* the health checks aren't queued behind the others */
+    if (method_->service() == BuiltinService::descriptor()) {
+        priority_ = kPriorityHigh;
+    } else if (meta.priority() < (uint32_t)kNumPriorities) {
+        priority_ = meta.priority();
+    } else {
+        priority_ = kPriorityLow;
+    }
+}
+
+void ServerMessage::TakeClient(const MsgMeta &meta)
+{
+    /* the connection stands for the anonymous client */
+    if (meta.has_client_id() && !meta.client_id().empty()) {
+        client_ = meta.client_id();
+    } else {
+        client_ = remote_addr();
+    }
+}
+
+bool ServerMessage::ParseFromArray(const char *data, int len, const MsgMeta &meta)
+{
     meta_.set_sequence(meta.sequence());
+    request_size_ = len;
+    TakeTrace(meta);
+    TakeDeadline(meta);
+    timing_ = meta.want_timing();
+
+    if (!FindMethod(meta)) {
+        return false;
+    }
+
+    /* it's dropped before calling, skip the body */
+    if (unlikely(expired())) {
+        return true;
+    }
+    if (unlikely(!Throttle(meta))) {
+        reject_ = kErrRateLimit;
+        return true;
+    }
+    if (unlikely(!Admit())) {
+        Unthrottle(meta);
+        reject_ = kErrOverload;
+        return true;
+    }
+
+    request_ = service_->GetRequestPrototype(method_).New();
+    if (!request_) {
+        LOG(FATAL) << "alloc message failed!!!";
+    }
 
     return request_->ParseFromArray(data, len);
 }
 
+bool ServerMessage::ParseFromMessage(google::protobuf::Message *request,
+                                     const MsgMeta &meta)
+{
+    meta_.set_sequence(meta.sequence());
+    TakeTrace(meta);
+    TakeDeadline(meta);
+    timing_ = meta.want_timing();
+
+    if (!FindMethod(meta)) {
+        delete request;
+        return false;
+    }
+
+    /* it's dropped before calling if expired */
+    if (likely(!expired())) {
+        if (unlikely(!Throttle(meta))) {
+            reject_ = kErrRateLimit;
+        } else if (unlikely(!Admit())) {
+            Unthrottle(meta);
+            reject_ = kErrOverload;
+        }
+    }
+
+    /* the same generated class, take it without copying */
+    const google::protobuf::Message &proto = service_->GetRequestPrototype(method_);
+    if (request->GetReflection() == proto.GetReflection()) {
+        request_ = request;
+        return true;
+    }
+
+    request_ = proto.New();
+    if (!request_) {
+        LOG(FATAL) << "alloc message failed!!!";
+    }
+
+    string data;
+    bool rc = request->SerializeToString(&data)
+           && request_->ParseFromString(data);
+    delete request;
+
+    return rc;
+}
+
 // -------------------------------------------------------------
 // class ClientMessage
 // -------------------------------------------------------------
@@ -174,6 +582,17 @@ ClientMessage::ClientMessage(ChannelImpl *channel,
     , done_(done)
     , response_(response)
     , request_(request)
+    , start_(rdtsc())
+    , stats_(channel->stats()->Get(method))
+    , deadline_(0)
+    , trace_start_(0)
+    , method_(method)
+    , encode_start_(0)
+    , sent_(0)
+    , received_(0)
+    , server_queue_ns_(0)
+    , server_handler_ns_(0)
+    , request_size_(0)
 {
     const string &fname = method->full_name();
     size_t dotpos = fname.find_last_of('.');
@@ -186,6 +605,29 @@ ClientMessage::ClientMessage(ChannelImpl *channel,
     meta_.set_service(service);
     meta_.set_method(method->name());
     meta_.set_compression_type(controller->options().compression);
+    meta_.set_accept_compression(kAcceptCompression);
+
+    StartTrace();
+
+    /* the call made inside a handler can't outlive the handler's client */
+    int timeout = controller->options().rpc_timeout;
+    deadline_ = start_ + usec_to_cycles(timeout * 1000ULL);
+    uint64_t inherited = current_deadline();
+    if (inherited && inherited < deadline_) {
+        deadline_ = inherited;
+    }
+
+    if (controller->options().collect_timing) {
+        meta_.set_want_timing(true);
+    }
+
+    if (controller->options().priority != kPriorityNormal) {
+        meta_.set_priority(controller->options().priority);
+    }
+
+    if (!channel->options().client_id.empty()) {
+        meta_.set_client_id(channel->options().client_id);
+    }
 
     controller->SetOwnership(this);
 }
@@ -213,6 +655,100 @@ void ClientMessage::AssignEndpoints()
     }
 }
 
+void ClientMessage::StartTrace()
+{
+    const TraceContext &ctx = current_trace();
+    int rate = channel_->options().trace_sample_rate;
+
+    uint64_t parent = 0;
+    bool sampled = false;
+
+    if (ctx.trace_id) {
+        /* the child of the handler's span */
+        meta_.set_trace_id(ctx.trace_id);
+        parent = ctx.span_id;
+        sampled = ctx.sampled;
+    } else if (rate) {
+        /* the root of a new trace */
+        uint64_t trace_id = new_trace_id();
+        meta_.set_trace_id(trace_id);
+        sampled = (trace_id % rate == 0);
+    } else {
+        return;
+    }
+
+    meta_.set_span_id(new_trace_id());
+    if (parent) {
+        meta_.set_parent_span(parent);
+    }
+    if (sampled) {
+        meta_.set_sampled(true);
+        trace_start_ = wall_usec();
+    }
+}
+
+void ClientMessage::RecordTrace()
+{
+    TraceSpan span;
+
+    span.trace_id = meta_.trace_id();
+    span.span_id = meta_.span_id();
+    span.parent_span = meta_.parent_span();
+    span.method = meta_.service() + "." + meta_.method();
+    span.server = false;
+    span.code = controller_->code();
+    span.start_us = trace_start_;
+    span.duration_ns = cycles_to_nsec(rdtsc() - start_);
+
+    record_trace_span(span);
+}
+
+void ClientMessage::TakeTiming(const MsgMeta &meta)
+{
+    if (likely(!meta_.want_timing())) {
+        return;
+    }
+
+    received_ = rdtsc();
+    server_queue_ns_ = meta.server_queue_ns();
+    server_handler_ns_ = meta.server_handler_ns();
+}
+
+void ClientMessage::FillTiming()
+{
+    CallTiming timing;
+
+    timing.server_queue_ns = server_queue_ns_;
+    timing.server_handler_ns = server_handler_ns_;
+    timing.total_ns = cycles_to_nsec(rdtsc() - start_);
+
+    if (encode_start_) {
+        timing.queue_ns = cycles_to_nsec(encode_start_ - start_);
+    }
+    if (encode_start_ && sent_) {
+        timing.encode_ns = cycles_to_nsec(sent_ - encode_start_);
+    }
+
+    /* the in-process call has no wire */
+    uint64_t issued = sent_ ? sent_ : start_;
+    if (received_) {
+        uint64_t round = cycles_to_nsec(received_ - issued);
+        uint64_t server = server_queue_ns_ + server_handler_ns_;
+        timing.wire_ns = round > server ? round - server : 0;
+    }
+
+    controller_->SetTiming(timing);
+}
+
+void ClientMessage::StampDeadline()
+{
+    uint64_t now = rdtsc();
+    uint64_t left = now < deadline_ ? cycles_to_usec(deadline_ - now) : 0;
+
+    meta_.set_timeout_us(left);
+    meta_.set_deadline_us(wall_usec() + left);
+}
+
 void ClientMessage::NewMonitor()
 {
     if (monitor_) {
@@ -221,10 +757,15 @@ void ClientMessage::NewMonitor()
 
     monitor_ = true;
 
-    const ControllerOptions &ctl_opt = controller_->options();
+    /* round up, the server drops the request once it's exceeded */
+    uint64_t now = rdtsc();
+    uint64_t msec = 0;
+    if (now < deadline_) {
+        msec = (cycles_to_usec(deadline_ - now) + 999) / 1000;
+    }
 
     timer_.Set(channel_->base(),
-               ctl_opt.rpc_timeout,
+               msec,
                tr1::bind(&ClientMessage::HandleTimeout, this));
     timer_.SchedOneshot();
 }
@@ -241,6 +782,8 @@ void ClientMessage::DelMonitor()
 
 void ClientMessage::HandleTimeout()
 {
+    QRPC_PROBE2(client_timeout, this, channel_);
+
     controller_->SetResponseCode(kErrTimeout);
 
     monitor_ = false;
@@ -254,6 +797,21 @@ void ClientMessage::StartCancel()
     channel_->StartCancel(this);
 }
 
+/*
+ * Only the sequence is sent, so the server drops the request. The
+ * controller and the request may be released, they aren't touched.
+ */
+void ClientMessage::ToCancel()
+{
+    assert(finish_ == true);
+
+    uint64_t sequence = meta_.sequence();
+    meta_.Clear();
+    meta_.set_sequence(sequence);
+    meta_.set_cancel(true);
+    meta_.set_priority(kPriorityHigh);
+}
+
 int ClientMessage::CompressionType() const
 {
     return meta_.compression_type();
@@ -265,7 +823,8 @@ void ClientMessage::ByteSize(int *smeta, int *sdata) const
     assert(sdata != NULL);
 
     *smeta = meta_.ByteSize();
-    *sdata = request_->ByteSize();
+    *sdata = meta_.cancel() ? 0 : request_->ByteSize();
+    request_size_ = *sdata;
 
     if ((uint32_t)*smeta > kMaxMetaSize) {
         LOG(FATAL) << "the message meta is too long";
@@ -278,21 +837,57 @@ void ClientMessage::ByteSize(int *smeta, int *sdata) const
 bool ClientMessage::SerializeToArray(char *data, int len) const
 {
     int smeta = meta_.GetCachedSize();
-    int sdata = request_->GetCachedSize();
+    int sdata = meta_.cancel() ? 0 : request_->GetCachedSize();
 
     if (smeta + sdata > len) {
         LOG(ERROR) << "the array is too small!!!";
         return false;
     }
 
+    if (unlikely(meta_.want_timing())) {
+        encode_start_ = rdtsc();
+    }
+
     uint8 *brk = meta_.SerializeWithCachedSizesToArray((uint8 *)data);
-    request_->SerializeWithCachedSizesToArray(brk);
+    if (sdata) {
+        request_->SerializeWithCachedSizesToArray(brk);
+    }
+
+    return true;
+}
+
+bool ClientMessage::ParseFromMessage(google::protobuf::Message *response,
+                                     const MsgMeta &meta)
+{
+    TakeTiming(meta);
+
+    /* response failed */
+    if (meta.code()) {
+        controller_->SetResponseCode(meta.code());
+        controller_->SetResponseError(meta.error_text());
+        return true;
+    }
+
+    /* the same generated class, swap without copying */
+    if (response->GetReflection() == response_->GetReflection()) {
+        response_->GetReflection()->Swap(response_, response);
+        return true;
+    }
+
+    string data;
+    if (!response->SerializeToString(&data) ||
+        !response_->ParseFromString(data)) {
+        controller_->SetResponseCode(kErrResponse);
+        return false;
+    }
 
     return true;
 }
 
 bool ClientMessage::ParseFromArray(const char *data, int len, const MsgMeta &meta)
 {
+    TakeTiming(meta);
+
     /* response failed */
     if (meta.code()) {
         controller_->SetResponseCode(meta.code());
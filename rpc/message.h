@@ -13,6 +13,12 @@
 #include "src/qrpc/util/timer.h"
 #include "src/qrpc/util/atomic.h"
 #include "src/qrpc/util/compiler.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/rpc/controller.h"
+#include "src/qrpc/rpc/stats.h"
+#include "src/qrpc/rpc/rpcz.h"
+#include "src/qrpc/rpc/trace.h"
+#include "src/qrpc/rpc/limiter.h"
 #include "src/qrpc/rpc/message.pb.h"
 
 namespace qrpc {
@@ -32,13 +38,19 @@ class Connection;
 class ClientConnection;
 class ServerConnection;
 
+class LocalPeer;
+
 struct MsgHdr {
     int payload_;
     int data_;
     int meta_;
     int compression_;
+    int checksum_;
+    uint32_t crc_;
 
-    MsgHdr() : payload_(0), data_(0), meta_(0), compression_(0) { }
+    MsgHdr()
+        : payload_(0), data_(0), meta_(0)
+        , compression_(0), checksum_(0), crc_(0) { }
 };
 
 /*
@@ -47,12 +59,19 @@ struct MsgHdr {
  * data size (4 bytes),
  * meta size (2 bytes),
  * compression type (1 byte),
+ * crc32c of payload (4 bytes, optional)
+ *
+ * The crc32c is present only if kMsgCrcFlag is set
+ * in the compression type.
  */
 static const int kMsgPayloadSize = 4;
 static const int kMsgDataSize = 4;
 static const int kMsgMetaSize = 2;
 static const int kMsgCompSize = 1;
+static const int kMsgCrcSize = 4;
 static const int kMsgHdrSize = 4 + 4 + 2 + 1;
+static const int kMsgMaxHdrSize = kMsgHdrSize + kMsgCrcSize;
+static const int kMsgCrcFlag = 0x80;
 
 /*
  * The ByteSize() of google protobuf returns 'int',
@@ -65,6 +84,27 @@ static const uint32_t kMaxMetaSize = (65535);
 static const uint32_t kMaxDataSize = (2147483647 - 65535);
 static const uint32_t kMaxPayloadSize = (2147483647);
 
+/*
+ * The codecs which the client is able to uncompress,
+ * advertised in MsgMeta::accept_compression.
+ */
+static const uint32_t kAcceptCompression = (1 << kZlibCompression)
+                                         | (1 << kLz4Compression)
+                                         | (1 << kSnappyCompression);
+
+/* the deadline (cycles) of the handler running in this thread, 0 if none */
+extern uint64_t current_deadline();
+
+/* run the handler before the deadline, inherited by its client calls */
+class DeadlineScope {
+public:
+    explicit DeadlineScope(uint64_t deadline);
+    ~DeadlineScope();
+
+private:
+    uint64_t saved_;
+};
+
 class Message {
 public:
     inline Message() { }
@@ -84,6 +124,7 @@ private:
 class ServerMessage : public Message {
 public:
     explicit ServerMessage(ServerConnection *conn);
+    explicit ServerMessage(Worker *worker, LocalPeer *peer, uint64_t received);
     virtual ~ServerMessage();
 
     virtual int  CompressionType() const;
@@ -91,26 +132,92 @@ public:
     virtual bool SerializeToArray(char *data, int len) const;
     virtual bool ParseFromArray(const char *data, int len, const MsgMeta &meta);
 
+    /* Take the request of in-process channel */
+    bool ParseFromMessage(google::protobuf::Message *request, const MsgMeta &meta);
+
 public:
     uint64_t id() const { return meta_.sequence(); }
+    const MsgMeta& msg_meta() const { return meta_; }
+    google::protobuf::Message* response() { return response_; }
     ServerConnection* server_connection() { return conn_; }
+    const google::protobuf::MethodDescriptor* method() const { return method_; }
+
+    std::string& local_addr();
+    std::string& remote_addr();
+
 
     inline void FinishMethod() { controller_.FinishRequest(); }
 
+    /* the last touch, the callback of the handler may finish it */
     inline void CancelMethod() {
-        controller_.CancelRequest();
         meta_.set_code(controller_.code());
         meta_.set_error_text(controller_.error_text());
+        controller_.CancelRequest();
     }
 
     inline void CallMethod() {
+        if (unlikely(expired())) { return DropMethod(kErrDeadline); }
+        if (unlikely(reject_)) { return DropMethod(reject_); }
+        if (unlikely(timing_)) { handler_start_ = rdtsc(); }
+        TraceScope scope(trace_);
+        DeadlineScope deadline(deadline_);
         service_->CallMethod(method_, &controller_, request_, response_, &closure_);
     }
+    void RejectMethod();
+    void DropMethod(uint32_t code);
+
+    /* the cycles when the client gives up, 0 if no deadline */
+    uint64_t deadline() const { return deadline_; }
+    bool expired() const { return deadline_ && rdtsc() >= deadline_; }
+
+    /* the client has sent the cancel of it */
+    bool canceled() const { return controller_.IsCanceled(); }
+
+    /* the cycles when the request is read */
+    uint64_t received() const { return received_; }
+
+    /* false if it's rejected by the limiters */
+    bool admitted() const { return !reject_; }
+
+    /* the bytes of request on the wire */
+    int request_size() const { return request_size_; }
+
+    int priority() const { return priority_; }
+
+    /* the client for fair queuing, EMPTY if it's off */
+    const std::string& client() const { return client_; }
+
+    /* the window of the client, ZERO is unlimited */
+    void SetCredit(uint32_t requests, uint32_t bytes) {
+        if (requests) { meta_.set_credit_requests(requests); }
+        if (bytes) { meta_.set_credit_bytes(bytes); }
+    }
+
+    /* sample the request into the rpcz */
+    void StartRpcz(uint64_t recv, int request_size);
+    RpczSpan* rpcz() { return rpcz_; }
+
+    inline void Stamp(RpczStage stage) {
+        if (unlikely(rpcz_ != NULL)) {
+            rpcz_->Stamp(stage);
+        }
+    }
 
 private:
+    bool FindMethod(const MsgMeta &meta);
+    void TakePriority(const MsgMeta &meta);
+    void TakeClient(const MsgMeta &meta);
+    void TakeTrace(const MsgMeta &meta);
+    void TakeDeadline(const MsgMeta &meta);
+    bool Throttle(const MsgMeta &meta);
+    void Unthrottle(const MsgMeta &meta);
+    bool Admit();
+    void RecordTrace();
     void OnRpcDone();
 
 private:
+    Worker *worker_;
+    LocalPeer *peer_;
     ServerConnection *conn_;
 
     MsgMeta meta_;
@@ -124,6 +231,37 @@ private:
 
     ServerController controller_;
     internal::MethodClosure0<ServerMessage> closure_;
+
+    /* the latency since the request is received */
+    uint64_t start_;
+    MethodStats *stats_;
+
+    /* the bytes of request are read, maybe long before parsing */
+    uint64_t received_;
+
+    /* the stages of sampled request */
+    RpczSpan *rpcz_;
+
+    /* the span of the request, shared with the client */
+    TraceContext trace_;
+    uint64_t parent_span_;
+    uint64_t trace_start_;
+
+    /* return the timings in the response meta */
+    bool timing_;
+    uint64_t handler_start_;
+
+    /* the budget of client, counted from receiving the request */
+    uint64_t deadline_;
+
+    /* the slots taken, or the code if it's rejected by the limiters */
+    ConcurrencyLimiter *server_limiter_;
+    ConcurrencyLimiter *method_limiter_;
+    uint32_t reject_;
+
+    int request_size_;
+    int priority_;
+    std::string client_;
 };
 
 class ClientMessage : public Message {
@@ -143,9 +281,18 @@ public:
 public:
     const MsgMeta& msg_meta() const { return meta_; }
     uint64_t id() const { return meta_.sequence(); }
+    const google::protobuf::MethodDescriptor* method() const { return method_; }
+
+    /* the request is written to the connection */
+    void Sent() {
+        if (unlikely(meta_.want_timing())) { sent_ = rdtsc(); }
+    }
 
     void Finish() {
         if (finish_) { return; }
+        stats_->Record(controller_->code(), rdtsc() - start_);
+        if (unlikely(meta_.sampled())) { RecordTrace(); }
+        if (unlikely(meta_.want_timing())) { FillTiming(); }
         AssignEndpoints();
         controller_->ResetOwnership();
         done_->Run();
@@ -153,15 +300,39 @@ public:
     }
     bool finish() const { return finish_; }
 
+    /* Take the response of in-process channel */
+    bool ParseFromMessage(google::protobuf::Message *response, const MsgMeta &meta);
+
+
     void StartCancel();
     void SetCancel() { controller_->SetResponseCode(kErrCancel); }
 
+    /* the finished call becomes the cancel frame of its request */
+    void ToCancel();
+    bool cancel() const { return meta_.cancel(); }
+    void SetBacklog() { controller_->SetResponseCode(kErrBacklog); }
+    void SetConnLost() { controller_->SetResponseCode(kErrConnLost); }
+
+    const google::protobuf::Message* request() const { return request_; }
+
+    /* the bytes of request, taken on encoding */
+    int request_size() const { return request_size_; }
+
+    int priority() const { return meta_.priority(); }
+
+    /* send the budget left, called before encoding */
+    void StampDeadline();
+
     void NewMonitor();
     void DelMonitor();
 
 private:
     void HandleTimeout();
     void AssignEndpoints();
+    void StartTrace();
+    void RecordTrace();
+    void TakeTiming(const MsgMeta &meta);
+    void FillTiming();
 
 private:
     MsgMeta meta_;
@@ -176,6 +347,27 @@ private:
     google::protobuf::Closure *done_;
     google::protobuf::Message *response_;
     const google::protobuf::Message *request_;
+
+    /* the latency since the request is issued */
+    uint64_t start_;
+    MethodStats *stats_;
+
+    /* the rpc_timeout, or the deadline of the handler if it's earlier */
+    uint64_t deadline_;
+
+    /* the wall time of the sampled span */
+    uint64_t trace_start_;
+
+    const google::protobuf::MethodDescriptor *method_;
+
+    /* the stages of call, if collect_timing */
+    mutable uint64_t encode_start_;
+    uint64_t sent_;
+    uint64_t received_;
+    uint64_t server_queue_ns_;
+    uint64_t server_handler_ns_;
+
+    mutable int request_size_;
 };
 
 } // namespace qrpc
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <assert.h>
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include <google/protobuf/service.h>
+#include <google/protobuf/descriptor.h>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/rpc/errno.h"
+#include "src/qrpc/rpc/closure.h"
+#include "src/qrpc/rpc/controller.h"
+#include "src/qrpc/rpc/controller_client.h"
+#include "src/qrpc/rpc/controller_server.h"
+#include "src/qrpc/rpc/message.h"
+#include "src/qrpc/rpc/limiter.h"
+#include "src/qrpc/rpc/builtin.h"
+#include "src/qrpc/rpc/server.h"
+#include "src/qrpc/rpc/server_impl.h"
+#include "src/qrpc/rpc/ready_queue.h"
+
+using namespace std;
+
+namespace qrpc {
+
+ReadyQueue::ReadyQueue(ServerImpl *server)
+    : server_(server)
+    , size_(0)
+{
+
+}
+
+ReadyQueue::~ReadyQueue()
+{
+    assert(size_ == 0);
+
+    for (int i = 0; i < kNumPriorities; i++) {
+        FlowMap &flows = levels_[i].flows;
+        for (FlowMap::iterator it = flows.begin(); it != flows.end(); ++it) {
+            delete it->second;
+        }
+        flows.clear();
+    }
+}
+
+ReadyQueue::Flow* ReadyQueue::GetFlow(Level *level, const string &client)
+{
+    FlowMap::iterator it = level->flows.find(client);
+    if (it != level->flows.end()) {
+        return it->second;
+    }
+
+    Flow *flow = new Flow();
+    if (!flow) {
+        LOG(FATAL) << "alloc ready flow failed!!!";
+    }
+    flow->client = client;
+    flow->weight = server_->ClientWeight(client);
+    flow->deficit = flow->weight;
+
+    level->flows.insert(make_pair(client, flow));
+
+    return flow;
+}
+
+/* the drained client is forgotten, the weight is kept by the server */
+void ReadyQueue::DelFlow(Level *level, Flow *flow)
+{
+    assert(flow->msgs.empty());
+
+    level->flows.erase(flow->client);
+    delete flow;
+}
+
+void ReadyQueue::Push(ServerMessage *msg)
+{
+    Level *level = &levels_[msg->priority()];
+    Flow *flow = GetFlow(level, msg->client());
+
+    /* join the round at the back */
+    if (flow->msgs.empty()) {
+        level->active.push_back(flow);
+    }
+
+    flow->msgs.push_back(msg);
+    size_++;
+}
+
+ServerMessage* ReadyQueue::Pop(bool newest)
+{
+    if (!size_) {
+        return NULL;
+    }
+
+    int i = 0;
+    while (levels_[i].active.empty()) {
+        i++;
+    }
+
+    Level *level = &levels_[i];
+    Flow *flow = level->active.front();
+
+    /* the critical ones kept by Shed() are older, they go first */
+    ServerMessage *msg;
+    if (newest && !server_->IsCritical(flow->msgs.front()->method())) {
+        msg = flow->msgs.back();
+        flow->msgs.pop_back();
+    } else {
+        msg = flow->msgs.front();
+        flow->msgs.pop_front();
+    }
+    size_--;
+
+    if (flow->msgs.empty()) {
+        level->active.pop_front();
+        DelFlow(level, flow);
+    } else if (--flow->deficit == 0) {
+        flow->deficit = flow->weight;
+        level->active.pop_front();
+        level->active.push_back(flow);
+    }
+
+    return msg;
+}
+
+uint64_t ReadyQueue::Oldest() const
+{
+    uint64_t oldest = 0;
+
+    for (int i = 0; i < kNumPriorities; i++) {
+        const deque<Flow *> &active = levels_[i].active;
+
+        for (size_t j = 0; j < active.size(); j++) {
+            uint64_t received = active[j]->msgs.front()->received();
+            if (!oldest || received < oldest) {
+                oldest = received;
+            }
+        }
+    }
+
+    return oldest;
+}
+
+/* from the oldest of each client, the critical ones are kept */
+void ReadyQueue::Shed(const QueueDelay *delay, uint64_t now,
+                      vector<ServerMessage *> *shed)
+{
+    for (int i = 0; i < kNumPriorities; i++) {
+        Level *level = &levels_[i];
+        deque<Flow *> &active = level->active;
+        deque<Flow *>::iterator fit = active.begin();
+
+        while (fit != active.end()) {
+            deque<ServerMessage *> &msgs = (*fit)->msgs;
+            deque<ServerMessage *>::iterator it = msgs.begin();
+
+            while (it != msgs.end() &&
+                   delay->Expired(now - (*it)->received())) {
+                if (server_->IsCritical((*it)->method())) {
+                    ++it;
+                    continue;
+                }
+
+                shed->push_back(*it);
+                it = msgs.erase(it);
+                size_--;
+            }
+
+            if (msgs.empty()) {
+                Flow *flow = *fit;
+                fit = active.erase(fit);
+                DelFlow(level, flow);
+            } else {
+                ++fit;
+            }
+        }
+    }
+}
+
+} // namespace qrpc
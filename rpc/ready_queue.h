@@ -0,0 +1,80 @@
+#ifndef QRPC_RPC_READY_QUEUE_H
+#define QRPC_RPC_READY_QUEUE_H
+
+#include <stdint.h>
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include "src/qrpc/rpc/controller.h"
+
+namespace qrpc {
+
+class QueueDelay;
+class ServerImpl;
+class ServerMessage;
+
+/*
+ * The parsed requests waiting in a worker, served by priority, and
+ * by deficit round robin between the clients of a priority: a client
+ * of weight w takes w requests in its turn, then goes to the back.
+ *
+ * Without fair queuing the client of requests is empty, so it's FIFO
+ * per priority. Used by the worker thread only.
+ */
+class ReadyQueue {
+public:
+    explicit ReadyQueue(ServerImpl *server);
+    ~ReadyQueue();
+
+    void Push(ServerMessage *msg);
+
+    /*
+     * The next one, the newest of the client if 'newest' unless its
+     * oldest is critical, so the critical ones are FIFO. NULL if empty.
+     */
+    ServerMessage* Pop(bool newest);
+
+    /* the cycles when the oldest request is read, 0 if it's empty */
+    uint64_t Oldest() const;
+
+    /* take out the non-critical requests expired in overload */
+    void Shed(const QueueDelay *delay, uint64_t now,
+              std::vector<ServerMessage *> *shed);
+
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+private:
+    struct Flow {
+        std::string client;
+        std::deque<ServerMessage *> msgs;
+        int weight;
+        int deficit;
+    };
+
+    typedef std::map<std::string, Flow *> FlowMap;
+
+    struct Level {
+        FlowMap flows;                  /* the clients with requests */
+        std::deque<Flow *> active;      /* the clients with requests */
+    };
+
+    Flow* GetFlow(Level *level, const std::string &client);
+    void DelFlow(Level *level, Flow *flow);
+
+private:
+    ServerImpl *server_;
+    Level levels_[kNumPriorities];
+    int size_;
+
+private:
+    /* No copying allowed */
+    ReadyQueue(const ReadyQueue &);
+    void operator=(const ReadyQueue &);
+};
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_READY_QUEUE_H */
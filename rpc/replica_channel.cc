@@ -0,0 +1,525 @@
+#include <sys/time.h>
+#include <assert.h>
+#include <event.h>
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include <string>
+
+#include <google/protobuf/message.h>
+#include <google/protobuf/service.h>
+#include <google/protobuf/descriptor.h>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/util/compiler.h"
+#include "src/qrpc/rpc/errno.h"
+#include "src/qrpc/rpc/closure.h"
+#include "src/qrpc/rpc/controller.h"
+#include "src/qrpc/rpc/controller_client.h"
+#include "src/qrpc/rpc/controller_server.h"
+#include "src/qrpc/rpc/message.h"
+#include "src/qrpc/rpc/trace.h"
+#include "src/qrpc/rpc/stats.h"
+#include "src/qrpc/rpc/channel.h"
+#include "src/qrpc/rpc/channel_impl.h"
+#include "src/qrpc/rpc/retry.h"
+#include "src/qrpc/rpc/replica_channel.h"
+
+using namespace std;
+using namespace google::protobuf;
+
+namespace qrpc {
+
+namespace {
+
+/* the calls of a window which the delay is taken from */
+static const uint64_t kHedgeWindowSamples = 256;
+
+/*
+ * A call of hedged method. The primary goes with the user's controller
+ * and response, the backup with its own, which are swapped into the
+ * user's if it wins. The loser is canceled, and the server is told.
+ *
+ * A failure waits for the other one if it's in flight, so the user
+ * sees the error only if both failed. The user's cancel goes to the
+ * backup meanwhile, by the cancel hook of the controller.
+ */
+class HedgedCall {
+public:
+    HedgedCall(ReplicaChannel *channel,
+               ReplicaChannel::Hedge *hedge,
+               size_t primary,
+               const MethodDescriptor *method,
+               ClientController *controller,
+               const google::protobuf::Message *request,
+               google::protobuf::Message *response,
+               google::protobuf::Closure *done);
+    ~HedgedCall();
+
+    void Start();
+
+private:
+    static void HandleTimer(int fd, short flags, void *arg);
+
+    void OnTimer();
+    void OnPrimaryDone();
+    void OnBackupDone();
+    void OnCancel();
+    void TakeBackup();
+    void Complete();
+
+private:
+    ReplicaChannel *channel_;
+    ReplicaChannel::Hedge *hedge_;
+    size_t primary_;
+
+    const MethodDescriptor *method_;
+    ClientController *controller_;
+    const google::protobuf::Message *request_;
+    google::protobuf::Message *response_;
+    google::protobuf::Closure *done_;
+
+    /* the backup is issued in the context of the call */
+    uint64_t start_;
+    uint64_t deadline_;
+    TraceContext trace_;
+
+    bool armed_;
+    event timer_;
+
+    ClientController *backup_controller_;
+    google::protobuf::Message *backup_response_;
+
+    bool primary_done_;
+    bool backup_sent_;
+    bool backup_done_;
+    bool backup_won_;
+    bool canceling_;
+
+    /* set while the failed primary waits for the backup */
+    google::protobuf::Closure *cancel_;
+};
+
+HedgedCall::HedgedCall(ReplicaChannel *channel,
+                       ReplicaChannel::Hedge *hedge,
+                       size_t primary,
+                       const MethodDescriptor *method,
+                       ClientController *controller,
+                       const google::protobuf::Message *request,
+                       google::protobuf::Message *response,
+                       google::protobuf::Closure *done)
+    : channel_(channel)
+    , hedge_(hedge)
+    , primary_(primary)
+    , method_(method)
+    , controller_(controller)
+    , request_(request)
+    , response_(response)
+    , done_(done)
+    , start_(0)
+    , deadline_(0)
+    , armed_(false)
+    , backup_controller_(NULL)
+    , backup_response_(NULL)
+    , primary_done_(false)
+    , backup_sent_(false)
+    , backup_done_(false)
+    , backup_won_(false)
+    , canceling_(false)
+    , cancel_(NULL)
+{
+
+}
+
+HedgedCall::~HedgedCall()
+{
+    assert(armed_ == false);
+
+    delete backup_controller_;
+    delete backup_response_;
+}
+
+void HedgedCall::Start()
+{
+    start_ = rdtsc();
+
+    /* the same as the primary, see ClientMessage */
+    int timeout = controller_->options().rpc_timeout;
+    deadline_ = start_ + usec_to_cycles(timeout * 1000ULL);
+    uint64_t inherited = current_deadline();
+    if (inherited && inherited < deadline_) {
+        deadline_ = inherited;
+    }
+    trace_ = current_trace();
+
+    if (event_assign(&timer_, channel_->base(), -1, 0, HandleTimer, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+
+    uint64_t usec = cycles_to_usec(hedge_->delay);
+    struct timeval tv = { (time_t)(usec / 1000000), (suseconds_t)(usec % 1000000) };
+    evtimer_add(&timer_, &tv);
+    armed_ = true;
+
+    /* it may be done at once, e.g. beyond the limits */
+    channel_->replica(primary_)->CallMethod(method_, controller_,
+            request_, response_,
+            NewCallback(this, &HedgedCall::OnPrimaryDone));
+}
+
+void HedgedCall::HandleTimer(int fd, short flags, void *arg)
+{
+    HedgedCall *me = (HedgedCall *)arg;
+
+    me->armed_ = false;
+    me->OnTimer();
+}
+
+void HedgedCall::OnTimer()
+{
+    if (!channel_->TakeHedge()) {
+        return;
+    }
+
+    backup_controller_ = new ClientController(controller_->options());
+    if (!backup_controller_) {
+        LOG(FATAL) << "alloc controller failed!!!";
+    }
+
+    backup_response_ = response_->New();
+    if (!backup_response_) {
+        LOG(FATAL) << "alloc message failed!!!";
+    }
+
+    backup_sent_ = true;
+
+    size_t backup = (primary_ + 1) % channel_->num_replicas();
+
+    TraceScope trace(trace_);
+    DeadlineScope deadline(deadline_);
+
+    channel_->replica(backup)->CallMethod(method_, backup_controller_,
+            request_, backup_response_,
+            NewCallback(this, &HedgedCall::OnBackupDone));
+}
+
+void HedgedCall::OnPrimaryDone()
+{
+    primary_done_ = true;
+
+    if (armed_) {
+        evtimer_del(&timer_);
+        armed_ = false;
+    }
+
+    /* canceled for the backup */
+    if (backup_won_) {
+        TakeBackup();
+        controller_->SetResponseCode(kOk);
+        controller_->SetResponseError("");
+        return Complete();
+    }
+
+    if (backup_sent_ && !backup_done_) {
+        uint32_t code = controller_->code();
+        if (code != kOk && code != kErrCancel) {
+            cancel_ = NewCallback(this, &HedgedCall::OnCancel);
+            controller_->SetCancelHook(cancel_);
+            return;
+        }
+
+        /* the backup lost, or the user canceled the call */
+        canceling_ = true;
+        backup_controller_->StartCancel();
+    }
+
+    Complete();
+}
+
+void HedgedCall::OnBackupDone()
+{
+    backup_done_ = true;
+
+    if (canceling_) {
+        return;
+    }
+
+    bool ok = backup_controller_->code() == kOk;
+
+    /* the primary failed and waited for it */
+    if (primary_done_) {
+        if (ok) {
+            TakeBackup();
+            controller_->SetResponseCode(kOk);
+            controller_->SetResponseError("");
+        }
+        return Complete();
+    }
+
+    if (!ok) {
+        return;
+    }
+
+    /* taken by OnPrimaryDone() */
+    backup_won_ = true;
+    controller_->StartCancel();
+}
+
+/* the user canceled the call while the primary waits for the backup */
+void HedgedCall::OnCancel()
+{
+    /* run and freed by the controller */
+    cancel_ = NULL;
+
+    canceling_ = true;
+    backup_controller_->StartCancel();
+
+    controller_->SetResponseCode(kErrCancel);
+    controller_->SetResponseError("");
+
+    Complete();
+}
+
+void HedgedCall::TakeBackup()
+{
+    response_->GetReflection()->Swap(response_, backup_response_);
+
+    string local = backup_controller_->LocalAddress();
+    string remote = backup_controller_->RemoteAddress();
+    controller_->SetLocalAddress(local);
+    controller_->SetRemoteAddress(remote);
+
+    CallTiming timing;
+    if (backup_controller_->GetTiming(&timing)) {
+        controller_->SetTiming(timing);
+    }
+}
+
+void HedgedCall::Complete()
+{
+    if (cancel_) {
+        controller_->SetCancelHook(NULL);
+        delete cancel_;
+        cancel_ = NULL;
+    }
+
+    if (controller_->code() == kOk) {
+        channel_->Sample(hedge_, rdtsc() - start_);
+    }
+
+    done_->Run();
+
+    delete this;
+}
+
+} // anonymous namespace
+
+ReplicaChannel::ReplicaChannel(const ChannelOptions &options,
+                               const vector<pair<string, int> > &endpoints,
+                               event_base *base)
+    : base_(base)
+    , tid_(pthread_self())
+    , options_(options)
+    , next_(0)
+    , hedge_budget_(options.hedge_budget_percent, 0)
+    , retrier_(options.retry_budget_percent, base,
+               tr1::bind(&ReplicaChannel::Dispatch, this,
+                         tr1::placeholders::_1, tr1::placeholders::_2,
+                         tr1::placeholders::_3, tr1::placeholders::_4,
+                         tr1::placeholders::_5))
+{
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        ChannelImpl *replica = new ChannelImpl(options,
+                endpoints[i].first, endpoints[i].second, base);
+        if (!replica) {
+            LOG(FATAL) << "alloc channel object failed!!!";
+        }
+        replicas_.push_back(replica);
+    }
+}
+
+ReplicaChannel::~ReplicaChannel()
+{
+    /* the pending calls are canceled */
+    retrier_.CancelAll();
+
+    for (size_t i = 0; i < replicas_.size(); i++) {
+        delete replicas_[i];
+    }
+    replicas_.clear();
+
+    for (HedgeMap::iterator it = hedges_.begin(); it != hedges_.end(); ++it) {
+        delete it->second;
+    }
+    hedges_.clear();
+}
+
+int ReplicaChannel::Open()
+{
+    for (size_t i = 0; i < replicas_.size(); i++) {
+        int rc = replicas_[i]->Open();
+        if (rc) {
+            return rc;
+        }
+    }
+
+    return kOk;
+}
+
+int ReplicaChannel::Close()
+{
+    int ret = kOk;
+
+    retrier_.CancelAll();
+
+    for (size_t i = 0; i < replicas_.size(); i++) {
+        int rc = replicas_[i]->Close();
+        if (rc) {
+            ret = rc;
+        }
+    }
+
+    return ret;
+}
+
+int ReplicaChannel::Cancel()
+{
+    int ret = kOk;
+
+    retrier_.CancelAll();
+
+    for (size_t i = 0; i < replicas_.size(); i++) {
+        int rc = replicas_[i]->Cancel();
+        if (rc) {
+            ret = rc;
+        }
+    }
+
+    return ret;
+}
+
+int ReplicaChannel::SetHedgingPolicy(const string &method,
+                                     const HedgingPolicy &policy)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    const MethodDescriptor *desc =
+        DescriptorPool::generated_pool()->FindMethodByName(method);
+    if (!desc) {
+        LOG(ERROR) << "method not found: " << method;
+        return kErrParam;
+    }
+
+    if (policy.delay_percentile < 0 || policy.delay_percentile > 99 ||
+        policy.delay_usec <= 0) {
+        LOG(ERROR) << "invalid hedging policy: " << method;
+        return kErrParam;
+    }
+
+    Hedge *hedge = FindHedge(desc);
+    if (!hedge) {
+        hedge = new Hedge();
+        if (!hedge) {
+            LOG(ERROR) << "alloc hedge failed!!!";
+            return kErrMem;
+        }
+        hedges_.insert(make_pair(desc, hedge));
+    }
+
+    hedge->policy = policy;
+    hedge->latency.Clear();
+    hedge->delay = usec_to_cycles(policy.delay_usec);
+
+    return kOk;
+}
+
+int ReplicaChannel::SetRetryPolicy(const string &method,
+                                   const RetryPolicy &policy)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    return retrier_.SetPolicy(method, policy);
+}
+
+ReplicaChannel::Hedge*
+ReplicaChannel::FindHedge(const MethodDescriptor *method) const
+{
+    if (likely(hedges_.empty())) {
+        return NULL;
+    }
+
+    HedgeMap::const_iterator it = hedges_.find(method);
+    if (it == hedges_.end()) {
+        return NULL;
+    }
+
+    return it->second;
+}
+
+void ReplicaChannel::CallMethod(const MethodDescriptor *method,
+                                RpcController *controller,
+                                const google::protobuf::Message *request,
+                                google::protobuf::Message *response,
+                                google::protobuf::Closure *done)
+{
+    if (unlikely(retrier_.CallMethod(method, controller,
+                                     request, response, done))) {
+        return;
+    }
+
+    Dispatch(method, (ClientController *)controller, request, response, done);
+}
+
+/* the retries go to the next replica round robin */
+void ReplicaChannel::Dispatch(const MethodDescriptor *method,
+                              ClientController *controller,
+                              const google::protobuf::Message *request,
+                              google::protobuf::Message *response,
+                              google::protobuf::Closure *done)
+{
+    ChannelImpl *replica = replicas_[next_];
+
+    size_t primary = next_;
+    next_ = (next_ + 1) % replicas_.size();
+
+    /* the backup goes to another replica */
+    Hedge *hedge = FindHedge(method);
+    if (!hedge || replicas_.size() < 2) {
+        return replica->CallMethod(method, controller, request, response, done);
+    }
+
+    hedge_budget_.Deposit();
+
+    HedgedCall *call = new HedgedCall(this, hedge, primary, method,
+            controller, request, response, done);
+    if (!call) {
+        LOG(FATAL) << "alloc hedged call failed!!!";
+    }
+
+    call->Start();
+}
+
+/* the delay follows the percentile of the last window */
+void ReplicaChannel::Sample(Hedge *hedge, uint64_t cycles)
+{
+    if (!hedge->policy.delay_percentile) {
+        return;
+    }
+
+    hedge->latency.Add(cycles);
+    if (hedge->latency.count() < kHedgeWindowSamples) {
+        return;
+    }
+
+    hedge->delay = hedge->latency.Percentile(hedge->policy.delay_percentile / 100.0);
+    hedge->latency.Clear();
+}
+
+} // namespace qrpc
@@ -0,0 +1,96 @@
+#ifndef QRPC_RPC_REPLICA_CHANNEL_H
+#define QRPC_RPC_REPLICA_CHANNEL_H
+
+#include <stdint.h>
+#include <event.h>
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include <string>
+
+#include <google/protobuf/service.h>
+#include <google/protobuf/descriptor.h>
+
+#include "src/qrpc/rpc/stats.h"
+#include "src/qrpc/rpc/retry.h"
+
+namespace qrpc {
+
+class Channel;
+class ChannelImpl;
+class ClientController;
+
+/*
+ * The channel over the replicas of a service, one ChannelImpl each.
+ * The calls and their retries go to the replicas round robin, and the
+ * calls of hedged methods send a backup to the next replica after the
+ * delay, if the budget allows. Used by the thread of the event base only.
+ */
+class ReplicaChannel : public Channel {
+public:
+    explicit ReplicaChannel(const ChannelOptions &options,
+                            const std::vector<std::pair<std::string, int> > &endpoints,
+                            event_base *base);
+    virtual ~ReplicaChannel();
+
+    virtual int Open();
+    virtual int Close();
+    virtual int Cancel();
+    virtual int SetHedgingPolicy(const std::string &method,
+                                 const HedgingPolicy &policy);
+    virtual int SetRetryPolicy(const std::string &method,
+                               const RetryPolicy &policy);
+
+    virtual void CallMethod(const google::protobuf::MethodDescriptor *method,
+                            google::protobuf::RpcController *controller,
+                            const google::protobuf::Message *request,
+                            google::protobuf::Message *response,
+                            google::protobuf::Closure *done);
+
+public:
+    /* the policy and the recent latency of a hedged method */
+    struct Hedge {
+        HedgingPolicy policy;
+        Histogram latency;
+        uint64_t delay;         /* cycles */
+    };
+
+    /* for HedgedCall */
+    ChannelImpl* replica(size_t index) const { return replicas_[index]; }
+    size_t num_replicas() const { return replicas_.size(); }
+    event_base* base() const { return base_; }
+
+    bool TakeHedge() { return hedge_budget_.Withdraw(); }
+    void Sample(Hedge *hedge, uint64_t cycles);
+
+private:
+    typedef std::map<const google::protobuf::MethodDescriptor *, Hedge *> HedgeMap;
+
+    Hedge* FindHedge(const google::protobuf::MethodDescriptor *method) const;
+
+    /* an attempt of the call, hedged or not */
+    void Dispatch(const google::protobuf::MethodDescriptor *method,
+                  ClientController *controller,
+                  const google::protobuf::Message *request,
+                  google::protobuf::Message *response,
+                  google::protobuf::Closure *done);
+
+private:
+    event_base *base_;
+    pthread_t tid_;
+    ChannelOptions options_;
+
+    std::vector<ChannelImpl *> replicas_;
+    size_t next_;
+
+    HedgeMap hedges_;
+
+    /* earned by the calls of hedged methods, spent by the backups */
+    RequestBudget hedge_budget_;
+
+    Retrier retrier_;
+};
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_REPLICA_CHANNEL_H */
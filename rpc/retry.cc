@@ -0,0 +1,329 @@
+#include <sys/time.h>
+#include <assert.h>
+#include <event.h>
+#include <set>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <google/protobuf/message.h>
+#include <google/protobuf/service.h>
+#include <google/protobuf/descriptor.h>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/util/compiler.h"
+#include "src/qrpc/rpc/errno.h"
+#include "src/qrpc/rpc/closure.h"
+#include "src/qrpc/rpc/controller.h"
+#include "src/qrpc/rpc/controller_client.h"
+#include "src/qrpc/rpc/controller_server.h"
+#include "src/qrpc/rpc/message.h"
+#include "src/qrpc/rpc/trace.h"
+#include "src/qrpc/rpc/channel.h"
+#include "src/qrpc/rpc/retry.h"
+
+using namespace std;
+using namespace google::protobuf;
+
+namespace qrpc {
+
+/*
+ * A call of retried method, the attempts go with the user's controller
+ * and response, which are reset before the next one. The user sees the
+ * result of the last attempt. The user's cancel between the attempts
+ * goes to Cancel(), by the cancel hook of the controller.
+ */
+class RetryCall {
+public:
+    RetryCall(Retrier *retrier,
+              const RetryPolicy *policy,
+              const MethodDescriptor *method,
+              ClientController *controller,
+              const google::protobuf::Message *request,
+              google::protobuf::Message *response,
+              google::protobuf::Closure *done);
+    ~RetryCall();
+
+    void Start();
+
+    /* fail it with kErrCancel if it's waiting for the backoff */
+    void Cancel();
+
+private:
+    static void HandleTimer(int fd, short flags, void *arg);
+
+    void Attempt();
+    void OnDone();
+    void OnCancel();
+    void Disarm();
+    bool Retriable(uint32_t code) const;
+    uint64_t Backoff() const;
+    void Complete();
+
+private:
+    Retrier *retrier_;
+    const RetryPolicy *policy_;
+
+    const MethodDescriptor *method_;
+    ClientController *controller_;
+    const google::protobuf::Message *request_;
+    google::protobuf::Message *response_;
+    google::protobuf::Closure *done_;
+
+    /* the retries are issued in the context of the call */
+    uint64_t deadline_;
+    TraceContext trace_;
+
+    int attempts_;
+    bool armed_;
+    event timer_;
+
+    /* set while it's waiting for the backoff */
+    google::protobuf::Closure *cancel_;
+};
+
+RetryCall::RetryCall(Retrier *retrier,
+                     const RetryPolicy *policy,
+                     const MethodDescriptor *method,
+                     ClientController *controller,
+                     const google::protobuf::Message *request,
+                     google::protobuf::Message *response,
+                     google::protobuf::Closure *done)
+    : retrier_(retrier)
+    , policy_(policy)
+    , method_(method)
+    , controller_(controller)
+    , request_(request)
+    , response_(response)
+    , done_(done)
+    , deadline_(0)
+    , attempts_(0)
+    , armed_(false)
+    , cancel_(NULL)
+{
+
+}
+
+RetryCall::~RetryCall()
+{
+    assert(armed_ == false);
+}
+
+void RetryCall::Start()
+{
+    /* the attempts share it, see ClientMessage */
+    int timeout = controller_->options().rpc_timeout;
+    deadline_ = rdtsc() + usec_to_cycles(timeout * 1000ULL);
+    uint64_t inherited = current_deadline();
+    if (inherited && inherited < deadline_) {
+        deadline_ = inherited;
+    }
+    trace_ = current_trace();
+
+    if (event_assign(&timer_, retrier_->base(), -1, 0, HandleTimer, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+
+    Attempt();
+}
+
+void RetryCall::Cancel()
+{
+    if (!armed_) {
+        return;
+    }
+
+    evtimer_del(&timer_);
+    Disarm();
+
+    controller_->SetResponseCode(kErrCancel);
+    controller_->SetResponseError("");
+
+    Complete();
+}
+
+void RetryCall::HandleTimer(int fd, short flags, void *arg)
+{
+    RetryCall *me = (RetryCall *)arg;
+
+    me->Disarm();
+
+    /* the result of the previous attempt is dropped */
+    me->controller_->Reset();
+    me->response_->Clear();
+
+    me->Attempt();
+}
+
+void RetryCall::Attempt()
+{
+    attempts_++;
+
+    TraceScope trace(trace_);
+    DeadlineScope deadline(deadline_);
+
+    /* it may be done at once, e.g. beyond the limits */
+    retrier_->call()(method_, controller_, request_, response_,
+                     NewCallback(this, &RetryCall::OnDone));
+}
+
+void RetryCall::OnDone()
+{
+    uint32_t code = controller_->code();
+    if (code == kOk || !Retriable(code) ||
+        attempts_ >= policy_->max_attempts) {
+        return Complete();
+    }
+
+    /* the caller has given up before the retry */
+    uint64_t backoff = Backoff();
+    if (rdtsc() + usec_to_cycles(backoff) >= deadline_) {
+        return Complete();
+    }
+
+    if (!retrier_->budget()->Withdraw()) {
+        return Complete();
+    }
+
+    struct timeval tv = { (time_t)(backoff / 1000000), (suseconds_t)(backoff % 1000000) };
+    evtimer_add(&timer_, &tv);
+    armed_ = true;
+
+    cancel_ = NewCallback(this, &RetryCall::OnCancel);
+    controller_->SetCancelHook(cancel_);
+}
+
+void RetryCall::OnCancel()
+{
+    /* run and freed by the controller */
+    cancel_ = NULL;
+
+    Cancel();
+}
+
+void RetryCall::Disarm()
+{
+    armed_ = false;
+
+    if (cancel_) {
+        controller_->SetCancelHook(NULL);
+        delete cancel_;
+        cancel_ = NULL;
+    }
+}
+
+bool RetryCall::Retriable(uint32_t code) const
+{
+    if (code == kErrCancel) {
+        return false;
+    }
+
+    const vector<int> &codes = policy_->codes;
+    return find(codes.begin(), codes.end(), (int)code) != codes.end();
+}
+
+/* full jitter, in [0, the exponential backoff] */
+uint64_t RetryCall::Backoff() const
+{
+    uint64_t max = policy_->max_backoff_usec;
+    uint64_t cap = policy_->initial_backoff_usec;
+
+    for (int i = 1; i < attempts_ && cap < max; i++) {
+        cap *= 2;
+    }
+    if (cap > max) {
+        cap = max;
+    }
+
+    return retrier_->Random() % (cap + 1);
+}
+
+void RetryCall::Complete()
+{
+    retrier_->Remove(this);
+
+    done_->Run();
+
+    delete this;
+}
+
+// -------------------------------------------------------------
+// class Retrier
+// -------------------------------------------------------------
+
+Retrier::Retrier(int budget_percent, event_base *base, const Call &call)
+    : base_(base)
+    , call_(call)
+    , budget_(budget_percent, kBudgetMaxTokens)
+    , seed_((rdtsc() ^ (uint64_t)(uintptr_t)this) | 1)
+{
+
+}
+
+Retrier::~Retrier()
+{
+    assert(calls_.empty());
+}
+
+int Retrier::SetPolicy(const string &method, const RetryPolicy &policy)
+{
+    const MethodDescriptor *desc =
+        DescriptorPool::generated_pool()->FindMethodByName(method);
+    if (!desc) {
+        LOG(ERROR) << "method not found: " << method;
+        return kErrParam;
+    }
+
+    if (policy.max_attempts <= 0 || policy.initial_backoff_usec < 0 ||
+        policy.max_backoff_usec < policy.initial_backoff_usec) {
+        LOG(ERROR) << "invalid retry policy: " << method;
+        return kErrParam;
+    }
+
+    policies_[desc] = policy;
+
+    return kOk;
+}
+
+bool Retrier::CallMethod(const MethodDescriptor *method,
+                         RpcController *controller,
+                         const google::protobuf::Message *request,
+                         google::protobuf::Message *response,
+                         google::protobuf::Closure *done)
+{
+    if (likely(policies_.empty())) {
+        return false;
+    }
+
+    PolicyMap::const_iterator it = policies_.find(method);
+    if (it == policies_.end()) {
+        return false;
+    }
+
+    budget_.Deposit();
+
+    RetryCall *call = new RetryCall(this, &it->second, method,
+            (ClientController *)controller, request, response, done);
+    if (!call) {
+        LOG(FATAL) << "alloc retry call failed!!!";
+    }
+
+    calls_.insert(call);
+    call->Start();
+
+    return true;
+}
+
+void Retrier::CancelAll()
+{
+    /* the calls are removed once they're done */
+    vector<RetryCall *> calls(calls_.begin(), calls_.end());
+
+    for (size_t i = 0; i < calls.size(); i++) {
+        calls[i]->Cancel();
+    }
+}
+
+} // namespace qrpc
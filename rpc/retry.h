@@ -0,0 +1,119 @@
+#ifndef QRPC_RPC_RETRY_H
+#define QRPC_RPC_RETRY_H
+
+#include <stdint.h>
+#include <event.h>
+#include <set>
+#include <map>
+#include <string>
+#include <tr1/functional>
+
+#include <google/protobuf/service.h>
+#include <google/protobuf/descriptor.h>
+
+#include "src/qrpc/rpc/channel.h"
+
+namespace qrpc {
+
+class ClientController;
+
+/* the extra requests saved up while the calls are idle */
+static const double kBudgetMaxTokens = 10;
+
+/*
+ * The extra requests of a channel, e.g. the retries and the hedges.
+ * Each call earns 'percent' of a token and each extra request spends
+ * one, so they stay within the percentage of the calls even if all of
+ * the calls fail, after a burst of kBudgetMaxTokens.
+ */
+class RequestBudget {
+public:
+    RequestBudget(int percent, double tokens)
+        : ratio_(percent / 100.0), tokens_(tokens) { }
+
+    void Deposit() {
+        tokens_ += ratio_;
+        if (tokens_ > kBudgetMaxTokens) { tokens_ = kBudgetMaxTokens; }
+    }
+
+    /* false if it's run out */
+    bool Withdraw() {
+        if (tokens_ < 1) { return false; }
+        tokens_ -= 1;
+        return true;
+    }
+
+private:
+    double ratio_;
+    double tokens_;
+};
+
+class RetryCall;
+
+/*
+ * The retry policies and the budget of a channel. The attempts are
+ * made by 'call', which sends the request without retrying, and the
+ * retries are always issued by the timer, not in the done closure.
+ * Used by the thread of the event base only.
+ */
+class Retrier {
+public:
+    typedef std::tr1::function<void(const google::protobuf::MethodDescriptor *,
+                                    ClientController *,
+                                    const google::protobuf::Message *,
+                                    google::protobuf::Message *,
+                                    google::protobuf::Closure *)> Call;
+
+    Retrier(int budget_percent, event_base *base, const Call &call);
+    ~Retrier();
+
+    int SetPolicy(const std::string &method, const RetryPolicy &policy);
+
+    /* false if the method isn't retried, the caller sends it then */
+    bool CallMethod(const google::protobuf::MethodDescriptor *method,
+                    google::protobuf::RpcController *controller,
+                    const google::protobuf::Message *request,
+                    google::protobuf::Message *response,
+                    google::protobuf::Closure *done);
+
+    /* fail the calls waiting for the backoff with kErrCancel */
+    void CancelAll();
+
+    /* for RetryCall */
+    event_base* base() const { return base_; }
+    const Call& call() const { return call_; }
+    RequestBudget* budget() { return &budget_; }
+    void Remove(RetryCall *call) { calls_.erase(call); }
+
+    /* xorshift64, random() of util isn't thread safe */
+    uint64_t Random() {
+        seed_ ^= seed_ << 13;
+        seed_ ^= seed_ >> 7;
+        seed_ ^= seed_ << 17;
+        return seed_;
+    }
+
+private:
+    typedef std::map<const google::protobuf::MethodDescriptor *, RetryPolicy> PolicyMap;
+
+    event_base *base_;
+    Call call_;
+
+    PolicyMap policies_;
+    RequestBudget budget_;
+
+    /* the calls in progress */
+    std::set<RetryCall *> calls_;
+
+    /* the backoffs of the channels in other threads don't share it */
+    uint64_t seed_;
+
+private:
+    /* No copying allowed */
+    Retrier(const Retrier &);
+    void operator=(const Retrier &);
+};
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_RETRY_H */
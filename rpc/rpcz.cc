@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/rpc/rpcz.h"
+
+using namespace std;
+
+namespace qrpc {
+
+RpczRing::RpczRing(int sample_rate, int capacity)
+    : sequence_(0)
+    , sample_rate_(sample_rate)
+    , next_(0)
+{
+    assert(sample_rate > 0);
+    assert(capacity > 0);
+
+    ring_.reserve(capacity);
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+RpczRing::~RpczRing()
+{
+    pthread_mutex_destroy(&mutex_);
+}
+
+void RpczRing::Add(const RpczSpan &span)
+{
+    pthread_mutex_lock(&mutex_);
+
+    if (ring_.size() < ring_.capacity()) {
+        ring_.push_back(span);
+    } else {
+        ring_[next_] = span;
+    }
+    next_ = (next_ + 1) % ring_.capacity();
+
+    pthread_mutex_unlock(&mutex_);
+}
+
+void RpczRing::Dump(vector<RpczSpan> *spans) const
+{
+    pthread_mutex_lock(&mutex_);
+
+    size_t num = ring_.size();
+    for (size_t i = 1; i <= num; i++) {
+        spans->push_back(ring_[(next_ + num - i) % num]);
+    }
+
+    pthread_mutex_unlock(&mutex_);
+}
+
+} // namespace qrpc
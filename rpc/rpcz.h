@@ -0,0 +1,75 @@
+#ifndef QRPC_RPC_RPCZ_H
+#define QRPC_RPC_RPCZ_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "src/qrpc/util/cycles.h"
+
+namespace qrpc {
+
+/* the stages of a sampled request, in order */
+enum RpczStage {
+    kRpczRecv       = 0,    /* the frame is received completely */
+    kRpczParse      = 1,    /* the request is parsed            */
+    kRpczHandler    = 2,    /* the handler is called            */
+    kRpczDone       = 3,    /* the done closure is run          */
+    kRpczEncode     = 4,    /* the response is encoded          */
+    kRpczSent       = 5,    /* the last byte is sent            */
+    kRpczStages     = 6,
+};
+
+struct RpczSpan {
+    std::string method;
+    std::string remote;
+    uint32_t request_size;
+    uint32_t response_size;
+    uint32_t code;
+    uint64_t stamps[kRpczStages];
+
+    RpczSpan() : request_size(0), response_size(0), code(0) {
+        for (int i = 0; i < kRpczStages; i++) {
+            stamps[i] = 0;
+        }
+    }
+
+    void Stamp(RpczStage stage) { stamps[stage] = rdtsc(); }
+};
+
+/*
+ * The recent sampled requests of a worker. The owner thread decides
+ * the sampling and adds the spans, the lock is only taken for the
+ * sampled ones, against the readers of other threads.
+ */
+class RpczRing {
+public:
+    explicit RpczRing(int sample_rate, int capacity);
+    ~RpczRing();
+
+    /* one of every sample_rate requests, owner thread only */
+    bool Sample() { return (++sequence_ % sample_rate_) == 0; }
+
+    void Add(const RpczSpan &span);
+
+    /* copy the spans from the newest, called by any thread */
+    void Dump(std::vector<RpczSpan> *spans) const;
+
+private:
+    uint64_t sequence_;
+    uint64_t sample_rate_;
+
+    size_t next_;
+    std::vector<RpczSpan> ring_;
+    mutable pthread_mutex_t mutex_;
+
+private:
+    /* No copying allowed */
+    RpczRing(const RpczRing &);
+    void operator=(const RpczRing &);
+};
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_RPCZ_H */
@@ -23,6 +23,13 @@ do {                                    \
     LOG(ERROR) << "invalid: " << #param;\
     return false;                       \
 } while (0)
+#define NEGATIVE_RET(param)             \
+do {                                    \
+    if ((param) >= 0)                   \
+        break;                          \
+    LOG(ERROR) << "invalid: " << #param;\
+    return false;                       \
+} while (0)
 #define NULL_RET(param)                 \
 do {                                    \
     if (!param.empty())                 \
@@ -45,10 +52,21 @@ inline bool options_ok(const ServerOptions &opt)
     ZERO_RET(opt.keep_alive_time);
     ZERO_RET(opt.num_worker_thread);
 
+    NEGATIVE_RET(opt.rpcz_sample_rate);
+    ZERO_RET(opt.rpcz_capacity);
+    NEGATIVE_RET(opt.slow_callback_usec);
+    NEGATIVE_RET(opt.max_concurrency);
+    NEGATIVE_RET(opt.queue_delay_target_usec);
+    ZERO_RET(opt.queue_delay_interval_usec);
+    NEGATIVE_RET(opt.flow_credit_requests);
+    NEGATIVE_RET(opt.flow_credit_bytes);
+    NEGATIVE_RET(opt.recv_budget);
+
     return true;
 }
 
 #undef ZERO_RET
+#undef NEGATIVE_RET
 #undef NULL_RET
 
 void InitWorker(Thread *thr)
@@ -74,6 +92,19 @@ ServerOptions::ServerOptions()
     , max_sbuf_size(1024 * 1024)
     , keep_alive_time(3600)
     , num_worker_thread(8)
+    , http_service(false)
+    , rpcz_sample_rate(0)
+    , rpcz_capacity(1024)
+    , slow_callback_usec(100000)
+    , max_concurrency(0)
+    , auto_concurrency(false)
+    , queue_delay_target_usec(0)
+    , queue_delay_interval_usec(100000)
+    , priority_queue(false)
+    , flow_credit_requests(0)
+    , flow_credit_bytes(0)
+    , recv_budget(0)
+    , fair_queue(false)
     , init_cb(tr1::bind(InitWorker, tr1::placeholders::_1))
     , exit_cb(tr1::bind(ExitWorker, tr1::placeholders::_1))
 {
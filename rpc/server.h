@@ -8,6 +8,7 @@
 #include <google/protobuf/service.h>
 
 #include "src/qrpc/util/thread.h"
+#include "src/qrpc/rpc/controller.h"
 
 namespace qrpc {
 
@@ -79,6 +80,127 @@ struct ServerOptions {
      */
     int num_worker_thread;
 
+    /*
+     * Serve the HTTP requests for diagnostics on the same ports,
+     * such as /metrics, /connections, /status and /flags. They're
+     * not authenticated, so enable it on trusted networks only.
+     *
+     * Default: false
+     */
+    bool http_service;
+
+    /*
+     * Sample one of every rpcz_sample_rate requests into the rpcz,
+     * the recent requests with timestamps of stages. 0 disables it.
+     *
+     * Default: 0
+     */
+    int rpcz_sample_rate;
+
+    /*
+     * The max sampled requests kept by each worker thread.
+     *
+     * Default: 1024
+     */
+    int rpcz_capacity;
+
+    /*
+     * Warn the callbacks of worker slower than it in microseconds,
+     * naming the connection and method. ZERO means never warn.
+     * The event loops are measured anyway, see /metrics.
+     *
+     * Default: 100000
+     */
+    int slow_callback_usec;
+
+    /*
+     * The max requests in process of the server, the excess ones are
+     * rejected with kErrOverload before parsing, which the client may
+     * retry later or elsewhere. ZERO means unlimited.
+     *
+     * Default: 0
+     */
+    int max_concurrency;
+
+    /*
+     * Adapt the concurrency limits of the server and each method to
+     * the latency, see ConcurrencyLimiter. The max_concurrency and the
+     * limits set by SetMaxConcurrency() become the upper bounds.
+     *
+     * Default: false
+     */
+    bool auto_concurrency;
+
+    /*
+     * Queue the parsed requests in the worker and shed them like CoDel.
+     * Once the oldest request has waited longer than the target (usec)
+     * for queue_delay_interval_usec, the queue is served LIFO and the
+     * non-critical requests older than the target are rejected with
+     * kErrOverload, see SetCriticalMethod(). ZERO disables the queue,
+     * and the requests are called once parsed.
+     *
+     * Default: 0
+     */
+    int queue_delay_target_usec;
+
+    /*
+     * The interval (usec) of the standing queue to shed.
+     *
+     * Default: 100000
+     */
+    int queue_delay_interval_usec;
+
+    /*
+     * Queue the parsed requests in the worker as queue_delay_target_usec
+     * does, and call the higher priorities first, see Priority. The
+     * builtin service is of kPriorityHigh. It's on if the queue delay
+     * is set.
+     *
+     * Default: false
+     */
+    bool priority_queue;
+
+    /*
+     * The requests a connection may have in process, granted to the
+     * client in each response. The grant shrinks once the requests
+     * held by the worker exceed it, so the clients of a busy worker
+     * slow down instead of filling the socket buffers.
+     * ZERO disables it.
+     *
+     * Default: 0
+     */
+    int flow_credit_requests;
+
+    /*
+     * The request bytes a connection may have in process, granted
+     * as flow_credit_requests, by the request bytes held by the worker.
+     * A client may always send one request.
+     * ZERO disables it.
+     *
+     * Default: 0
+     */
+    int flow_credit_bytes;
+
+    /*
+     * The requests parsed from a connection per callback, the rest are
+     * parsed after the other ready connections, so a client sending in
+     * bursts doesn't hold the worker. ZERO means unlimited.
+     *
+     * Default: 0
+     */
+    int recv_budget;
+
+    /*
+     * Queue the parsed requests in the worker as priority_queue does,
+     * and share the worker between the clients of a priority by their
+     * weights (deficit round robin), see SetClientWeight(). A client is
+     * taken by ChannelOptions::client_id, or by the connection if it's
+     * not set.
+     *
+     * Default: false
+     */
+    bool fair_queue;
+
     /*
      * The init callback function for work thread.
      *
@@ -135,6 +257,9 @@ public:
      * for IPv6, hexadecimal string format),
      * or a network hostname, whose network addresses are looked up.
      *
+     * The host in format of "unix:/path" specifies a unix domain socket,
+     * and the port is ignored. The local channels will prefer it to TCP.
+     *
      * @return
      * Return 0 if success, error code otherwise.
      */
@@ -179,6 +304,81 @@ public:
     virtual int Unregister(std::string service_full_name) = 0;
     virtual int Unregister(google::protobuf::Service *service) = 0;
 
+    /**
+     * Set the compression type of the method's response message.
+     *
+     * The method is marked by its fully-qualified name, such as
+     * "package.Service.Method", and its service must be registered.
+     *
+     * By default the response uses the compression type of request.
+     * If the client advertises the codecs it accepts, the type is
+     * replaced by the best one the client supports.
+     *
+     * @return
+     * Return 0 if success, error code otherwise.
+     */
+    virtual int SetResponseCompression(const std::string &method_full_name,
+                                       CompressionType type) = 0;
+
+    /**
+     * Set the max requests in process of the method, in addition to
+     * ServerOptions::max_concurrency of the server.
+     *
+     * The method is marked by its fully-qualified name, and its
+     * service must be registered. With auto_concurrency the limit is
+     * adaptive up to max_concurrency.
+     *
+     * @return
+     * Return 0 if success, error code otherwise.
+     */
+    virtual int SetMaxConcurrency(const std::string &method_full_name,
+                                  int max_concurrency) = 0;
+
+    /**
+     * Mark the method critical, which isn't shed by the queue delay,
+     * see ServerOptions::queue_delay_target_usec. The builtin service
+     * is always critical.
+     *
+     * @return
+     * Return 0 if success, error code otherwise.
+     */
+    virtual int SetCriticalMethod(const std::string &method_full_name) = 0;
+
+    /**
+     * Set the weight of the client in the fair queue, the clients not
+     * set are of weight 1, see ServerOptions::fair_queue. The client
+     * is marked by its ChannelOptions::client_id.
+     *
+     * @return
+     * Return 0 if success, error code otherwise.
+     */
+    virtual int SetClientWeight(const std::string &client_id, int weight) = 0;
+
+    /**
+     * Limit the requests per second of a method or a whole service,
+     * by its fully-qualified name, with a token bucket of 'burst'
+     * tokens ('rate' if ZERO). The excess ones are rejected with
+     * kErrRateLimit before parsing. The service must be registered.
+     *
+     * @return
+     * Return 0 if success, error code otherwise.
+     */
+    virtual int SetRateLimit(const std::string &full_name,
+                             int rate, int burst) = 0;
+
+    /**
+     * Limit the requests per second of the client as SetRateLimit(),
+     * the client is marked by its ChannelOptions::client_id. The
+     * token of the client is given back if the method, the service
+     * or the concurrency limit rejects the request, so it's charged
+     * for the accepted ones only.
+     *
+     * @return
+     * Return 0 if success, error code otherwise.
+     */
+    virtual int SetClientRateLimit(const std::string &client_id,
+                                   int rate, int burst) = 0;
+
 private:
     /* No copying allowed */
     Server(const Server &);
@@ -21,6 +21,7 @@
 #include "src/qrpc/util/random.h"
 #include "src/qrpc/util/completion.h"
 #include "src/qrpc/util/socket.h"
+#include "src/qrpc/util/probe.h"
 #include "src/qrpc/rpc/errno.h"
 #include "src/qrpc/rpc/worker.h"
 #include "src/qrpc/rpc/command.h"
@@ -41,10 +42,22 @@ ServerImpl::ServerImpl(const ServerOptions &options, event_base *base)
     , has_base_(base != NULL)
     , base_(base)
     , nxt_worker_(-1)
+    , builtin_service_(this)
+    , http_service_(this)
     , tid_(pthread_self())
+    , limiter_(NULL)
 {
    //pthread_rwlock_init(&service_lock_, NULL); 
 
+    if (options_.max_concurrency || options_.auto_concurrency) {
+        int max = options_.max_concurrency;
+        limiter_ = new ConcurrencyLimiter(max ? max : kLimitMax,
+                                          options_.auto_concurrency);
+        if (!limiter_) {
+            LOG(FATAL) << "alloc concurrency limiter failed";
+        }
+    }
+
     Register(&builtin_service_, kServerDoesntOwnService);
 }
 
@@ -57,6 +70,13 @@ ServerImpl::~ServerImpl()
     assert(listens_.empty() == true);
     assert(workers_.empty() == true);
     assert(services_.empty() == true);
+
+    delete limiter_;
+
+    for (ClientRateMap::iterator it = client_rates_.begin();
+         it != client_rates_.end(); ++it) {
+        delete it->second;
+    }
 }
 
 bool ServerImpl::NewWorker()
@@ -64,7 +84,7 @@ bool ServerImpl::NewWorker()
     int num = options_.num_worker_thread;
 
     for (int i = 0; i < num; i++) {
-        Worker *worker = new Worker(this);
+        Worker *worker = new Worker(this, i);
         if (!worker) {
             LOG(FATAL) << "alloc worker thread failed";
         }
@@ -175,12 +195,77 @@ void ServerImpl::DelServer()
     work.Wait();
 }
 
-bool ServerImpl::Dispatch(int sfd, std::string &local, std::string &remote)
+Worker* ServerImpl::NextWorker()
 {
+    if (workers_.empty()) {
+        return NULL;
+    }
+
     int nxt = (++nxt_worker_);
     if (nxt < 0) nxt = -nxt;
-    int idx = nxt % options_.num_worker_thread;
-    Worker *worker = workers_[idx];
+    int idx = nxt % workers_.size();
+
+    return workers_[idx];
+}
+
+void ServerImpl::MergeStats(StatsMap *stats) const
+{
+    for (size_t i = 0; i < workers_.size(); i++) {
+        workers_[i]->stats()->Merge(stats);
+    }
+}
+
+namespace {
+
+bool newer_span(const RpczSpan &a, const RpczSpan &b)
+{
+    return a.stamps[kRpczRecv] > b.stamps[kRpczRecv];
+}
+
+bool newer_trace(const TraceSpan &a, const TraceSpan &b)
+{
+    return a.start_us > b.start_us;
+}
+
+} // anonymous namespace
+
+void ServerImpl::DumpRpcz(vector<RpczSpan> *spans) const
+{
+    for (size_t i = 0; i < workers_.size(); i++) {
+        RpczRing *rpcz = workers_[i]->rpcz();
+        if (rpcz) {
+            rpcz->Dump(spans);
+        }
+    }
+
+    sort(spans->begin(), spans->end(), newer_span);
+}
+
+void ServerImpl::DumpTraces(uint64_t trace_id, vector<TraceSpan> *spans) const
+{
+    for (size_t i = 0; i < workers_.size(); i++) {
+        workers_[i]->traces()->Dump(trace_id, spans);
+    }
+    process_trace_ring()->Dump(trace_id, spans);
+
+    sort(spans->begin(), spans->end(), newer_trace);
+}
+
+void ServerImpl::DumpLoops(vector<LoopStats> *loops) const
+{
+    for (size_t i = 0; i < workers_.size(); i++) {
+        loops->push_back(LoopStats());
+        workers_[i]->loop()->Snapshot(&loops->back());
+    }
+
+    dump_channel_loops(loops);
+}
+
+bool ServerImpl::Dispatch(int sfd, std::string &local, std::string &remote)
+{
+    Worker *worker = NextWorker();
+
+    QRPC_PROBE4(dispatch, sfd, worker, local.c_str(), remote.c_str());
 
     Link *link = new Link(worker, sfd, local, remote);
     if (!link) {
@@ -225,7 +310,10 @@ int ServerImpl::Add(const string &host, int port)
         return kErrParam;
     }
 
-    if (port <= 0) {
+    /* the port is ignored by unix domain socket */
+    if (is_unix_addr(host.c_str())) {
+        port = 0;
+    } else if (port <= 0) {
         LOG(ERROR) << "network port is invalid";
         return kErrParam;
     }
@@ -344,6 +432,10 @@ int ServerImpl::Register(Service *service, ServiceOwnership ownership)
 unlock:
     //pthread_rwlock_unlock(&service_lock_);
 
+    if (res) {
+        NewLimiter(desc);
+    }
+
     return (res ? kOk : kErrHasSrv);
 }
 
@@ -391,6 +483,11 @@ int ServerImpl::Unregister(string service_full_name)
         return kErrNotSrv;
     }
 
+    DelCompression(service->GetDescriptor());
+    DelLimiter(service->GetDescriptor());
+    DelCritical(service->GetDescriptor());
+    DelRateLimit(service->GetDescriptor());
+
     if (ownership == kServerOwnsService) {
         delete service;
     }
@@ -445,6 +542,11 @@ int ServerImpl::Unregister(Service *srvptr)
         return kErrNotSrv;
     }
 
+    DelCompression(desc);
+    DelLimiter(desc);
+    DelCritical(desc);
+    DelRateLimit(desc);
+
     if (ownership == kServerOwnsService) {
         delete service;
     }
@@ -452,6 +554,334 @@ int ServerImpl::Unregister(Service *srvptr)
     return 0;
 }
 
+int ServerImpl::FindMethod(const string &method_full_name,
+                           const MethodDescriptor **method) const
+{
+    size_t dotpos = method_full_name.find_last_of('.');
+    if (dotpos == string::npos) {
+        LOG(ERROR) << "invalid method full name: " << method_full_name;
+        return kErrParam;
+    }
+
+    map<string, Service *>::const_iterator it;
+    it = services_.find(method_full_name.substr(0, dotpos));
+    if (it == services_.end()) {
+        LOG(ERROR) << "not registered service: " << method_full_name;
+        return kErrNotSrv;
+    }
+
+    *method = it->second->GetDescriptor()
+        ->FindMethodByName(method_full_name.substr(dotpos + 1));
+    if (!*method) {
+        LOG(ERROR) << "not implemente RPC method: " << method_full_name;
+        return kErrParam;
+    }
+
+    return kOk;
+}
+
+int ServerImpl::SetResponseCompression(const string &method_full_name,
+                                       CompressionType type)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    if (state_ != kInit) {
+        LOG(ERROR) << "the server is in: " << state();
+        return kError;
+    }
+
+    if (type < kNoCompression || type > kSnappyCompression) {
+        LOG(ERROR) << "invalid compression type: " << type;
+        return kErrParam;
+    }
+
+    const MethodDescriptor *method = NULL;
+    int rc = FindMethod(method_full_name, &method);
+    if (rc) {
+        return rc;
+    }
+
+    compressions_[method] = type;
+
+    return kOk;
+}
+
+int ServerImpl::SetMaxConcurrency(const string &method_full_name,
+                                  int max_concurrency)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    if (state_ != kInit) {
+        LOG(ERROR) << "the server is in: " << state();
+        return kError;
+    }
+
+    if (max_concurrency <= 0) {
+        LOG(ERROR) << "invalid max concurrency: " << max_concurrency;
+        return kErrParam;
+    }
+
+    const MethodDescriptor *method = NULL;
+    int rc = FindMethod(method_full_name, &method);
+    if (rc) {
+        return rc;
+    }
+
+    ConcurrencyLimiter *limiter = new ConcurrencyLimiter(
+            max_concurrency, options_.auto_concurrency);
+    if (!limiter) {
+        LOG(FATAL) << "alloc concurrency limiter failed";
+    }
+
+    delete limiters_[method];
+    limiters_[method] = limiter;
+
+    return kOk;
+}
+
+int ServerImpl::SetCriticalMethod(const string &method_full_name)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    if (state_ != kInit) {
+        LOG(ERROR) << "the server is in: " << state();
+        return kError;
+    }
+
+    const MethodDescriptor *method = NULL;
+    int rc = FindMethod(method_full_name, &method);
+    if (rc) {
+        return rc;
+    }
+
+    criticals_.insert(method);
+
+    return kOk;
+}
+
+int ServerImpl::SetClientWeight(const string &client_id, int weight)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    if (state_ != kInit) {
+        LOG(ERROR) << "the server is in: " << state();
+        return kError;
+    }
+
+    if (client_id.empty() || weight <= 0) {
+        LOG(ERROR) << "invalid client weight: " << client_id
+                   << " " << weight;
+        return kErrParam;
+    }
+
+    weights_[client_id] = weight;
+
+    return kOk;
+}
+
+RateLimiter* ServerImpl::NewRateLimit(int rate, int burst) const
+{
+    RateLimiter *limiter = new RateLimiter(rate, burst,
+                                           options_.num_worker_thread);
+    if (!limiter) {
+        LOG(FATAL) << "alloc rate limiter failed";
+    }
+
+    return limiter;
+}
+
+int ServerImpl::SetRateLimit(const string &full_name, int rate, int burst)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    if (state_ != kInit) {
+        LOG(ERROR) << "the server is in: " << state();
+        return kError;
+    }
+
+    if (rate <= 0 || burst < 0) {
+        LOG(ERROR) << "invalid rate limit: " << rate << " " << burst;
+        return kErrParam;
+    }
+
+    /* the name of service, or its method */
+    map<string, Service *>::const_iterator it = services_.find(full_name);
+    if (it != services_.end()) {
+        const ServiceDescriptor *desc = it->second->GetDescriptor();
+        delete service_rates_[desc];
+        service_rates_[desc] = NewRateLimit(rate, burst);
+        return kOk;
+    }
+
+    const MethodDescriptor *method = NULL;
+    int rc = FindMethod(full_name, &method);
+    if (rc) {
+        return rc;
+    }
+
+    delete method_rates_[method];
+    method_rates_[method] = NewRateLimit(rate, burst);
+
+    return kOk;
+}
+
+int ServerImpl::SetClientRateLimit(const string &client_id,
+                                   int rate, int burst)
+{
+    if (pthread_self() != tid_) {
+        LOG(ERROR) << "run in the alloc thread context";
+        return kErrCtx;
+    }
+
+    if (state_ != kInit) {
+        LOG(ERROR) << "the server is in: " << state();
+        return kError;
+    }
+
+    if (client_id.empty() || rate <= 0 || burst < 0) {
+        LOG(ERROR) << "invalid client rate limit: " << client_id
+                   << " " << rate << " " << burst;
+        return kErrParam;
+    }
+
+    delete client_rates_[client_id];
+    client_rates_[client_id] = NewRateLimit(rate, burst);
+
+    return kOk;
+}
+
+int ServerImpl::ResponseCompression(const MethodDescriptor *method,
+                                    const MsgMeta &meta) const
+{
+    /* prefer lz4 and snappy for the speed */
+    static const CompressionType kPrefer[] = {
+        kLz4Compression,
+        kSnappyCompression,
+        kZlibCompression,
+    };
+
+    int type = meta.compression_type();
+
+    if (!compressions_.empty()) {
+        CompressionMap::const_iterator it = compressions_.find(method);
+        if (it != compressions_.end()) {
+            type = it->second;
+        }
+    }
+
+    /* the client doesn't advertise, it should be the same as request */
+    if (!meta.has_accept_compression()) {
+        return type;
+    }
+
+    uint32_t accept = meta.accept_compression();
+    if (type == kNoCompression || (accept & (1 << type))) {
+        return type;
+    }
+
+    for (size_t i = 0; i < sizeof(kPrefer) / sizeof(kPrefer[0]); i++) {
+        if (accept & (1 << kPrefer[i])) {
+            return kPrefer[i];
+        }
+    }
+
+    return kNoCompression;
+}
+
+void ServerImpl::DelCompression(const ServiceDescriptor *desc)
+{
+    CompressionMap::iterator it = compressions_.begin();
+
+    while (it != compressions_.end()) {
+        if (it->first->service() == desc) {
+            compressions_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/* the methods are adaptive by default, except the builtin service */
+void ServerImpl::NewLimiter(const ServiceDescriptor *desc)
+{
+    if (!options_.auto_concurrency) {
+        return;
+    }
+    if (desc == builtin_service_.GetDescriptor()) {
+        return;
+    }
+
+    for (int i = 0; i < desc->method_count(); i++) {
+        ConcurrencyLimiter *limiter = new ConcurrencyLimiter(kLimitMax, true);
+        if (!limiter) {
+            LOG(FATAL) << "alloc concurrency limiter failed";
+        }
+        limiters_[desc->method(i)] = limiter;
+    }
+}
+
+void ServerImpl::DelLimiter(const ServiceDescriptor *desc)
+{
+    LimiterMap::iterator it = limiters_.begin();
+
+    while (it != limiters_.end()) {
+        if (it->first->service() == desc) {
+            delete it->second;
+            limiters_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void ServerImpl::DelRateLimit(const ServiceDescriptor *desc)
+{
+    MethodRateMap::iterator it = method_rates_.begin();
+
+    while (it != method_rates_.end()) {
+        if (it->first->service() == desc) {
+            delete it->second;
+            method_rates_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    ServiceRateMap::iterator sit = service_rates_.find(desc);
+    if (sit != service_rates_.end()) {
+        delete sit->second;
+        service_rates_.erase(sit);
+    }
+}
+
+void ServerImpl::DelCritical(const ServiceDescriptor *desc)
+{
+    CriticalSet::iterator it = criticals_.begin();
+
+    while (it != criticals_.end()) {
+        if ((*it)->service() == desc) {
+            criticals_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
 void ServerImpl::DelService()
 {
     //pthread_rwlock_wrlock(&service_lock_);
@@ -474,6 +904,26 @@ void ServerImpl::DelService()
 
     services_.clear();
     ownership_.clear();
+    compressions_.clear();
+    criticals_.clear();
+
+    for (LimiterMap::iterator it = limiters_.begin();
+         it != limiters_.end(); ++it) {
+        delete it->second;
+    }
+    limiters_.clear();
+
+    for (MethodRateMap::iterator it = method_rates_.begin();
+         it != method_rates_.end(); ++it) {
+        delete it->second;
+    }
+    method_rates_.clear();
+
+    for (ServiceRateMap::iterator it = service_rates_.begin();
+         it != service_rates_.end(); ++it) {
+        delete it->second;
+    }
+    service_rates_.clear();
 
     //pthread_rwlock_unlock(&service_lock_);
 }
@@ -6,6 +6,7 @@
 #include <pthread.h>
 
 #include <map>
+#include <set>
 #include <string>
 
 #include "src/qrpc/util/timer.h"
@@ -13,6 +14,12 @@
 #include "src/qrpc/util/socket.h"
 #include "src/qrpc/util/compiler.h"
 #include "src/qrpc/rpc/message.pb.h"
+#include "src/qrpc/rpc/stats.h"
+#include "src/qrpc/rpc/rpcz.h"
+#include "src/qrpc/rpc/trace.h"
+#include "src/qrpc/rpc/loop_monitor.h"
+#include "src/qrpc/rpc/http_service.h"
+#include "src/qrpc/rpc/limiter.h"
 
 namespace qrpc {
 
@@ -37,6 +44,17 @@ public:
     virtual int Unregister(std::string service_full_name);
     virtual int Unregister(google::protobuf::Service *service);
 
+    virtual int SetResponseCompression(const std::string &method_full_name,
+                                       CompressionType type);
+    virtual int SetMaxConcurrency(const std::string &method_full_name,
+                                  int max_concurrency);
+    virtual int SetCriticalMethod(const std::string &method_full_name);
+    virtual int SetClientWeight(const std::string &client_id, int weight);
+    virtual int SetRateLimit(const std::string &full_name,
+                             int rate, int burst);
+    virtual int SetClientRateLimit(const std::string &client_id,
+                                   int rate, int burst);
+
 public:
     google::protobuf::Service* Find(const MsgMeta &meta) const {
         using namespace google::protobuf;
@@ -53,15 +71,118 @@ public:
         return service;
     }
 
+    int ResponseCompression(const google::protobuf::MethodDescriptor *method,
+                            const MsgMeta &meta) const;
+
+    typedef std::map<const google::protobuf::MethodDescriptor *,
+                     ConcurrencyLimiter *> LimiterMap;
+
+    /* the limiter of server, NULL if unlimited */
+    ConcurrencyLimiter* limiter() const { return limiter_; }
+
+    /* the limiter of method, NULL if unlimited */
+    ConcurrencyLimiter* MethodLimiter(
+            const google::protobuf::MethodDescriptor *method) const {
+        if (limiters_.empty()) {
+            return NULL;
+        }
+        LimiterMap::const_iterator it = limiters_.find(method);
+        return it != limiters_.end() ? it->second : NULL;
+    }
+    const LimiterMap& limiters() const { return limiters_; }
+
+    typedef std::map<const google::protobuf::MethodDescriptor *,
+                     RateLimiter *> MethodRateMap;
+    typedef std::map<const google::protobuf::ServiceDescriptor *,
+                     RateLimiter *> ServiceRateMap;
+    typedef std::map<std::string, RateLimiter *> ClientRateMap;
+
+    /* the rate limits of method, service and client, NULL if unlimited */
+    RateLimiter* MethodRate(
+            const google::protobuf::MethodDescriptor *method) const {
+        return FindRate(method_rates_, method);
+    }
+    RateLimiter* ServiceRate(
+            const google::protobuf::ServiceDescriptor *service) const {
+        return FindRate(service_rates_, service);
+    }
+    RateLimiter* ClientRate(const std::string &client_id) const {
+        return FindRate(client_rates_, client_id);
+    }
+    const MethodRateMap& method_rates() const   { return method_rates_;  }
+    const ServiceRateMap& service_rates() const { return service_rates_; }
+    const ClientRateMap& client_rates() const   { return client_rates_;  }
+
+    /* the method isn't shed by the queue delay */
+    bool IsCritical(const google::protobuf::MethodDescriptor *method) const {
+        if (method->service() == BuiltinService::descriptor()) {
+            return true;
+        }
+        return !criticals_.empty() && criticals_.count(method);
+    }
+
+    /* the weight of the client in the fair queue */
+    int ClientWeight(const std::string &client_id) const {
+        if (weights_.empty()) {
+            return 1;
+        }
+        std::map<std::string, int>::const_iterator it;
+        it = weights_.find(client_id);
+        return it != weights_.end() ? it->second : 1;
+    }
+
     const ServerOptions& options() { return options_; }
+    const std::vector<std::pair<std::string, int> >& endpoints() const {
+        return endpoints_;
+    }
     event_base* base() { return base_; }
+    HttpService* http_service() { return &http_service_; }
+
+    const std::vector<Worker *>& workers() const { return workers_; }
+    const std::map<std::string, google::protobuf::Service *>& services() const {
+        return services_;
+    }
 
     bool Dispatch(int sfd, std::string &local, std::string &remote);
 
+    /* the worker for next connection, NULL if not running */
+    Worker* NextWorker();
+
+    /* merge the server stats of workers */
+    void MergeStats(StatsMap *stats) const;
+
+    /* the sampled requests of workers, from the newest */
+    void DumpRpcz(std::vector<RpczSpan> *spans) const;
+
+    /* the trace spans (all if trace_id is 0) of process, from the newest */
+    void DumpTraces(uint64_t trace_id, std::vector<TraceSpan> *spans) const;
+
+    /* the event loops of workers and channel threads */
+    void DumpLoops(std::vector<LoopStats> *loops) const;
+
 private:
     const std::string& state() const;
 
     void DelService();
+    int FindMethod(const std::string &method_full_name,
+                   const google::protobuf::MethodDescriptor **method) const;
+
+    void DelCompression(const google::protobuf::ServiceDescriptor *desc);
+    void DelCritical(const google::protobuf::ServiceDescriptor *desc);
+    void DelRateLimit(const google::protobuf::ServiceDescriptor *desc);
+    RateLimiter* NewRateLimit(int rate, int burst) const;
+
+    template <typename Map>
+    static RateLimiter* FindRate(const Map &rates,
+                                 const typename Map::key_type &key) {
+        if (rates.empty()) {
+            return NULL;
+        }
+        typename Map::const_iterator it = rates.find(key);
+        return it != rates.end() ? it->second : NULL;
+    }
+    void NewLimiter(const google::protobuf::ServiceDescriptor *desc);
+    void DelLimiter(const google::protobuf::ServiceDescriptor *desc);
 
     bool NewWorker();
     void DelWorker();
@@ -100,10 +221,34 @@ private:
     /* shared builtin service */
     BuiltinServiceImpl builtin_service_;
 
+    /* the diagnostics over HTTP */
+    HttpService http_service_;
+
     pthread_t tid_;
     //pthread_rwlock_t service_lock_;
     std::map<std::string, ServiceOwnership> ownership_;
     std::map<std::string, google::protobuf::Service *> services_;
+
+    /* response compression of methods */
+    typedef std::map<const google::protobuf::MethodDescriptor *,
+                     CompressionType> CompressionMap;
+    CompressionMap compressions_;
+
+    /* the methods which aren't shed by the queue delay */
+    typedef std::set<const google::protobuf::MethodDescriptor *> CriticalSet;
+    CriticalSet criticals_;
+
+    /* the weights of clients in the fair queue */
+    std::map<std::string, int> weights_;
+
+    /* the token buckets of methods, services and clients */
+    MethodRateMap method_rates_;
+    ServiceRateMap service_rates_;
+    ClientRateMap client_rates_;
+
+    /* the concurrency limiters of server and methods */
+    ConcurrencyLimiter *limiter_;
+    LimiterMap limiters_;
 };
 
 } // namespace qrpc
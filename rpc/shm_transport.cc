@@ -0,0 +1,450 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/memfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/util/barrier.h"
+#include "src/qrpc/util/compiler.h"
+#include "src/qrpc/rpc/shm_transport.h"
+
+namespace qrpc {
+
+static const uint32_t kShmSegMagic = 0x7172706d; /* "qrpm" */
+static const size_t kShmMinRingSize = 4096;
+static const size_t kShmMaxRingSize = 1UL << 30;
+
+/* The indexes grow monotonically, and (head - tail) is the used bytes */
+struct ShmRing {
+    volatile uint64_t head;     /* written by the producer */
+    char pad0[56];
+    volatile uint64_t tail;     /* written by the consumer */
+    char pad1[56];
+    volatile uint32_t parked;   /* the consumer waits for data */
+    volatile uint32_t blocked;  /* the producer waits for space */
+    char pad2[56];
+} __attribute__((aligned(64)));
+
+/* ring[0] is client to server, ring[1] is server to client */
+struct ShmSegment {
+    uint32_t magic;
+    uint32_t ring_size;
+    uint32_t spin_count;
+    char pad[52];
+    ShmRing ring[2];
+} __attribute__((aligned(64)));
+
+static int new_eventfd()
+{
+    int n = 1;
+
+    int fd = syscall(SYS_eventfd, 0);
+    if (fd < 0) {
+        LOG(ERROR) << "eventfd failed: " << strerror(errno);
+        return -1;
+    }
+    if (ioctl(fd, FIONBIO, &n)) {
+        LOG(ERROR) << "ioctl failed: " << strerror(errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+ShmTransport::ShmTransport()
+    : memfd_(-1)
+    , wait_fd_(-1)
+    , notify_fd_(-1)
+    , map_size_(0)
+    , seg_(NULL)
+    , rx_(NULL)
+    , tx_(NULL)
+    , rx_data_(NULL)
+    , tx_data_(NULL)
+    , mask_(0)
+    , spin_count_(0)
+{
+
+}
+
+ShmTransport::~ShmTransport()
+{
+    if (seg_) {
+        munmap(seg_, map_size_);
+    }
+    if (memfd_ >= 0) {
+        close(memfd_);
+    }
+    if (wait_fd_ >= 0) {
+        close(wait_fd_);
+    }
+    if (notify_fd_ >= 0) {
+        close(notify_fd_);
+    }
+}
+
+bool ShmTransport::Map(int memfd, size_t size)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, memfd, 0);
+    if (addr == MAP_FAILED) {
+        LOG(ERROR) << "mmap failed: " << strerror(errno);
+        return false;
+    }
+
+    map_size_ = size;
+    seg_ = (ShmSegment *)addr;
+    return true;
+}
+
+ShmTransport* ShmTransport::Create(size_t ring_size, int spin_count)
+{
+    size_t size = kShmMinRingSize;
+    while (size < ring_size && size < kShmMaxRingSize) {
+        size <<= 1;
+    }
+
+    ShmTransport *shm = new ShmTransport();
+    if (!shm) {
+        LOG(FATAL) << "alloc shm transport failed!!!";
+    }
+
+    shm->memfd_ = syscall(SYS_memfd_create, "qrpc_shm",
+                          MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm->memfd_ < 0) {
+        LOG(ERROR) << "memfd_create failed: " << strerror(errno);
+        delete shm;
+        return NULL;
+    }
+
+    size_t total = sizeof(ShmSegment) + size * 2;
+    if (ftruncate(shm->memfd_, total)) {
+        LOG(ERROR) << "ftruncate failed: " << strerror(errno);
+        delete shm;
+        return NULL;
+    }
+
+    /* the server maps it, which mustn't be truncated under it */
+    if (fcntl(shm->memfd_, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+        LOG(ERROR) << "seal memfd failed: " << strerror(errno);
+        delete shm;
+        return NULL;
+    }
+
+    shm->wait_fd_ = new_eventfd();
+    shm->notify_fd_ = new_eventfd();
+    if (shm->wait_fd_ < 0 || shm->notify_fd_ < 0) {
+        delete shm;
+        return NULL;
+    }
+
+    if (!shm->Map(shm->memfd_, total)) {
+        delete shm;
+        return NULL;
+    }
+
+    ShmSegment *seg = shm->seg_;
+    memset(seg, 0, sizeof(ShmSegment));
+    seg->magic = kShmSegMagic;
+    seg->ring_size = size;
+    seg->spin_count = spin_count;
+
+    /* notify the first message of both sides */
+    seg->ring[0].parked = 1;
+    seg->ring[1].parked = 1;
+
+    char *data = (char *)(seg + 1);
+    shm->tx_ = &seg->ring[0];
+    shm->rx_ = &seg->ring[1];
+    shm->tx_data_ = data;
+    shm->rx_data_ = data + size;
+    shm->mask_ = size - 1;
+    shm->spin_count_ = spin_count;
+
+    return shm;
+}
+
+ShmTransport* ShmTransport::Attach(const int fds[kShmFds])
+{
+    ShmTransport *shm = new ShmTransport();
+    if (!shm) {
+        LOG(FATAL) << "alloc shm transport failed!!!";
+    }
+
+    /* the eventfds are swapped on the server side */
+    shm->memfd_ = fds[0];
+    shm->notify_fd_ = fds[1];
+    shm->wait_fd_ = fds[2];
+
+    /* the size is trusted only if the client can't shrink it */
+    int seals = fcntl(shm->memfd_, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        LOG(ERROR) << "the shm segment isn't sealed";
+        delete shm;
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(shm->memfd_, &st)) {
+        LOG(ERROR) << "fstat failed: " << strerror(errno);
+        delete shm;
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(ShmSegment) + kShmMinRingSize * 2) {
+        LOG(ERROR) << "invalid shm segment size: " << st.st_size;
+        delete shm;
+        return NULL;
+    }
+
+    if (!shm->Map(shm->memfd_, st.st_size)) {
+        delete shm;
+        return NULL;
+    }
+
+    ShmSegment *seg = shm->seg_;
+    size_t size = seg->ring_size;
+    if (seg->magic != kShmSegMagic ||
+        size < kShmMinRingSize || (size & (size - 1)) ||
+        sizeof(ShmSegment) + size * 2 != (size_t)st.st_size) {
+        LOG(ERROR) << "corrupt shm segment header";
+        delete shm;
+        return NULL;
+    }
+
+    char *data = (char *)(seg + 1);
+    shm->rx_ = &seg->ring[0];
+    shm->tx_ = &seg->ring[1];
+    shm->rx_data_ = data;
+    shm->tx_data_ = data + size;
+    shm->mask_ = size - 1;
+    shm->spin_count_ = seg->spin_count;
+
+    return shm;
+}
+
+bool ShmTransport::SendFds(int sfd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * kShmFds)];
+    } cmsg;
+
+    struct iovec iov;
+    iov.iov_base = (void *)kShmMagic;
+    iov.iov_len = kShmMagicSize;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&cmsg, 0, sizeof(cmsg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * kShmFds);
+
+    int fds[kShmFds] = { memfd_, wait_fd_, notify_fd_ };
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+again:
+    ssize_t res = sendmsg(sfd, &msg, MSG_NOSIGNAL);
+    if (res == kShmMagicSize) {
+        return true;
+    }
+    if (res < 0 && errno == EINTR) {
+        goto again;
+    }
+
+    LOG(ERROR) << "send shm handshake failed: " << strerror(errno);
+    return false;
+}
+
+int ShmTransport::RecvFds(int sfd, char *buf, int len,
+                          int fds[kShmFds], int *nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * kShmFds)];
+    } cmsg;
+
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    *nfds = 0;
+
+    int res = recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC);
+    if (res <= 0) {
+        return res;
+    }
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+         c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        int *cfds = (int *)CMSG_DATA(c);
+        int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; ++i) {
+            if (*nfds < kShmFds) {
+                fds[(*nfds)++] = cfds[i];
+            } else {
+                close(cfds[i]);
+            }
+        }
+    }
+
+    return res;
+}
+
+void __always_inline ShmTransport::Notify()
+{
+    uint64_t u = 1;
+    while (write(notify_fd_, &u, sizeof(u)) < 0 && errno == EINTR) {
+        /* the counter never overflows in practice */
+    }
+}
+
+void ShmTransport::Drain()
+{
+    uint64_t u;
+    while (read(wait_fd_, &u, sizeof(u)) < 0 && errno == EINTR) {
+        /* EAGAIN if it's been drained */
+    }
+}
+
+bool ShmTransport::Readable() const
+{
+    return rx_->head != rx_->tail;
+}
+
+bool ShmTransport::Park()
+{
+    rx_->parked = 1;
+    smp_mb();
+
+    if (rx_->head != rx_->tail) {
+        rx_->parked = 0;
+        return false;
+    }
+
+    return true;
+}
+
+int ShmTransport::Read(char *buf, int len)
+{
+    uint64_t tail = rx_->tail;
+    uint64_t head = rx_->head;
+    smp_rmb();
+
+    /* the peer writes them, don't go out of the ring */
+    size_t n = head - tail;
+    if (unlikely(n > mask_ + 1)) {
+        LOG(ERROR) << "the shm ring is broken by the peer";
+        errno = EPROTO;
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (n > (size_t)len) {
+        n = len;
+    }
+
+    size_t off = tail & mask_;
+    size_t first = mask_ + 1 - off;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(buf, rx_data_ + off, first);
+    memcpy(buf + first, rx_data_, n - first);
+
+    smp_mb();
+    rx_->tail = tail + n;
+
+    /* wake up the producer waiting for space */
+    smp_mb();
+    if (rx_->blocked) {
+        rx_->blocked = 0;
+        Notify();
+    }
+
+    return n;
+}
+
+int ShmTransport::Write(const char *buf, int len)
+{
+    uint64_t head = tx_->head;
+    uint64_t tail = tx_->tail;
+
+    /* the peer writes the tail, don't go out of the ring */
+    if (unlikely(head - tail > mask_ + 1)) {
+        LOG(ERROR) << "the shm ring is broken by the peer";
+        errno = EPROTO;
+        return -1;
+    }
+
+    size_t avail = mask_ + 1 - (head - tail);
+    if (avail == 0) {
+        tx_->blocked = 1;
+        smp_mb();
+
+        tail = tx_->tail;
+        if (unlikely(head - tail > mask_ + 1)) {
+            LOG(ERROR) << "the shm ring is broken by the peer";
+            errno = EPROTO;
+            return -1;
+        }
+
+        avail = mask_ + 1 - (head - tail);
+        if (avail == 0) {
+            return 0;
+        }
+        tx_->blocked = 0;
+    }
+
+    size_t n = (size_t)len < avail ? len : avail;
+
+    size_t off = head & mask_;
+    size_t first = mask_ + 1 - off;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(tx_data_ + off, buf, first);
+    memcpy(tx_data_, buf + first, n - first);
+
+    smp_wmb();
+    tx_->head = head + n;
+
+    /* wake up the consumer parked in the event loop */
+    smp_mb();
+    if (tx_->parked) {
+        tx_->parked = 0;
+        Notify();
+    }
+
+    return n;
+}
+
+} // namespace qrpc
@@ -0,0 +1,116 @@
+#ifndef QRPC_RPC_SHM_TRANSPORT_H
+#define QRPC_RPC_SHM_TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace qrpc {
+
+/* memfd, eventfd of client, eventfd of server */
+static const int kShmFds = 3;
+
+/* The handshake sent with the fds over the unix domain socket */
+static const char kShmMagic[] = "QRPCSHM";
+static const int kShmMagicSize = sizeof(kShmMagic);
+
+struct ShmRing;
+struct ShmSegment;
+
+/*
+ * Shared memory transport between the co-located processes.
+ *
+ * The client creates a memfd segment holding two single-producer
+ * single-consumer byte rings, one for each direction, and passes it
+ * with two eventfds to the server over the unix domain socket.
+ *
+ * The consumer marks itself parked before waiting in the event loop,
+ * and the producer writes the eventfd of the peer only if it's parked,
+ * so there's no syscall while both sides are busy.
+ */
+class ShmTransport {
+public:
+    /*
+     * Create the segment on the client side.
+     * The ring size is rounded up to the power of 2, and both sides
+     * poll the ring spin_count times before parking.
+     *
+     * Returns NULL on error.
+     */
+    static ShmTransport* Create(size_t ring_size, int spin_count);
+
+    /*
+     * Attach to the segment passed by the client.
+     * The fds are owned by the transport even on error.
+     *
+     * Returns NULL on error.
+     */
+    static ShmTransport* Attach(const int fds[kShmFds]);
+
+    /*
+     * Receive the handshake and fds from the unix domain socket.
+     * *nfds is set to the number of fds received.
+     *
+     * Returns the bytes read as recv().
+     */
+    static int RecvFds(int sfd, char *buf, int len, int fds[kShmFds], int *nfds);
+
+    ~ShmTransport();
+
+    /* Send the handshake and fds to the server */
+    bool SendFds(int sfd);
+
+    /* The eventfd to wait for */
+    int fd() const { return wait_fd_; }
+
+    /* Polling times before parking in the event loop */
+    int spin_count() const { return spin_count_; }
+
+    /*
+     * Returns the bytes copied, 0 if the ring is empty or full, -1
+     * with errno EPROTO if the peer has broken the head or the tail.
+     */
+    int Read(char *buf, int len);
+    int Write(const char *buf, int len);
+
+    /* Returns true if there's data to read */
+    bool Readable() const;
+
+    /* Consume the notifications of the eventfd */
+    void Drain();
+
+    /*
+     * Mark the consumer parked before waiting in the event loop.
+     * Returns false if the data arrived meanwhile.
+     */
+    bool Park();
+
+private:
+    ShmTransport();
+
+    bool Map(int memfd, size_t size);
+    void Notify();
+
+private:
+    int memfd_;
+    int wait_fd_;
+    int notify_fd_;
+
+    size_t map_size_;
+    ShmSegment *seg_;
+
+    ShmRing *rx_;
+    ShmRing *tx_;
+    char *rx_data_;
+    char *tx_data_;
+    uint64_t mask_;
+    int spin_count_;
+
+private:
+    /* No copying allowed */
+    ShmTransport(const ShmTransport &);
+    void operator=(const ShmTransport &);
+};
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_SHM_TRANSPORT_H */
@@ -0,0 +1,220 @@
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/rpc/stats.h"
+
+using namespace std;
+using namespace google::protobuf;
+
+namespace qrpc {
+
+// -------------------------------------------------------------
+// class Histogram
+// -------------------------------------------------------------
+
+uint64_t Histogram::Upper(int index)
+{
+    if (index < kHistSubBuckets) {
+        return index;
+    }
+
+    int shift = (index >> kHistSubBits) - 1;
+    uint64_t sub = index & (kHistSubBuckets - 1);
+
+    return ((kHistSubBuckets + sub) << shift) + (1ULL << shift) - 1;
+}
+
+void Histogram::Merge(const Histogram &other)
+{
+    count_ += other.count_;
+    sum_ += other.sum_;
+    if (other.max_ > max_) {
+        max_ = other.max_;
+    }
+
+    for (int i = 0; i < kHistBuckets; i++) {
+        buckets_[i] += other.buckets_[i];
+    }
+}
+
+uint64_t Histogram::Percentile(double p) const
+{
+    if (!count_) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p * count_ + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < kHistBuckets; i++) {
+        seen += buckets_[i];
+        if (seen >= rank) {
+            uint64_t upper = Upper(i);
+            return upper < max_ ? upper : max_;
+        }
+    }
+
+    return max_;
+}
+
+uint64_t Histogram::CountBelow(uint64_t value) const
+{
+    uint64_t seen = 0;
+
+    for (int i = 0; i < kHistBuckets && Upper(i) <= value; i++) {
+        seen += buckets_[i];
+    }
+
+    return seen;
+}
+
+// -------------------------------------------------------------
+// class MethodStats
+// -------------------------------------------------------------
+
+void MethodStats::Merge(const MethodStats &other)
+{
+    latency_.Merge(other.latency_);
+
+    for (int i = 0; i < kStatsCodes; i++) {
+        errors_[i] += other.errors_[i];
+    }
+}
+
+// -------------------------------------------------------------
+// class StatsTable
+// -------------------------------------------------------------
+
+StatsTable::StatsTable()
+{
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+StatsTable::~StatsTable()
+{
+    for (TableIte ite = table_.begin(); ite != table_.end(); ++ite) {
+        delete ite->second;
+    }
+
+    pthread_mutex_destroy(&mutex_);
+}
+
+MethodStats* StatsTable::Insert(const MethodDescriptor *method)
+{
+    MethodStats *stats = new MethodStats();
+    if (!stats) {
+        LOG(FATAL) << "alloc method stats failed!!!";
+    }
+
+    pthread_mutex_lock(&mutex_);
+    table_.insert(make_pair(method, stats));
+    pthread_mutex_unlock(&mutex_);
+
+    return stats;
+}
+
+void StatsTable::Merge(StatsMap *stats) const
+{
+    pthread_mutex_lock(&mutex_);
+
+    Table::const_iterator ite = table_.begin();
+    for (; ite != table_.end(); ++ite) {
+        (*stats)[ite->first->full_name()].Merge(*ite->second);
+    }
+
+    pthread_mutex_unlock(&mutex_);
+}
+
+// -------------------------------------------------------------
+// the client stats of channel threads
+// -------------------------------------------------------------
+
+typedef pair<uint64_t, StatsTable *> LocalStats;
+typedef map<pthread_t, LocalStats>::iterator StatsIte;
+
+/* protect the shared client stats */
+static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the shared client stats */
+static map<pthread_t, LocalStats> client_stats;
+
+/* the stats of released channel threads */
+static StatsMap retired_stats;
+
+StatsTable* new_client_stats_if_not(pthread_t tid)
+{
+    StatsTable *target = NULL;
+
+    pthread_mutex_lock(&client_mutex);
+
+    StatsIte ite = client_stats.find(tid);
+
+    if (ite != client_stats.end()) {
+        ite->second.first++;
+        target = ite->second.second;
+    } else {
+        StatsTable *new_stats = new StatsTable();
+        if (!new_stats) {
+            LOG(FATAL) << "out of memory";
+        }
+
+        target = new_stats;
+        client_stats.insert(make_pair(tid, make_pair(1, new_stats)));
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+
+    return target;
+}
+
+void del_client_stats_if_zero(StatsTable *source, pthread_t tid)
+{
+    StatsTable *target = NULL;
+
+    pthread_mutex_lock(&client_mutex);
+
+    StatsIte ite = client_stats.find(tid);
+
+    if (ite != client_stats.end()) {
+        assert(ite->second.second == source);
+        if (!--ite->second.first) {
+            target = source;
+            client_stats.erase(ite);
+
+            /* keep the history of the thread */
+            target->Merge(&retired_stats);
+        }
+    } else {
+        LOG(FATAL) << "invalid local client stats";
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+
+    if (target) { delete target; }
+}
+
+void merge_client_stats(StatsMap *stats)
+{
+    pthread_mutex_lock(&client_mutex);
+
+    StatsIte ite = client_stats.begin();
+    for (; ite != client_stats.end(); ++ite) {
+        ite->second.second->Merge(stats);
+    }
+
+    StatsMap::const_iterator rit = retired_stats.begin();
+    for (; rit != retired_stats.end(); ++rit) {
+        (*stats)[rit->first].Merge(rit->second);
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+}
+
+} // namespace qrpc
@@ -0,0 +1,160 @@
+#ifndef QRPC_RPC_STATS_H
+#define QRPC_RPC_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+
+#include "src/qrpc/util/compiler.h"
+
+namespace qrpc {
+
+/*
+ * The log-linear (HDR style) histogram, every power of two is
+ * split into kHistSubBuckets linear buckets, so the relative
+ * error of the recorded value is less than 1/kHistSubBuckets.
+ *
+ * The values are in cycles of rdtsc, which is converted to
+ * nanoseconds while reporting.
+ */
+static const int kHistSubBits = 4;
+static const int kHistSubBuckets = 1 << kHistSubBits;
+static const int kHistMaxBits = 48;
+static const int kHistBuckets = (kHistMaxBits - kHistSubBits + 1) * kHistSubBuckets;
+
+/* the error codes counted one by one, the others share the last */
+static const int kStatsCodes = 32;
+
+class Histogram {
+public:
+    Histogram() { Clear(); }
+
+    void Clear() { memset(this, 0, sizeof(*this)); }
+
+    __always_inline void Add(uint64_t value) {
+        ++buckets_[Index(value)];
+        ++count_;
+        sum_ += value;
+        if (unlikely(value > max_)) {
+            max_ = value;
+        }
+    }
+
+    void Merge(const Histogram &other);
+
+    /* the upper bound of the bucket at percentile p (0 ~ 1) */
+    uint64_t Percentile(double p) const;
+
+    /* the count of buckets whose upper bound isn't above value */
+    uint64_t CountBelow(uint64_t value) const;
+
+    uint64_t count()          const { return count_;      }
+    uint64_t sum()            const { return sum_;        }
+    uint64_t max()            const { return max_;        }
+    uint64_t bucket(int i)    const { return buckets_[i]; }
+
+    static __always_inline int Index(uint64_t value) {
+        if (value < (uint64_t)kHistSubBuckets) {
+            return value;
+        }
+        if (unlikely(value >> kHistMaxBits)) {
+            value = (1ULL << kHistMaxBits) - 1;
+        }
+
+        int shift = 63 - __builtin_clzll(value) - kHistSubBits;
+        return ((shift + 1) << kHistSubBits)
+             + ((value >> shift) & (kHistSubBuckets - 1));
+    }
+
+    /* the largest value of the bucket */
+    static uint64_t Upper(int index);
+
+private:
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+    uint64_t buckets_[kHistBuckets];
+};
+
+/*
+ * The counters of one method, written by the owner thread only.
+ * The readers aggregate them without locking, so the snapshot is
+ * approximate but never blocks the hot path.
+ */
+class MethodStats {
+public:
+    MethodStats() { memset(errors_, 0, sizeof(errors_)); }
+
+    __always_inline void Record(uint32_t code, uint64_t cycles) {
+        latency_.Add(cycles);
+        if (unlikely(code)) {
+            ++errors_[code < (uint32_t)kStatsCodes ? code : kStatsCodes - 1];
+        }
+    }
+
+    void Merge(const MethodStats &other);
+
+    uint64_t count()          const { return latency_.count(); }
+    uint64_t errors(int code) const { return errors_[code];    }
+    const Histogram& latency() const { return latency_;        }
+
+private:
+    Histogram latency_;
+    uint64_t errors_[kStatsCodes];
+};
+
+/* the aggregation keyed by the full name of method */
+typedef std::map<std::string, MethodStats> StatsMap;
+
+/*
+ * The stats of methods owned by one thread (worker or channel thread),
+ * the lock only guards inserting new methods against the readers.
+ */
+class StatsTable {
+public:
+    StatsTable();
+    ~StatsTable();
+
+    /* the stats of method, created if not exists, owner thread only */
+    MethodStats* Get(const google::protobuf::MethodDescriptor *method) {
+        TableIte ite = table_.find(method);
+        if (likely(ite != table_.end())) {
+            return ite->second;
+        }
+        return Insert(method);
+    }
+
+    /* merge into the aggregation, called by any thread */
+    void Merge(StatsMap *stats) const;
+
+private:
+    MethodStats* Insert(const google::protobuf::MethodDescriptor *method);
+
+private:
+    typedef std::map<const google::protobuf::MethodDescriptor *,
+                     MethodStats *> Table;
+    typedef Table::iterator TableIte;
+
+    Table table_;
+    mutable pthread_mutex_t mutex_;
+
+private:
+    /* No copying allowed */
+    StatsTable(const StatsTable &);
+    void operator=(const StatsTable &);
+};
+
+/* the client stats shared by the channels of the same thread */
+extern StatsTable* new_client_stats_if_not(pthread_t tid);
+extern void del_client_stats_if_zero(StatsTable *table, pthread_t tid);
+
+/* merge the client stats of the process, including the released */
+extern void merge_client_stats(StatsMap *stats);
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_STATS_H */
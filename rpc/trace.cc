@@ -0,0 +1,135 @@
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "src/qrpc/util/log.h"
+#include "src/qrpc/util/cycles.h"
+#include "src/qrpc/rpc/trace.h"
+
+using namespace std;
+
+namespace qrpc {
+
+static __thread TraceContext tls_trace;
+static __thread TraceRing *tls_trace_ring = NULL;
+static __thread uint64_t tls_trace_seed = 0;
+
+static TraceRing shared_trace_ring(kTraceRingSize);
+
+const TraceContext& current_trace()
+{
+    return tls_trace;
+}
+
+/*
+ * xorshift64* seeded by the thread, the random() of util
+ * shares its state among threads without locking.
+ */
+uint64_t new_trace_id()
+{
+    uint64_t x = tls_trace_seed;
+
+    if (!x) {
+        x = rdtsc() ^ ((uint64_t)syscall(SYS_gettid) << 32);
+        x |= 1;
+    }
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    tls_trace_seed = x;
+
+    uint64_t id = x * 2685821657736338717ULL;
+    return id ? id : 1;
+}
+
+// -------------------------------------------------------------
+// class TraceScope
+// -------------------------------------------------------------
+
+TraceScope::TraceScope(const TraceContext &context)
+    : saved_(tls_trace)
+{
+    tls_trace = context;
+}
+
+TraceScope::~TraceScope()
+{
+    tls_trace = saved_;
+}
+
+// -------------------------------------------------------------
+// class TraceRing
+// -------------------------------------------------------------
+
+TraceRing::TraceRing(int capacity)
+    : next_(0)
+{
+    assert(capacity > 0);
+
+    ring_.reserve(capacity);
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+TraceRing::~TraceRing()
+{
+    pthread_mutex_destroy(&mutex_);
+}
+
+void TraceRing::Add(const TraceSpan &span)
+{
+    pthread_mutex_lock(&mutex_);
+
+    if (ring_.size() < ring_.capacity()) {
+        ring_.push_back(span);
+    } else {
+        ring_[next_] = span;
+    }
+    next_ = (next_ + 1) % ring_.capacity();
+
+    pthread_mutex_unlock(&mutex_);
+}
+
+void TraceRing::Dump(uint64_t trace_id, vector<TraceSpan> *spans) const
+{
+    pthread_mutex_lock(&mutex_);
+
+    size_t num = ring_.size();
+    for (size_t i = 1; i <= num; i++) {
+        const TraceSpan &span = ring_[(next_ + num - i) % num];
+        if (!trace_id || span.trace_id == trace_id) {
+            spans->push_back(span);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex_);
+}
+
+// -------------------------------------------------------------
+// the rings of threads
+// -------------------------------------------------------------
+
+void set_thread_trace_ring(TraceRing *ring)
+{
+    tls_trace_ring = ring;
+}
+
+void record_trace_span(const TraceSpan &span)
+{
+    if (tls_trace_ring) {
+        tls_trace_ring->Add(span);
+    } else {
+        shared_trace_ring.Add(span);
+    }
+}
+
+TraceRing* process_trace_ring()
+{
+    return &shared_trace_ring;
+}
+
+} // namespace qrpc
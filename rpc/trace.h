@@ -0,0 +1,90 @@
+#ifndef QRPC_RPC_TRACE_H
+#define QRPC_RPC_TRACE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+namespace qrpc {
+
+/* the spans kept by each worker, and by the other threads together */
+static const int kTraceRingSize = 1024;
+
+/*
+ * The trace context propagated in MsgMeta, trace_id is 0 if
+ * the request isn't traced. It's kept POD for the thread local.
+ */
+struct TraceContext {
+    uint64_t trace_id;
+    uint64_t span_id;
+    bool sampled;
+};
+
+/* the context of the handler running in this thread */
+extern const TraceContext& current_trace();
+
+/* a new non-zero random id of trace or span */
+extern uint64_t new_trace_id();
+
+/*
+ * Run the handler in the context, the client calls made inside
+ * it become the children of the server span.
+ */
+class TraceScope {
+public:
+    explicit TraceScope(const TraceContext &context);
+    ~TraceScope();
+
+private:
+    TraceContext saved_;
+};
+
+struct TraceSpan {
+    uint64_t trace_id;
+    uint64_t span_id;
+    uint64_t parent_span;
+    std::string method;
+    bool server;
+    uint32_t code;
+    uint64_t start_us;      /* the wall time since epoch */
+    uint64_t duration_ns;
+
+    TraceSpan()
+        : trace_id(0), span_id(0), parent_span(0), server(false)
+        , code(0), start_us(0), duration_ns(0) { }
+};
+
+class TraceRing {
+public:
+    explicit TraceRing(int capacity);
+    ~TraceRing();
+
+    void Add(const TraceSpan &span);
+
+    /* copy the spans of trace (all if 0) from the newest */
+    void Dump(uint64_t trace_id, std::vector<TraceSpan> *spans) const;
+
+private:
+    size_t next_;
+    std::vector<TraceSpan> ring_;
+    mutable pthread_mutex_t mutex_;
+
+private:
+    /* No copying allowed */
+    TraceRing(const TraceRing &);
+    void operator=(const TraceRing &);
+};
+
+/* bind the ring of worker to its thread */
+extern void set_thread_trace_ring(TraceRing *ring);
+
+/* record the finished span into the ring of this thread */
+extern void record_trace_span(const TraceSpan &span);
+
+/* the ring of the threads which aren't workers */
+extern TraceRing* process_trace_ring();
+
+} // namespace qrpc
+
+#endif /* QRPC_RPC_TRACE_H */
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include <vector>
 #include <string>
 #include <tr1/functional>
@@ -30,6 +31,12 @@
 #include "src/qrpc/rpc/message.h"
 #include "src/qrpc/rpc/connection.h"
 #include "src/qrpc/rpc/compressor.h"
+#include "src/qrpc/rpc/stats.h"
+#include "src/qrpc/rpc/rpcz.h"
+#include "src/qrpc/rpc/trace.h"
+#include "src/qrpc/rpc/loop_monitor.h"
+#include "src/qrpc/rpc/limiter.h"
+#include "src/qrpc/rpc/ready_queue.h"
 #include "src/qrpc/rpc/builtin.h"
 #include "src/qrpc/rpc/server.h"
 #include "src/qrpc/rpc/server_impl.h"
@@ -39,6 +46,9 @@ using namespace std;
 
 namespace qrpc {
 
+/* the time to serve the ready queue before polling the sockets */
+static const int kReadySliceUsec = 1000;
+
 namespace {
 
 string new_thread_name()
@@ -54,12 +64,68 @@ string new_thread_name()
 
 } // anonymous namespace
 
-Worker::Worker(ServerImpl *server)
+Worker::Worker(ServerImpl *server, int index)
     : server_(server)
+    , index_(index)
     , compressor_(NULL)
+    , stats_(NULL)
+    , rpcz_(NULL)
+    , traces_(NULL)
+    , loop_(NULL)
+    , ready_(NULL)
+    , delay_(NULL)
+    , ready_armed_(false)
+    , slice_(usec_to_cycles(kReadySliceUsec))
+    , queued_(0)
+    , shed_(0)
+    , held_requests_(0)
+    , held_bytes_(0)
     , bg_thread_(NULL)
 {
-    bg_thread_ = new Thread(new_thread_name(),
+    pthread_mutex_init(&mutex_, NULL);
+
+    stats_ = new StatsTable();
+    if (!stats_) {
+        LOG(FATAL) << "create stats table failed!!!";
+    }
+
+    const ServerOptions &opt = server->options();
+    if (opt.rpcz_sample_rate) {
+        rpcz_ = new RpczRing(opt.rpcz_sample_rate, opt.rpcz_capacity);
+        if (!rpcz_) {
+            LOG(FATAL) << "create rpcz ring failed!!!";
+        }
+    }
+
+    traces_ = new TraceRing(kTraceRingSize);
+    if (!traces_) {
+        LOG(FATAL) << "create trace ring failed!!!";
+    }
+
+    if (opt.priority_queue || opt.queue_delay_target_usec ||
+        opt.fair_queue) {
+        ready_ = new ReadyQueue(server);
+        if (!ready_) {
+            LOG(FATAL) << "create ready queue failed!!!";
+        }
+    }
+
+    if (opt.queue_delay_target_usec) {
+        delay_ = new QueueDelay(opt.queue_delay_target_usec,
+                                opt.queue_delay_interval_usec);
+        if (!delay_) {
+            LOG(FATAL) << "create queue delay failed!!!";
+        }
+    }
+
+    string name = new_thread_name();
+
+    loop_ = new LoopMonitor(name, opt.slow_callback_usec);
+    if (!loop_) {
+        LOG(FATAL) << "create loop monitor failed!!!";
+    }
+
+    bg_thread_ = new Thread(name,
             tr1::bind(&Worker::InitWorker, this, tr1::placeholders::_1),
             tr1::bind(&Worker::ExitWorker, this, tr1::placeholders::_1));
     if (!bg_thread_) {
@@ -70,8 +136,17 @@ Worker::Worker(ServerImpl *server)
 Worker::~Worker()
 {
     delete bg_thread_;
+    delete stats_;
+    delete rpcz_;
+    delete traces_;
+    delete loop_;
+    delete delay_;
+    delete ready_;
 
     assert(clients_.empty() == true);
+    assert(queued_ == 0);
+
+    pthread_mutex_destroy(&mutex_);
 }
 
 void Worker::InitWorker(Thread *thr)
@@ -82,6 +157,19 @@ void Worker::InitWorker(Thread *thr)
         LOG(FATAL) << "create compressor failed!!!";
     }
 
+    /* the spans of handlers and their client calls */
+    set_thread_trace_ring(traces_);
+
+    loop_->Bind(thr->base());
+    thr->ev_queue()->SetMonitor(tr1::bind(&LoopMonitor::OnTask, loop_,
+            tr1::placeholders::_1, tr1::placeholders::_2,
+            tr1::placeholders::_3));
+
+    if (ready_ &&
+        event_assign(&ready_event_, thr->base(), -1, 0, HandleReady, this)) {
+        LOG(FATAL) << "set event failed!!!";
+    }
+
     const ServerOptions &opt = server_->options();
     opt.init_cb(thr);
 }
@@ -92,11 +180,28 @@ void Worker::ExitWorker(Thread *thr)
     const ServerOptions &opt = server_->options();
     opt.exit_cb(thr);
 
+    /* the connections are released after their requests */
+    if (ready_) {
+        event_del(&ready_event_);
+        ready_armed_ = false;
+
+        while (!ready_->empty()) {
+            ServerMessage *msg = ready_->Pop(false);
+            queued_--;
+            msg->DropMethod(kErrCancel);
+        }
+    }
+
     while (!clients_.empty()) {
         ClientQueue::iterator it = clients_.begin();
         it->second->Close();
     }
     delete compressor_;
+
+    set_thread_trace_ring(NULL);
+
+    /* the event base is freed after it */
+    loop_->Bind(NULL);
 }
 
 void Worker::Link(::qrpc::Link *cmd)
@@ -120,7 +225,9 @@ void Worker::HandleLink(::qrpc::Link *cmd)
         return;
     }
 
+    pthread_mutex_lock(&mutex_);
     clients_.insert(Client(conn, conn));
+    pthread_mutex_unlock(&mutex_);
 }
 
 void Worker::Listen(::qrpc::Listen *cmd)
@@ -143,10 +250,73 @@ void Worker::HandleListen(::qrpc::Listen *cmd)
     cmd->work_.Signal();
 }
 
+void Worker::LocalCall(::qrpc::LocalCall *cmd)
+{
+    EvQueue *evq = bg_thread_->ev_queue();
+    if (!evq->Push(cmd)) {
+        /* the worker is exiting, and the RPC will be timeout */
+        delete cmd;
+    }
+}
+
+void Worker::HandleLocalCall(::qrpc::LocalCall *cmd)
+{
+    ServerMessage *msg = new ServerMessage(this, cmd->peer_, cmd->created_);
+    if (!msg) {
+        LOG(FATAL) << "alloc server message failed!!!";
+    }
+
+    bool rc;
+    if (cmd->request_) {
+        rc = msg->ParseFromMessage(cmd->request_, cmd->meta_);
+        cmd->request_ = NULL;
+    } else {
+        rc = msg->ParseFromArray(cmd->data_.data(),
+                                 cmd->data_.size(), cmd->meta_);
+    }
+
+    /* for the cancel of it */
+    if (rc) {
+        cmd->peer_->Add(msg);
+    }
+
+    delete cmd;
+
+    if (rc) {
+        Serve(msg);
+    } else {
+        msg->RejectMethod();
+    }
+}
+
+void Worker::LocalCancel(::qrpc::LocalCancel *cmd)
+{
+    EvQueue *evq = bg_thread_->ev_queue();
+    if (!evq->Push(cmd)) {
+        /* the worker is exiting */
+        delete cmd;
+    }
+}
+
+/* as ServerConnection::OnRpcCancel() */
+void Worker::HandleLocalCancel(::qrpc::LocalCancel *cmd)
+{
+    ServerMessage *msg = cmd->peer_->Find(cmd->sequence_);
+    if (msg) {
+        msg->CancelMethod();
+    } else {
+        DLOG(INFO) << "find a delayed cancel request RPC";
+    }
+
+    delete cmd;
+}
+
 void Worker::Unlink(ServerConnection *conn)
 {
     ClientQueue::iterator it;
 
+    pthread_mutex_lock(&mutex_);
+
     it = clients_.find(conn);
     if (it != clients_.end()) {
         clients_.erase(it);
@@ -154,7 +324,145 @@ void Worker::Unlink(ServerConnection *conn)
         LOG(FATAL) << "invalid client";
     }
 
+    pthread_mutex_unlock(&mutex_);
+
     delete conn;
 }
 
+void Worker::Serve(ServerMessage *msg)
+{
+    if (!ready_ || !msg->admitted()) {
+        loop_->Note(&msg->method()->full_name());
+        msg->Stamp(kRpczHandler);
+        msg->CallMethod();
+        return;
+    }
+
+    ready_->Push(msg);
+    queued_++;
+
+    /* behind the events being handled */
+    if (!ready_armed_) {
+        ready_armed_ = true;
+        event_active(&ready_event_, EV_TIMEOUT, 0);
+    }
+}
+
+void Worker::HandleReady(int fd, short flags, void *arg)
+{
+    Worker *me = (Worker *)arg;
+    me->ServeReady();
+}
+
+void Worker::ServeReady()
+{
+    uint64_t start = loop_->Begin();
+    uint64_t now = start;
+
+    ready_armed_ = false;
+
+    while (queued_) {
+        if (delay_) {
+            delay_->Sample(now - ready_->Oldest(), now);
+            if (delay_->overloaded()) {
+                ShedReady(now);
+                if (!queued_) {
+                    break;
+                }
+            }
+        }
+
+        /* the newest one in overload, it may still meet the deadline */
+        ServerMessage *msg = ready_->Pop(overloaded());
+        queued_--;
+
+        CallReady(msg);
+
+        now = rdtsc();
+        if (now - start >= slice_) {
+            break;
+        }
+    }
+
+    /* poll the sockets before the rest */
+    if (queued_) {
+        struct timeval tv = { 0, 0 };
+        ready_armed_ = true;
+        evtimer_add(&ready_event_, &tv);
+    }
+
+    loop_->EndCallback(start, "ready queue");
+}
+
+/* drop the non-critical requests waited too long */
+void Worker::ShedReady(uint64_t now)
+{
+    vector<ServerMessage *> shed;
+    ready_->Shed(delay_, now, &shed);
+
+    for (size_t i = 0; i < shed.size(); i++) {
+        queued_--;
+        shed_++;
+        shed[i]->DropMethod(kErrOverload);
+    }
+}
+
+void Worker::CallReady(ServerMessage *msg)
+{
+    ServerConnection *conn = msg->server_connection();
+
+    /* nobody waits for the response */
+    if (conn && !conn->connected()) {
+        msg->DropMethod(kErrCancel);
+        return;
+    }
+
+    /* the client has canceled it, e.g. the loser of hedged calls */
+    if (unlikely(msg->canceled())) {
+        msg->DropMethod(kErrCancel);
+        return;
+    }
+
+    loop_->Note(&msg->method()->full_name());
+    msg->Stamp(kRpczHandler);
+    msg->CallMethod();
+}
+
+bool Worker::overloaded() const
+{
+    return delay_ && delay_->overloaded();
+}
+
+size_t Worker::num_connections()
+{
+    pthread_mutex_lock(&mutex_);
+    size_t num = clients_.size();
+    pthread_mutex_unlock(&mutex_);
+
+    return num;
+}
+
+void Worker::DumpConnections(int index, std::string *out)
+{
+    char line[512];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&mutex_);
+
+    for (ClientQueue::iterator it = clients_.begin();
+         it != clients_.end(); ++it) {
+        ServerConnection *conn = it->second;
+
+        snprintf(line, sizeof(line), "%d\t%s\t%s\t%s\t%llu\t%ld\n",
+                 index, conn->transport(),
+                 conn->local_addr().c_str(),
+                 conn->remote_addr().c_str(),
+                 (unsigned long long)conn->requests(),
+                 (long)(now - conn->created()));
+        out->append(line);
+    }
+
+    pthread_mutex_unlock(&mutex_);
+}
+
 } // namespace qrpc
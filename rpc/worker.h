@@ -11,13 +11,22 @@
 #include "src/qrpc/util/timer.h"
 #include "src/qrpc/util/thread.h"
 #include "src/qrpc/util/event_queue.h"
+#include "src/qrpc/rpc/controller.h"
 
 namespace qrpc {
 
 class Compressor;
+class StatsTable;
+class RpczRing;
+class TraceRing;
+class LoopMonitor;
+class QueueDelay;
+class ReadyQueue;
 class Quit;
 class Link;
 class Listen;
+class LocalCall;
+class LocalCancel;
 class Server;
 class ServerImpl;
 class Message;
@@ -27,7 +36,7 @@ class ServerConnection;
 
 class Worker {
 public:
-    explicit Worker(ServerImpl *server);
+    Worker(ServerImpl *server, int index);
     ~Worker();
 
     /* handle link socket */
@@ -38,11 +47,42 @@ public:
     void Listen(::qrpc::Listen *cmd);
     void HandleListen(::qrpc::Listen *cmd);
 
+    /* handle request of in-process channel */
+    void LocalCall(::qrpc::LocalCall *cmd);
+    void HandleLocalCall(::qrpc::LocalCall *cmd);
+
+    /* handle cancel of in-process channel */
+    void LocalCancel(::qrpc::LocalCancel *cmd);
+    void HandleLocalCancel(::qrpc::LocalCancel *cmd);
+
     void Unlink(ServerConnection *conn);
 
+    /* call the parsed request, or queue it if the queue delay is on */
+    void Serve(ServerMessage *msg);
+
+    /* the requests read and not answered, for the flow credits */
+    void Hold(int bytes)   { held_requests_++; held_bytes_ += bytes; }
+    void Unhold(int bytes) { held_requests_--; held_bytes_ -= bytes; }
+    uint64_t held_requests() const { return held_requests_; }
+    uint64_t held_bytes() const    { return held_bytes_;    }
+
+    /* the ready queue for diagnostics, called by any thread */
+    int queued() const { return queued_; }
+    uint64_t shed() const { return shed_; }
+    bool overloaded() const;
+
+    /* the connections for diagnostics, called by any thread */
+    size_t num_connections();
+    void DumpConnections(int index, std::string *out);
+
 public:
+    int         index() const { return index_;                 }
     ServerImpl* server_impl() { return server_;                }
     Compressor* compressor()  { return compressor_;            }
+    StatsTable* stats()       { return stats_;                 }
+    RpczRing*   rpcz()        { return rpcz_;                  }
+    TraceRing*  traces()      { return traces_;                }
+    LoopMonitor* loop()       { return loop_;                  }
     event_base* base()        { return bg_thread_->base();     }
     Thread*     thread()      { return bg_thread_;             }
     EvQueue*    ev_queue()    { return bg_thread_->ev_queue(); }
@@ -54,6 +94,13 @@ private:
     /* exit thread local variable */
     void ExitWorker(Thread *thr);
 
+    /* call the queued requests for a time slice */
+    void ServeReady();
+    void ShedReady(uint64_t now);
+    void CallReady(ServerMessage *msg);
+
+    static void HandleReady(int fd, short flags, void *arg);
+
 private:
     typedef std::pair<void *, ServerConnection *> Client;
     typedef std::map<void *, ServerConnection *> ClientQueue;
@@ -61,12 +108,41 @@ private:
 private:
     ServerImpl *server_;
 
-    /* peer connections */
+    /* the order in the workers of server, for the sharded limits */
+    int index_;
+
+    /* peer connections, locked against the diagnostics */
     ClientQueue clients_;
+    pthread_mutex_t mutex_;
 
     /* thread based compressor */
     Compressor *compressor_;
 
+    /* the server stats of methods */
+    StatsTable *stats_;
+
+    /* the sampled requests, NULL if disabled */
+    RpczRing *rpcz_;
+
+    /* the trace spans recorded by this thread */
+    TraceRing *traces_;
+
+    /* the measure of event loop */
+    LoopMonitor *loop_;
+
+    /* the parsed requests, NULL if they are called at once */
+    ReadyQueue *ready_;
+    QueueDelay *delay_;
+    event ready_event_;
+    bool ready_armed_;
+    uint64_t slice_;
+    volatile int queued_;
+    volatile uint64_t shed_;
+
+    /* the requests of connections in process */
+    uint64_t held_requests_;
+    uint64_t held_bytes_;
+
     /* event queue based thread */
     Thread *bg_thread_;
 
@@ -35,6 +35,9 @@ namespace qrpc {
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #endif
 
+/** Hint the CPU that it's in a spin-wait loop */
+#define cpu_relax() __asm__ __volatile__("rep; nop": : :"memory")
+
 #ifndef __always_inline
 #define __always_inline inline __attribute__((always_inline))
 #endif
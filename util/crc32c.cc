@@ -3,11 +3,19 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 //
 // A portable implementation of crc32c, optimized to handle
-// four bytes at a time.
+// four bytes at a time, and an implementation based on the SSE4.2
+// crc32 instruction which is chosen at runtime by CPUID.
 
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
 
 #include "src/qrpc/util/coding.h"
+#include "src/qrpc/util/compiler.h"
 #include "src/qrpc/util/crc32c.h"
 
 namespace qrpc {
@@ -286,7 +294,7 @@ static inline uint32_t LE_LOAD32(const uint8_t *p)
     return DecodeFixed32(reinterpret_cast<const char*>(p));
 }
 
-uint32_t Extend(uint32_t crc, const char *buf, size_t size)
+static uint32_t ExtendPortable(uint32_t crc, const char *buf, size_t size)
 {
     const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
     const uint8_t *e = p + size;
@@ -332,5 +340,172 @@ uint32_t Extend(uint32_t crc, const char *buf, size_t size)
     return l ^ 0xffffffffu;
 }
 
-} // namespace qrpc
+#if defined(__x86_64__)
+
+// The reflected crc32c polynomial
+static const uint32_t kPoly = 0x82f63b78u;
+
+// The block size (bytes) of the 3-way interleaved loops.
+static const size_t kLongBlock = 8192;
+static const size_t kShortBlock = 256;
+
+// The constants to shift a crc over 'block' and '2 * block' zero bytes.
+static uint64_t long_shift1_, long_shift2_;
+static uint64_t short_shift1_, short_shift2_;
+
+// Return x^n mod P in the reflected representation.
+static uint32_t XPowModP(size_t n)
+{
+    uint32_t r = 0x80000000u;
+
+    while (n--) {
+        r = (r & 1) ? ((r >> 1) ^ kPoly) : (r >> 1);
+    }
+
+    return r;
+}
+
+static void InitShiftConstants()
+{
+    // clmul and a crc32 of 8 bytes multiply the crc by x^33 in total
+    long_shift1_ = XPowModP(kLongBlock * 8 - 33);
+    long_shift2_ = XPowModP(kLongBlock * 16 - 33);
+    short_shift1_ = XPowModP(kShortBlock * 8 - 33);
+    short_shift2_ = XPowModP(kShortBlock * 16 - 33);
+}
+
+static inline uint64_t LE_LOAD64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t ExtendWords(uint32_t l, const uint8_t *p, size_t n)
+{
+    uint64_t l64 = l;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        l64 = _mm_crc32_u64(l64, LE_LOAD64(p));
+    }
+    l = (uint32_t)l64;
+    for (; n; --n) {
+        l = _mm_crc32_u8(l, *p++);
+    }
+
+    return l;
+}
+
+// Process three blocks in parallel to hide the latency of the crc32
+// instruction, and merge the crcs of blocks with carry-less multiply.
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t Extend3Way(uint32_t l, const uint8_t **pp, size_t *n,
+                                  size_t block, uint64_t shift1, uint64_t shift2)
+{
+    const uint8_t *p = *pp;
 
+    while (*n >= block * 3) {
+        uint64_t a = l, b = 0, c = 0;
+
+        for (size_t i = 0; i < block; i += 8) {
+            a = _mm_crc32_u64(a, LE_LOAD64(p + i));
+            b = _mm_crc32_u64(b, LE_LOAD64(p + block + i));
+            c = _mm_crc32_u64(c, LE_LOAD64(p + block * 2 + i));
+        }
+
+        __m128i ka = _mm_clmulepi64_si128(_mm_cvtsi64_si128(a),
+                                          _mm_cvtsi64_si128(shift2), 0);
+        __m128i kb = _mm_clmulepi64_si128(_mm_cvtsi64_si128(b),
+                                          _mm_cvtsi64_si128(shift1), 0);
+        uint64_t v = _mm_cvtsi128_si64(_mm_xor_si128(ka, kb));
+
+        l = (uint32_t)_mm_crc32_u64(0, v) ^ (uint32_t)c;
+
+        p += block * 3;
+        *n -= block * 3;
+    }
+
+    *pp = p;
+    return l;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t ExtendSSE42(uint32_t crc, const char *buf, size_t size)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
+    uint32_t l = crc ^ 0xffffffffu;
+
+    // Process bytes until p is 8-byte aligned
+    while (size && (reinterpret_cast<uintptr_t>(p) & 7)) {
+        l = _mm_crc32_u8(l, *p++);
+        --size;
+    }
+
+    l = ExtendWords(l, p, size);
+
+    return l ^ 0xffffffffu;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t ExtendPCLMUL(uint32_t crc, const char *buf, size_t size)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
+    uint32_t l = crc ^ 0xffffffffu;
+
+    // Process bytes until p is 8-byte aligned
+    while (size && (reinterpret_cast<uintptr_t>(p) & 7)) {
+        l = _mm_crc32_u8(l, *p++);
+        --size;
+    }
+
+    l = Extend3Way(l, &p, &size, kLongBlock, long_shift1_, long_shift2_);
+    l = Extend3Way(l, &p, &size, kShortBlock, short_shift1_, short_shift2_);
+    l = ExtendWords(l, p, size);
+
+    return l ^ 0xffffffffu;
+}
+
+#endif // __x86_64__
+
+typedef uint32_t (*ExtendFunc)(uint32_t, const char *, size_t);
+
+static ExtendFunc ChooseExtend()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse4.2")) {
+        if (__builtin_cpu_supports("pclmul")) {
+            InitShiftConstants();
+            return ExtendPCLMUL;
+        }
+        return ExtendSSE42;
+    }
+#endif
+
+    return ExtendPortable;
+}
+
+static const ExtendFunc extend_ = ChooseExtend();
+
+uint32_t Extend(uint32_t crc, const char *buf, size_t size)
+{
+    // Calls from other static initializers may run before extend_ is set
+    if (unlikely(!extend_)) {
+        return ChooseExtend()(crc, buf, size);
+    }
+    return extend_(crc, buf, size);
+}
+
+bool IsHardwareAccelerated()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+} // namespace qrpc
@@ -15,6 +15,10 @@ namespace qrpc {
 // crc32c of a stream of data.
 extern uint32_t Extend(uint32_t init_crc, const char *data, size_t n);
 
+// Return true if the crc32c is calculated by the SSE4.2 crc32
+// instruction instead of the portable table-driven implementation.
+extern bool IsHardwareAccelerated();
+
 // Return the crc32c of data[0,n-1]
 inline uint32_t Value(const char *data, size_t n)
 {
@@ -0,0 +1,67 @@
+#include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "src/qrpc/util/cycles.h"
+
+namespace qrpc {
+
+static double cycles_per_usec_ = 0;
+static pthread_once_t cycles_once_ = PTHREAD_ONCE_INIT;
+
+static uint64_t monotonic_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* busy wait about 10 milliseconds against the monotonic clock */
+static void calibrate_cycles()
+{
+    uint64_t ns0 = monotonic_nsec();
+    uint64_t tsc0 = rdtsc();
+    uint64_t ns1 = ns0;
+
+    while (ns1 - ns0 < 10000000) {
+        ns1 = monotonic_nsec();
+    }
+    uint64_t tsc1 = rdtsc();
+
+    cycles_per_usec_ = (double)(tsc1 - tsc0) * 1000 / (ns1 - ns0);
+    if (cycles_per_usec_ < 1) {
+        cycles_per_usec_ = 1;
+    }
+}
+
+double cycles_per_usec()
+{
+    pthread_once(&cycles_once_, calibrate_cycles);
+    return cycles_per_usec_;
+}
+
+uint64_t cycles_to_usec(uint64_t cycles)
+{
+    return (uint64_t)(cycles / cycles_per_usec());
+}
+
+uint64_t cycles_to_nsec(uint64_t cycles)
+{
+    return (uint64_t)(cycles * (1000 / cycles_per_usec()));
+}
+
+uint64_t usec_to_cycles(uint64_t usec)
+{
+    return (uint64_t)(usec * cycles_per_usec());
+}
+
+uint64_t wall_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+} // namespace qrpc
@@ -0,0 +1,35 @@
+#ifndef QRPC_UTIL_CYCLES_H
+#define QRPC_UTIL_CYCLES_H
+
+#include <stdint.h>
+
+#include "src/qrpc/util/compiler.h"
+
+namespace qrpc {
+
+/* the time stamp counter, cheap enough for the hot path */
+static __always_inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* the cycles per microsecond, calibrated on the first call */
+extern double cycles_per_usec();
+
+/* convert the cycles to microseconds */
+extern uint64_t cycles_to_usec(uint64_t cycles);
+
+/* convert the cycles to nanoseconds */
+extern uint64_t cycles_to_nsec(uint64_t cycles);
+
+/* convert the microseconds to cycles */
+extern uint64_t usec_to_cycles(uint64_t usec);
+
+/* the wall time in microseconds since epoch */
+extern uint64_t wall_usec();
+
+} // namespace qrpc
+
+#endif /* QRPC_UTIL_CYCLES_H */
@@ -9,6 +9,7 @@
 
 #include "src/qrpc/util/log.h"
 #include "src/qrpc/util/compiler.h"
+#include "src/qrpc/util/cycles.h"
 #include "src/qrpc/util/task.h"
 #include "src/qrpc/util/event_queue.h"
 
@@ -54,9 +55,11 @@ bool EvQueue::Push(Task *task)
         return false;
     }
 
+    uint64_t now = rdtsc();
+
     pthread_mutex_lock(&mutex_);
     bool empty = queue_.empty();
-    queue_.push(task);
+    queue_.push(make_pair(task, now));
     pthread_mutex_unlock(&mutex_);
 
     while (empty) {
@@ -76,7 +79,7 @@ void EvQueue::Clear()
             pthread_mutex_unlock(&mutex_);
             break;
         }
-        Task *task = queue_.front();
+        Task *task = queue_.front().first;
         queue_.pop();
         pthread_mutex_unlock(&mutex_);
 
@@ -97,11 +100,20 @@ void EvQueue::OnEvent(int fd, short events, void *arg)
             pthread_mutex_unlock(&me->mutex_);
             break;
         }
-        Task *task = me->queue_.front();
+        Task *task = me->queue_.front().first;
+        uint64_t pushed = me->queue_.front().second;
+        size_t depth = me->queue_.size();
         me->queue_.pop();
         pthread_mutex_unlock(&me->mutex_);
 
+        if (!me->monitor_) {
+            (*task)();
+            continue;
+        }
+
+        uint64_t start = rdtsc();
         (*task)();
+        me->monitor_(depth, start - pushed, rdtsc() - start);
     }
 }
 
@@ -1,6 +1,7 @@
 #ifndef QRPC_UTIL_EVENT_QUEUE_H
 #define QRPC_UTIL_EVENT_QUEUE_H
 
+#include <stdint.h>
 #include <string>
 #include <queue>
 #include <event.h>
@@ -13,6 +14,13 @@ class Task;
 
 class EvQueue {
 public:
+    /**
+     * The callback after running each task with the depth of queue
+     * before popping it, and the cycles of waiting and running.
+     */
+    typedef std::tr1::function<void(size_t depth,
+            uint64_t wait, uint64_t run)> Monitor;
+
     explicit EvQueue(event_base *base);
     ~EvQueue();
 
@@ -38,6 +46,9 @@ public:
     /** Stop the event queue */
     void Quit() { quit_ = true; }
 
+    /** Measure the tasks, called in the thread of event base */
+    void SetMonitor(const Monitor &monitor) { monitor_ = monitor; }
+
 private:
     static void OnEvent(int fd, short events, void *arg);
 
@@ -48,7 +59,9 @@ private:
     event_base *base_;
 
     pthread_mutex_t mutex_;
-    std::queue<Task *> queue_;
+    std::queue<std::pair<Task *, uint64_t> > queue_;
+
+    Monitor monitor_;
 
 private:
     /* No copying allowed */
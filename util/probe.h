@@ -0,0 +1,49 @@
+#ifndef QRPC_UTIL_PROBE_H
+#define QRPC_UTIL_PROBE_H
+
+/*
+ * USDT probes of provider qrpc, see the bpftrace scripts in script/.
+ *
+ * A probe is a single nop in the code until a tracer attaches to
+ * it, the arguments are only placed in registers or on stack. The
+ * probes are built if <sys/sdt.h> (systemtap-sdt-dev) is found,
+ * define QRPC_NO_PROBES to leave them out.
+ *
+ *   QRPC_PROBE3(server_finish, msg, conn, code);
+ */
+
+#if !defined(QRPC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define QRPC_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef QRPC_HAVE_PROBES
+
+#include <sys/sdt.h>
+
+#define QRPC_PROBE1(name, a1) \
+    DTRACE_PROBE1(qrpc, name, a1)
+#define QRPC_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(qrpc, name, a1, a2)
+#define QRPC_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(qrpc, name, a1, a2, a3)
+#define QRPC_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(qrpc, name, a1, a2, a3, a4)
+#define QRPC_PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5(qrpc, name, a1, a2, a3, a4, a5)
+#define QRPC_PROBE6(name, a1, a2, a3, a4, a5, a6) \
+    DTRACE_PROBE6(qrpc, name, a1, a2, a3, a4, a5, a6)
+
+#else
+
+#define QRPC_PROBE1(name, a1)                       do { } while (0)
+#define QRPC_PROBE2(name, a1, a2)                   do { } while (0)
+#define QRPC_PROBE3(name, a1, a2, a3)               do { } while (0)
+#define QRPC_PROBE4(name, a1, a2, a3, a4)           do { } while (0)
+#define QRPC_PROBE5(name, a1, a2, a3, a4, a5)       do { } while (0)
+#define QRPC_PROBE6(name, a1, a2, a3, a4, a5, a6)   do { } while (0)
+
+#endif /* QRPC_HAVE_PROBES */
+
+#endif /* QRPC_UTIL_PROBE_H */
@@ -145,6 +145,10 @@ static int resolve_unix(const char *host, struct sockinfo *si)
     size_t len;
     struct sockaddr_un *un;
     
+    if (host[0] != '/') {
+        host += sizeof(UNIX_ADDRPREFIX) - 1;
+    }
+
     len = strlen(host);
     
     if (len >= UNIX_ADDRSTRLEN) {
@@ -172,7 +176,7 @@ static int resolve_unix(const char *host, struct sockinfo *si)
  */
 int resolve_addr(const char *host, int port, struct sockinfo *si)
 {
-    if (host != NULL && host[0] == '/') {
+    if (is_unix_addr(host)) {
         return resolve_unix(host, si);
     }
     
@@ -189,7 +193,7 @@ int resolve_addr(const char *host, int port, std::vector<sockinfo> &sis)
 {
     sis.clear();
 
-    if (host != NULL && host[0] == '/') {
+    if (is_unix_addr(host)) {
         struct sockinfo si;
         int rc = resolve_unix(host, &si);
         if (!rc) {
@@ -214,6 +218,19 @@ const char* unresolve_addr(struct sockaddr *addr, socklen_t addrlen)
     
     int status;
     
+    if (addr->sa_family == AF_UNIX) {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        size_t len = addrlen - offsetof(struct sockaddr_un, sun_path);
+
+        if (addrlen <= offsetof(struct sockaddr_un, sun_path)) {
+            len = 0;
+        }
+        snprintf(unresolve, sizeof(unresolve), "%s%.*s",
+                 UNIX_ADDRPREFIX, (int)strnlen(un->sun_path, len), un->sun_path);
+
+        return unresolve;
+    }
+
     status = getnameinfo(addr, addrlen, host, sizeof(host),
                          service, sizeof(service),
                          NI_NUMERICHOST | NI_NUMERICSERV);
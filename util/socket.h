@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stddef.h>
+#include <string.h>
 #include <vector>
 
 #include <netinet/in.h>
@@ -23,6 +24,10 @@ namespace qrpc {
 #define UNIX_ADDRSTRLEN	\
     (sizeof(struct sockaddr_un) - offsetof(struct sockaddr_un, sun_path))
 
+/* The prefix of unix domain socket address, such as "unix:/tmp/rpc.sock" */
+#define UNIX_ADDRPREFIX "unix:"
+
+inline bool is_unix_addr(const char *host);
 inline int set_blocking(int sd);
 inline int set_nonblocking(int sd);
 inline int set_reuseaddr(int sd);
@@ -54,6 +59,9 @@ struct sockinfo {
  * Resolve a hostname and service by translating it to socket address
  * and return the first address in si.
  *
+ * The host in format of "unix:/path" or "/path" is resolved to
+ * unix domain socket address, and the port is ignored.
+ *
  * This routine is reentrant
  */
 int resolve_addr(const char *host, int port, struct sockinfo *si);
@@ -90,6 +98,19 @@ const char* unresolve_peer_desc(int sd);
  */
 const char* unresolve_desc(int sd);
 
+inline bool is_unix_addr(const char *host)
+{
+    if (host == NULL) {
+        return false;
+    }
+
+    if (host[0] == '/') {
+        return true;
+    }
+
+    return !strncmp(host, UNIX_ADDRPREFIX, sizeof(UNIX_ADDRPREFIX) - 1);
+}
+
 inline int set_blocking(int sd)
 {
     int flags;